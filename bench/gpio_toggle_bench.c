@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cm4_gpio.h"
+
+#define BENCH_DEFAULT_PIN        21
+#define BENCH_DEFAULT_ITERATIONS 1000000U
+
+typedef enum {
+  BENCH_TOGGLE,
+  BENCH_WRITE,
+  BENCH_WRITE_MASK,
+  BENCH_PIN_HANDLE,
+} BenchMethod;
+
+static const char *method_names[] = {
+  "gpio_toggle", "gpio_write", "gpio_write_mask", "gpio_pin_set/clr",
+};
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Each iteration drives one full period, i.e. two edges */
+static double run(BenchMethod method, int pin, const GpioPin *handle,
+                  uint32_t iterations)
+{
+  int bank = pin / 32;
+  uint32_t mask = 1U << (pin % 32);
+
+  double start = now_s();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    switch (method) {
+      case BENCH_TOGGLE:
+        gpio_toggle(pin);
+        gpio_toggle(pin);
+        break;
+      case BENCH_WRITE:
+        gpio_write(pin, 1);
+        gpio_write(pin, 0);
+        break;
+      case BENCH_WRITE_MASK:
+        gpio_write_mask(bank, mask, 0);
+        gpio_write_mask(bank, 0, mask);
+        break;
+      case BENCH_PIN_HANDLE:
+        gpio_pin_set(handle);
+        gpio_pin_clr(handle);
+        break;
+    }
+  }
+
+  return now_s() - start;
+}
+
+int main(int argc, char **argv)
+{
+  int pin = (argc > 1) ? atoi(argv[1]) : BENCH_DEFAULT_PIN;
+  uint32_t iterations = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 0)
+                        : BENCH_DEFAULT_ITERATIONS;
+
+  if (iterations == 0) {
+    printf("usage: %s [pin] [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  StatusCode ret = gpio_regs_init();
+  if ((ret != STATUS_CODE_OK) && (ret != STATUS_CODE_ALREADY_INITIALIZED)) {
+    printf("gpio_regs_init() failed with exit code %d\n", ret);
+    return 1;
+  }
+
+  TRY(gpio_set_mode(pin, GPIO_MODE_OUTPUT));
+
+  GpioPin handle;
+  TRY(gpio_pin_open(pin, &handle));
+
+  printf("toggling gpio %d, %u periods per method\n", pin, iterations);
+
+  for (BenchMethod m = BENCH_TOGGLE; m <= BENCH_PIN_HANDLE; m++) {
+    double elapsed = run(m, pin, &handle, iterations);
+    double edges_per_s = 2.0 * iterations / elapsed;
+
+    printf("%-18s %12.0f edges/s  %8.2f ns/edge  %10.3f MHz square wave\n",
+           method_names[m], edges_per_s, 1e9 / edges_per_s,
+           edges_per_s / 2.0 / 1e6);
+  }
+
+  gpio_write(pin, 0);
+  return 0;
+}
@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cm4_gpio.h"
+#include "cm4_i2c.h"
+#ifdef CM4_GPIO_SIM
+#include "cm4_i2c_sim.h"
+#endif
+
+#define BENCH_DEFAULT_ADDR       0x50
+#define BENCH_DEFAULT_ITERATIONS 200U
+#define BENCH_READ_BYTES         16
+
+typedef struct {
+  I2cBus bus;
+  uint8_t addr;
+  uint32_t iterations;
+  uint32_t failures;
+} BenchJob;
+
+#ifdef CM4_GPIO_SIM
+/* 256 byte register file standing in for an eeprom on each bus */
+typedef struct {
+  uint8_t mem[256];
+  uint8_t ptr;
+} BenchSimEeprom;
+
+static BenchSimEeprom s_eeprom[2];
+
+static StatusCode eeprom_write(void *ctx, const uint8_t *buf, uint16_t len)
+{
+  BenchSimEeprom *e = ctx;
+
+  if (len == 0) {
+    return STATUS_CODE_OK;
+  }
+
+  e->ptr = buf[0];
+  for (uint16_t i = 1; i < len; i++) {
+    e->mem[e->ptr++] = buf[i];
+  }
+  return STATUS_CODE_OK;
+}
+
+static StatusCode eeprom_read(void *ctx, uint8_t *buf, uint16_t len)
+{
+  BenchSimEeprom *e = ctx;
+
+  for (uint16_t i = 0; i < len; i++) {
+    buf[i] = e->mem[e->ptr++];
+  }
+  return STATUS_CODE_OK;
+}
+#endif
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void *bench_job_func(void *arg)
+{
+  BenchJob *job = arg;
+  uint8_t buf[BENCH_READ_BYTES];
+
+  for (uint32_t i = 0; i < job->iterations; i++) {
+    if (i2c_write_then_read(job->bus, job->addr, (uint8_t[]) {0x00}, 1, buf,
+                            sizeof(buf)) != STATUS_CODE_OK) {
+      job->failures++;
+    }
+  }
+
+  return NULL;
+}
+
+static double run_jobs(BenchJob *jobs, int num_jobs)
+{
+  pthread_t threads[2];
+  double start = now_s();
+
+  for (int i = 0; i < num_jobs; i++) {
+    jobs[i].failures = 0;
+    pthread_create(&threads[i], NULL, bench_job_func, &jobs[i]);
+  }
+  for (int i = 0; i < num_jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  return now_s() - start;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t iterations = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0)
+                        : BENCH_DEFAULT_ITERATIONS;
+  uint8_t addr_1 = (argc > 2) ? (uint8_t)strtoul(argv[2], NULL, 0) : BENCH_DEFAULT_ADDR;
+  uint8_t addr_2 = (argc > 3) ? (uint8_t)strtoul(argv[3], NULL, 0) : BENCH_DEFAULT_ADDR;
+
+  if (iterations == 0) {
+    printf("usage: %s [iterations] [bus 1 addr] [bus 2 addr]\n", argv[0]);
+    return 1;
+  }
+
+  StatusCode ret = gpio_regs_init();
+  if ((ret != STATUS_CODE_OK) && (ret != STATUS_CODE_ALREADY_INITIALIZED)) {
+    printf("gpio_regs_init() failed with exit code %d\n", ret);
+    return 1;
+  }
+
+#ifdef CM4_GPIO_SIM
+  // charge real bus time and give each bus something to talk to
+  i2c_sim_set_realtime(1);
+  for (int i = 0; i < 2; i++) {
+    I2cSimDevice dev = {
+      .name = "eeprom", .addr = (i == 0) ? addr_1 : addr_2, .ctx = &s_eeprom[i],
+      .write = eeprom_write, .read = eeprom_read,
+    };
+    TRY(i2c_sim_attach((i == 0) ? I2C_BUS_1 : I2C_BUS_2, &dev));
+  }
+#endif
+
+  TRY(i2c_init(I2C_BUS_1));
+  TRY(i2c_init(I2C_BUS_2));
+
+  BenchJob jobs[2] = {
+    {.bus = I2C_BUS_1, .addr = addr_1, .iterations = iterations},
+    {.bus = I2C_BUS_2, .addr = addr_2, .iterations = iterations},
+  };
+
+  printf("%u register reads of %d bytes per bus\n", iterations, BENCH_READ_BYTES);
+
+  double bus_1 = run_jobs(&jobs[0], 1);
+  double bus_2 = run_jobs(&jobs[1], 1);
+  double both = run_jobs(jobs, 2);
+
+  printf("bus 1 alone   %8.1f ms  %8.0f reads/s\n", bus_1 * 1e3, iterations / bus_1);
+  printf("bus 2 alone   %8.1f ms  %8.0f reads/s\n", bus_2 * 1e3, iterations / bus_2);
+  printf("both at once  %8.1f ms  %8.0f reads/s  (%.2fx of back to back)\n", both * 1e3,
+         2.0 * iterations / both, (bus_1 + bus_2) / both);
+
+  if (jobs[0].failures || jobs[1].failures) {
+    printf("failed reads: bus 1 %u, bus 2 %u\n", jobs[0].failures, jobs[1].failures);
+  }
+
+  i2c_deinit(I2C_BUS_1);
+  i2c_deinit(I2C_BUS_2);
+  return 0;
+}
@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cm4_gpio.h"
+#include "cm4_i2c.h"
+#include "cm4_i2c_sched.h"
+#include "cm4_time.h"
+#include "pwm_controller.h"
+#ifdef CM4_GPIO_SIM
+#include "cm4_i2c_sim.h"
+#endif
+
+#define BENCH_MX_ADDR         0x57
+#define BENCH_MX_FIFO_DATA    0x07
+#define BENCH_MX_FIFO_DEPTH   32
+#define BENCH_MX_SAMPLE_BYTES 6
+
+#define BENCH_DEFAULT_FRAMES  500U
+#define BENCH_DEFAULT_CHUNK   4U /*samples per drain transaction, as irled does*/
+#define BENCH_FRAME_PERIOD_NS (5ULL * 1000 * 1000)
+
+static atomic_bool s_running = true;
+static uint32_t s_chunk_bytes;
+
+static const char *prio_names[I2C_PRIO_NUM_CLASSES] = {
+  "actuator", "telemetry", "bulk",
+};
+
+/* Back to back fifo drains, the traffic the actuator class has to cut through */
+static void *bulk_thread_func(void *arg)
+{
+  (void)arg;
+  uint8_t buf[BENCH_MX_FIFO_DEPTH * BENCH_MX_SAMPLE_BYTES];
+
+  while (atomic_load(&s_running)) {
+    i2c_write_then_read(I2C_BUS_2, BENCH_MX_ADDR, (uint8_t[]) {BENCH_MX_FIFO_DATA}, 1,
+                        buf, s_chunk_bytes);
+  }
+
+  return NULL;
+}
+
+static void sleep_until_ns(uint64_t t)
+{
+  struct timespec until = {
+    .tv_sec = (time_t)(t / 1000000000ULL), .tv_nsec = (long)(t % 1000000000ULL)
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0) {
+  }
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t frames = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0)
+                    : BENCH_DEFAULT_FRAMES;
+  uint32_t chunk = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 0)
+                   : BENCH_DEFAULT_CHUNK;
+
+  if ((frames == 0) || (chunk == 0) || (chunk > BENCH_MX_FIFO_DEPTH)) {
+    printf("usage: %s [frames] [fifo samples per drain, 1-%d]\n", argv[0],
+           BENCH_MX_FIFO_DEPTH);
+    return 1;
+  }
+
+  s_chunk_bytes = chunk * BENCH_MX_SAMPLE_BYTES;
+
+  StatusCode ret = gpio_regs_init();
+  if ((ret != STATUS_CODE_OK) && (ret != STATUS_CODE_ALREADY_INITIALIZED)) {
+    printf("gpio_regs_init() failed with exit code %d\n", ret);
+    return 1;
+  }
+
+#ifdef CM4_GPIO_SIM
+  // charge real bus time so the queues actually fill up
+  i2c_sim_set_realtime(1);
+#endif
+
+  ret = i2c_init(I2C_BUS_2);
+  if ((ret != STATUS_CODE_OK) && (ret != STATUS_CODE_ALREADY_INITIALIZED)) {
+    printf("i2c_init() failed with exit code %d\n", ret);
+    return 1;
+  }
+
+  TRY(i2c_sched_set_addr_prio(I2C_BUS_2, PCA_I2C_ADDR, I2C_PRIO_ACTUATOR));
+  TRY(i2c_sched_set_addr_prio(I2C_BUS_2, BENCH_MX_ADDR, I2C_PRIO_BULK));
+
+  pthread_t bulk_thread;
+  if (pthread_create(&bulk_thread, NULL, bulk_thread_func, NULL) != 0) {
+    printf("failed to start bulk thread\n");
+    return 1;
+  }
+
+  for (int prio = 0; prio < I2C_PRIO_NUM_CLASSES; prio++) {
+    I2cSchedStats discard;
+    i2c_sched_get_stats(I2C_BUS_2, (I2cPrio)prio, &discard, 1);
+  }
+
+  printf("%u servo frames every %llu us against back to back %u sample fifo drains\n",
+         frames, BENCH_FRAME_PERIOD_NS / 1000, chunk);
+
+  uint64_t next = time_now_ns();
+  for (uint32_t i = 0; i < frames; i++) {
+    next += BENCH_FRAME_PERIOD_NS;
+    sleep_until_ns(next);
+
+    uint16_t off = (uint16_t)(205 + (i % 205));
+    uint8_t frame[5] = {
+      PCA_LED0_ON_L, 0x00, 0x00, (uint8_t)(off & 0xFF), (uint8_t)(off >> 8)
+    };
+    i2c_write(I2C_BUS_2, PCA_I2C_ADDR, frame, sizeof(frame));
+  }
+
+  atomic_store(&s_running, false);
+  pthread_join(bulk_thread, NULL);
+
+  printf("%-10s %10s %8s %12s %12s %12s %12s\n", "class", "completed", "misses",
+         "wait avg us", "wait max us", "svc avg us", "svc max us");
+
+  for (int prio = 0; prio < I2C_PRIO_NUM_CLASSES; prio++) {
+    I2cSchedStats st;
+    TRY(i2c_sched_get_stats(I2C_BUS_2, (I2cPrio)prio, &st, 0));
+
+    double n = st.completed ? (double)st.completed : 1.0;
+    printf("%-10s %10llu %8llu %12.1f %12.1f %12.1f %12.1f\n", prio_names[prio],
+           (unsigned long long)st.completed, (unsigned long long)st.deadline_misses,
+           st.wait_ns_total / n / 1e3, st.wait_ns_max / 1e3,
+           st.service_ns_total / n / 1e3, st.service_ns_max / 1e3);
+  }
+
+  i2c_deinit(I2C_BUS_2);
+  return 0;
+}
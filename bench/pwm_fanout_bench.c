@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cm4_gpio.h"
+#include "cm4_i2c.h"
+#include "pwm_controller.h"
+#ifdef CM4_GPIO_SIM
+#include "cm4_i2c_sim.h"
+#endif
+
+#define BENCH_DEFAULT_FRAMES    200U
+#define BENCH_DEFAULT_ADDR_2    0x40
+#define BENCH_SERVOS_PER_BOARD  12
+#define BENCH_NUM_SERVOS        (2 * BENCH_SERVOS_PER_BOARD)
+#define BENCH_PWM_FREQ_HZ       50
+
+typedef enum {
+  BENCH_MODE_PER_CHANNEL = 0, // one set_channel per servo, as servo.c used to
+  BENCH_MODE_PER_BOARD,       // one burst per board
+  BENCH_MODE_FANOUT,          // one batch for both boards
+  BENCH_NUM_MODES,
+} BenchMode;
+
+static const char *mode_names[BENCH_NUM_MODES] = {
+  "per channel", "per board", "fan-out",
+};
+
+static PwmController s_boards[2];
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* A 24 servo frame, every pulse a little different from the last frame so the shadow registers
+   cannot drop any of it */
+static void fill_frame(PwmFanoutUpdate *updates, uint32_t frame)
+{
+  for (int i = 0; i < BENCH_NUM_SERVOS; i++) {
+    updates[i].pwm = &s_boards[i / BENCH_SERVOS_PER_BOARD];
+    updates[i].channel = PCA_LED_ON_L(i % BENCH_SERVOS_PER_BOARD);
+    updates[i].delay_percentage = 0.0f;
+    updates[i].duty_cycle = 0.05f + 0.05f * (float)((frame + i) % 64) / 64.0f;
+  }
+}
+
+static StatusCode send_frame(BenchMode mode, const PwmFanoutUpdate *updates)
+{
+  if (mode == BENCH_MODE_FANOUT) {
+    return pwm_controller_set_fanout(updates, BENCH_NUM_SERVOS);
+  }
+
+  for (int board = 0; board < 2; board++) {
+    PwmChannelUpdate board_updates[BENCH_SERVOS_PER_BOARD];
+    const PwmFanoutUpdate *src = &updates[board * BENCH_SERVOS_PER_BOARD];
+
+    for (int i = 0; i < BENCH_SERVOS_PER_BOARD; i++) {
+      board_updates[i] = (PwmChannelUpdate) {
+        .channel = src[i].channel,
+        .delay_percentage = src[i].delay_percentage,
+        .duty_cycle = src[i].duty_cycle,
+      };
+    }
+
+    if (mode == BENCH_MODE_PER_BOARD) {
+      TRY(pwm_controller_dev_set_channels(&s_boards[board], board_updates, BENCH_SERVOS_PER_BOARD));
+      continue;
+    }
+
+    for (int i = 0; i < BENCH_SERVOS_PER_BOARD; i++) {
+      TRY(pwm_controller_dev_set_channels(&s_boards[board], &board_updates[i], 1));
+    }
+  }
+
+  return STATUS_CODE_OK;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t frames = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : BENCH_DEFAULT_FRAMES;
+  uint8_t addr_2 = (argc > 2) ? (uint8_t)strtoul(argv[2], NULL, 0) : BENCH_DEFAULT_ADDR_2;
+
+  if (frames == 0) {
+    printf("usage: %s [frames] [second board addr]\n", argv[0]);
+    return 1;
+  }
+
+  StatusCode ret = gpio_regs_init();
+  if ((ret != STATUS_CODE_OK) && (ret != STATUS_CODE_ALREADY_INITIALIZED)) {
+    printf("gpio_regs_init() failed with exit code %d\n", ret);
+    return 1;
+  }
+
+#ifdef CM4_GPIO_SIM
+  // charge real bus time
+  i2c_sim_set_realtime(1);
+#endif
+
+  TRY(i2c_init(I2C_BUS_2));
+  TRY(pwm_controller_dev_init(&s_boards[0], I2C_BUS_2, PCA_I2C_ADDR, BENCH_PWM_FREQ_HZ));
+  TRY(pwm_controller_dev_init(&s_boards[1], I2C_BUS_2, addr_2, BENCH_PWM_FREQ_HZ));
+
+  printf("%u frames of %d servos across two boards\n", frames, BENCH_NUM_SERVOS);
+
+  PwmFanoutUpdate updates[BENCH_NUM_SERVOS];
+
+  for (BenchMode mode = 0; mode < BENCH_NUM_MODES; mode++) {
+    uint32_t failures = 0;
+#ifdef CM4_GPIO_SIM
+    I2cSimBusStats stats;
+    i2c_sim_get_stats(I2C_BUS_2, &stats, 1);
+#endif
+    double start = now_s();
+
+    for (uint32_t frame = 0; frame < frames; frame++) {
+      fill_frame(updates, frame);
+      if (send_frame(mode, updates) != STATUS_CODE_OK) {
+        failures++;
+      }
+    }
+
+    double elapsed = now_s() - start;
+    printf("%-12s %8.3f ms/frame  %8.0f frames/s", mode_names[mode], elapsed * 1e3 / frames,
+           frames / elapsed);
+#ifdef CM4_GPIO_SIM
+    i2c_sim_get_stats(I2C_BUS_2, &stats, 1);
+    printf("  %5.1f transactions/frame", (double)stats.transactions / frames);
+#endif
+    if (failures) {
+      printf("  %u failed", failures);
+    }
+    printf("\n");
+  }
+
+  pwm_controller_dev_deinit(&s_boards[0]);
+  pwm_controller_dev_deinit(&s_boards[1]);
+  i2c_deinit(I2C_BUS_2);
+  return 0;
+}
@@ -5,6 +5,14 @@
 #include "global_enums.h"
 
 #define GPIO_BLOCK_SIZE 4096
+#define GPIO_NUM_PINS   54
+#define GPIO_NUM_BANKS  2
+
+// bank 0 holds pins 0-31, bank 1 holds pins 32-53
+#define GPIO_BANK_VALID_MASK(bank) ((bank) == 0 ? 0xFFFFFFFFU : 0x003FFFFFU)
+
+#define GPIO_CHIP_DEV   "/dev/gpiochip0"
+#define GPIO_EDGE_EVENT_BUFFER 16
 
 #define GPFSEL0_INDEX   0   // 0x00 / 4
 #define GPSET0_INDEX    7   // 0x1C / 4
@@ -33,6 +41,27 @@ typedef enum {
   GPIO_EDGE_BOTH    = GPIO_EDGE_RISING | GPIO_EDGE_FALLING,
 } GpioEdge;
 
+/* Pin handle resolved once by gpio_pin_open, the inline accessors below use
+   the cached register pointers and mask without any further checks */
+typedef struct {
+  volatile uint32_t *set;
+  volatile uint32_t *clr;
+  volatile uint32_t *lev;
+  uint32_t mask;
+  int pin;
+} GpioPin;
+
+#ifdef CM4_GPIO_SIM
+// the sim backend models register side effects, so every access goes through it
+void gpio_sim_reg_write(volatile uint32_t *reg, uint32_t val);
+uint32_t gpio_sim_reg_read(volatile uint32_t *reg);
+#define GPIO_REG_WRITE(reg, val) gpio_sim_reg_write((reg), (val))
+#define GPIO_REG_READ(reg)       gpio_sim_reg_read(reg)
+#else
+#define GPIO_REG_WRITE(reg, val) (*(reg) = (val))
+#define GPIO_REG_READ(reg)       (*(reg))
+#endif
+
 #define MODE_TO_STR(x)                                                         \
         ((x) == GPIO_MODE_INPUT ? "INPUT"                                         \
          : (x) == GPIO_MODE_OUTPUT ? "OUTPUT"                                        \
@@ -94,4 +123,77 @@ StatusCode gpio_get_edge_event(int pin, int *event);
 /**
  * Clear the edge state of a specified gpio pin, only works if the pin has been configured with gpio_set_edge
  */
-StatusCode gpio_clear_edge(int pin);
\ No newline at end of file
+StatusCode gpio_clear_edge(int pin);
+
+/**
+ * Drive every pin in set_mask high and every pin in clr_mask low, one GPSET and one GPCLR write
+ * Bit n of a mask is pin (32 * bank + n), the masks must not overlap
+ */
+StatusCode gpio_write_mask(int bank, uint32_t set_mask, uint32_t clr_mask);
+
+/**
+ * Read the level of all pins in a bank from a single GPLEV read
+ */
+StatusCode gpio_read_bank(int bank, uint32_t *levels);
+
+/**
+ * Toggle every pin in mask using one GPLEV read and one GPSET/GPCLR write each
+ */
+StatusCode gpio_toggle_mask(int bank, uint32_t mask);
+
+/**
+ * Read the pending edge events of all pins in a bank from a single GPEDS read
+ */
+StatusCode gpio_get_edge_events_bank(int bank, uint32_t *events);
+
+/**
+ * Clear the pending edge events of every pin in mask with a single GPEDS write
+ */
+StatusCode gpio_clear_edges_mask(int bank, uint32_t mask);
+
+/**
+ * Get a pollable file descriptor that becomes readable when the edge configured with gpio_set_edge occurs
+ * The fd is owned by the gpio module, consume events with gpio_wait_edge. While it is open the kernel
+ * owns edge detection for the pin, so gpio_get_edge_event will not see its events
+ */
+StatusCode gpio_get_edge_fd(int pin, int *fd);
+
+/**
+ * Block until an edge occurs on the pin or timeout_ns elapses (< 0 waits forever, 0 only checks)
+ * timestamp_ns (CLOCK_MONOTONIC) may be NULL. Returns STATUS_CODE_TIMEOUT if no edge arrived
+ */
+StatusCode gpio_wait_edge(int pin, int64_t timeout_ns, uint64_t *timestamp_ns);
+
+/**
+ * Release the edge event fd of a pin, if one is open
+ */
+StatusCode gpio_release_edge(int pin);
+
+/**
+ * Resolve a pin into a handle for the inline fast paths, the pin must already be configured with gpio_set_mode
+ */
+StatusCode gpio_pin_open(int pin, GpioPin *handle);
+
+/**
+ * Drive a pin high - a single register store, the handle must come from gpio_pin_open
+ */
+static inline void gpio_pin_set(const GpioPin *p)
+{
+  GPIO_REG_WRITE(p->set, p->mask);
+}
+
+/**
+ * Drive a pin low - a single register store, the handle must come from gpio_pin_open
+ */
+static inline void gpio_pin_clr(const GpioPin *p)
+{
+  GPIO_REG_WRITE(p->clr, p->mask);
+}
+
+/**
+ * Read a pin level - a single register load, the handle must come from gpio_pin_open
+ */
+static inline int gpio_pin_get(const GpioPin *p)
+{
+  return (GPIO_REG_READ(p->lev) & p->mask) ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "cm4_gpio.h"
+
+/* Register model of the gpio block used by the sim backend. gpio.c runs
+   unchanged on top of it: GPFSEL selects which pins follow the output latch
+   (GPSET/GPCLR) and which follow the externally driven input level, GPLEV
+   reflects the result and GPEDS latches edges enabled in GPREN/GPFEN,
+   GPAREN/GPAFEN and GPHEN/GPLEN. Edge line requests receive real
+   gpio_v2_line_event records. Everything is silent unless tracing is on. */
+
+#define GPFSEL_NUM_REGS 6
+#define GPHEN0_INDEX    25  // 0x64 / 4
+#define GPLEN0_INDEX    28  // 0x70 / 4
+#define GPAREN0_INDEX   31  // 0x7C / 4
+#define GPAFEN0_INDEX   34  // 0x88 / 4
+
+/* One step of an input waveform, applied delay_ns after the previous step */
+typedef struct {
+  uint32_t delay_ns;
+  uint8_t bank;
+  uint32_t set_mask;
+  uint32_t clr_mask;
+} GpioSimStep;
+
+/**
+ * Register block backing gpio_regs_init in the sim build
+ */
+volatile uint32_t *gpio_sim_map_regs(void);
+
+/**
+ * Open an edge event line on the model, fd yields struct gpio_v2_line_event like the kernel's
+ */
+StatusCode gpio_sim_line_request(int pin, GpioEdge edge, int *fd);
+
+/**
+ * Return every register, latch and input to its power-on state and stop any waveform
+ */
+void gpio_sim_reset(void);
+
+/**
+ * Close gpio.c's cached edge line requests and forget their edge settings, called by
+ * gpio_sim_reset since the model ends of those lines go away. Implemented in gpio.c
+ */
+void gpio_sim_drop_edges(void);
+
+/**
+ * Print every register write and pin level change, off by default
+ */
+void gpio_sim_set_trace(int enable);
+
+/**
+ * Drive the external level of an input pin, has no effect on the level while the pin is an output
+ */
+StatusCode gpio_sim_drive_input(int pin, int level);
+
+/**
+ * Drive the external level of every pin in set_mask high and clr_mask low, in one update
+ */
+StatusCode gpio_sim_drive_input_mask(int bank, uint32_t set_mask, uint32_t clr_mask);
+
+/**
+ * Simulate an external edge on an input pin, drives the opposite level first if needed
+ */
+StatusCode gpio_sim_inject_edge(int pin, GpioEdge edge);
+
+/**
+ * Play an input waveform from a background thread, repeat times (0 loops until stopped)
+ * steps is copied and replaces any waveform already playing
+ */
+StatusCode gpio_sim_play_waveform(const GpioSimStep *steps, uint32_t n, uint32_t repeat);
+
+/**
+ * Stop the waveform that is playing, if any
+ */
+void gpio_sim_stop_waveform(void);
+
+/**
+ * Block until the waveform finishes playing, returns immediately if none is playing
+ */
+void gpio_sim_wait_waveform(void);
@@ -33,12 +33,41 @@
 #define S_TXD             (1U << 4)
 #define S_RXD             (1U << 5)
 #define S_TXE             (1U << 6)
+#define S_RXF             (1U << 7)
+
+#define I2C_BATCH_MAX_MSGS 42 // I2C_RDWR_IOCTL_MAX_MSGS
 
 typedef enum {
   I2C_BUS_1 = 1,
   I2C_BUS_2 = 2,
 } I2cBus;
 
+typedef enum {
+  I2C_MSG_FLAG_WRITE = 0,
+  I2C_MSG_FLAG_READ  = (1U << 0),
+} I2cMsgFlag;
+
+/* One segment of a batched transfer. Consecutive messages are joined with a
+   repeated start, so a register write followed by a read on the same address
+   behaves like i2c_write_then_read. status is filled in per message. */
+typedef struct {
+  uint8_t addr;
+  uint8_t flags;
+  uint16_t len;
+  uint8_t *buf;
+  StatusCode status;
+} I2cMsg;
+
+#define I2C_MSG_WRITE(a, b, l)                                                 \
+        ((I2cMsg) {.addr = (a), .flags = I2C_MSG_FLAG_WRITE, .len = (l),           \
+                   .buf = (uint8_t *)(b), .status = STATUS_CODE_OK})
+
+#define I2C_MSG_READ(a, b, l)                                                  \
+        ((I2cMsg) {.addr = (a), .flags = I2C_MSG_FLAG_READ, .len = (l),            \
+                   .buf = (uint8_t *)(b), .status = STATUS_CODE_OK})
+
+#define I2C_NUM_MSGS(msgs) (uint32_t)(sizeof(msgs) / sizeof((msgs)[0]))
+
 /**
  * Check if i2c has been initialized
  */
@@ -73,4 +102,11 @@ StatusCode i2c_write_byte(I2cBus i2c_bus, uint8_t addr, uint8_t data);
 /**
  * Used to read from an i2c device, typically write_buf will contain the register and read_buf will contain the data
  */
-StatusCode i2c_write_then_read(I2cBus i2c_bus, uint8_t addr, const uint8_t *write_buf, uint32_t write_len, uint8_t *read_buf, uint32_t read_len);
\ No newline at end of file
+StatusCode i2c_write_then_read(I2cBus i2c_bus, uint8_t addr, const uint8_t *write_buf, uint32_t write_len, uint8_t *read_buf, uint32_t read_len);
+
+/**
+ * Send any mix of reads and writes, to any addresses on one bus, in a single I2C_RDWR ioctl
+ * Batches longer than I2C_BATCH_MAX_MSGS are split; each message reports its own status and
+ * messages after a failed one are marked STATUS_CODE_FAILED without being sent
+ */
+StatusCode i2c_transfer_batch(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n);
\ No newline at end of file
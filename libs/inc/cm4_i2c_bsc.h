@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "cm4_i2c.h"
+
+/* User space driver for the BSC (Broadcom Serial Controller) blocks behind
+   I2C_BUS_1 (BSC1) and I2C_BUS_2 (BSC3, named BSC2_BASE here). The bsc
+   backend mmaps the block from /dev/mem and polls it directly instead of
+   going through i2c-dev, so a transaction costs its wire time and not a
+   syscall plus an interrupt per message. The kernel's i2c-bcm2835 driver
+   must not own the same bus (drop its dtoverlay) or both will fight over it.
+   The controller cannot issue a repeated start, so every message of a
+   transaction gets its own start and stop - fine for register pointer
+   devices like the PCA9685, INA219 and MAX30102. */
+
+#define BSC_FIFO_DEPTH        16
+#define BSC_CORE_CLK_HZ       MHZ(500) // needs a fixed core clock, core_freq_min=500 in config.txt
+#define BSC_DEFAULT_HZ        KHZ(100)
+#define BSC_MIN_HZ            KHZ(10)
+#define BSC_MAX_HZ            MHZ(1)
+
+#define BSC_CDIV_MASK         0xFFFFU
+#define BSC_DEL_FEDL_SHIFT    16
+#define BSC_DEL_REDL_SHIFT    0
+#define BSC_CLKT_MAX          0xFFFFU
+#define BSC_CLKT_TIMEOUT_MS   35 // SMBus clock stretch limit
+
+// the test double models the side effects of every register access, see cm4_i2c_sim.h
+#ifdef CM4_I2C_BSC_SIM
+void i2c_bsc_sim_reg_write(volatile uint32_t *reg, uint32_t val);
+uint32_t i2c_bsc_sim_reg_read(volatile uint32_t *reg);
+#define BSC_REG_WRITE(reg, val) i2c_bsc_sim_reg_write((reg), (val))
+#define BSC_REG_READ(reg)       i2c_bsc_sim_reg_read(reg)
+#else
+#define BSC_REG_WRITE(reg, val) (*(reg) = (val))
+#define BSC_REG_READ(reg)       (*(reg))
+#endif
+
+/**
+ * Set the SCL rate of a bus, BSC_CORE_CLK_HZ / hz rounded up to an even divider
+ */
+StatusCode i2c_bsc_set_clock(I2cBus i2c_bus, uint32_t hz);
+
+/**
+ * Get the SCL rate the divider of a bus actually produces
+ */
+StatusCode i2c_bsc_get_clock(I2cBus i2c_bus, uint32_t *hz);
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cm4_i2c.h"
+
+/* Shadow copy of a register pointer device's register file. Writes are
+   staged in the cache and only registers whose value changes become dirty;
+   i2c_regcache_flush sends the dirty registers in ascending order as one
+   batch, joining neighbours into auto increment bursts. Reads are served
+   from the cache when the register's content is known, so only status and
+   measurement registers cost bus time. Registers are width bytes each, in
+   bus order (MSB first for 16 bit devices). */
+
+#define I2C_REGCACHE_MAX_REGS  256
+#define I2C_REGCACHE_MAX_WIDTH 2
+#define I2C_REGCACHE_MAX_GAP   2 // clean registers a burst may rewrite to join two dirty runs
+#define I2C_REGCACHE_MAX_GROUP 8 // devices one i2c_regcache_flush_group can cover
+
+typedef enum {
+  I2C_REG_VOLATILE = 0, // changes behind our back, never cached - the default
+  I2C_REG_CACHED,       // only changes when written, reads hit the cache once it is known
+  I2C_REG_WRITE_ONLY,   // reads back nothing useful, reads always come from the cache
+} I2cRegKind;
+
+typedef struct {
+  uint64_t writes;         // registers staged
+  uint64_t writes_dropped; // staged with the value the device already holds
+  uint64_t regs_sent;      // registers put on the bus, including ones rewritten to bridge a gap
+  uint64_t msgs_sent;
+  uint64_t reads_cached;
+  uint64_t reads_bus;
+} I2cRegCacheStats;
+
+/* Caller owned, one per device */
+typedef struct {
+  I2cBus bus;
+  uint8_t addr;
+  uint16_t num_regs;
+  uint8_t width;
+  bool auto_inc;
+  uint8_t kind[I2C_REGCACHE_MAX_REGS];
+  bool valid[I2C_REGCACHE_MAX_REGS];
+  bool dirty[I2C_REGCACHE_MAX_REGS];
+  uint8_t values[I2C_REGCACHE_MAX_REGS * I2C_REGCACHE_MAX_WIDTH];
+  I2cRegCacheStats stats;
+  pthread_mutex_t mutex;
+} I2cRegCache;
+
+/**
+ * Set up an empty cache for registers 0 to num_regs - 1 of a device, every register starts volatile
+ */
+StatusCode i2c_regcache_init(I2cRegCache *cache, I2cBus i2c_bus, uint8_t addr,
+                             uint16_t num_regs, uint8_t width);
+
+/**
+ * Mark count registers starting at reg as volatile, cached or write only
+ */
+StatusCode i2c_regcache_set_kind(I2cRegCache *cache, uint16_t reg, uint16_t count,
+                                 I2cRegKind kind);
+
+/**
+ * Allow flushes and reads to span several registers in one message, only once the device auto increments
+ */
+void i2c_regcache_set_auto_inc(I2cRegCache *cache, bool enable);
+
+/**
+ * Record values the device is known to hold without any bus traffic, e.g. its reset state
+ */
+StatusCode i2c_regcache_seed(I2cRegCache *cache, uint16_t reg, const uint8_t *vals,
+                             uint16_t count);
+
+/**
+ * Stage writes to count registers starting at reg, writes of the value already held are dropped
+ * Volatile registers are always sent. Nothing goes on the bus until i2c_regcache_flush
+ */
+StatusCode i2c_regcache_write(I2cRegCache *cache, uint16_t reg, const uint8_t *vals,
+                              uint16_t count);
+
+/**
+ * Send every dirty register, lowest address first, as one batch of merged bursts
+ * Registers in a message that fails are left dirty with unknown content
+ */
+StatusCode i2c_regcache_flush(I2cRegCache *cache);
+
+/**
+ * Like i2c_regcache_flush but rewrites every known register between dirty ones, so the update
+ * goes out as a single message unless a volatile or unknown register sits in between
+ */
+StatusCode i2c_regcache_flush_burst(I2cRegCache *cache);
+
+/**
+ * i2c_regcache_flush_burst for several devices on the same bus, all of them sent as one batch
+ */
+StatusCode i2c_regcache_flush_group(I2cRegCache *const *caches, uint32_t n);
+
+/**
+ * Read count registers starting at reg, from the cache when all of them are known - staged
+ * writes included. Pending writes are flushed before going to the bus
+ */
+StatusCode i2c_regcache_read(I2cRegCache *cache, uint16_t reg, uint8_t *vals, uint16_t count);
+
+/**
+ * Forget count registers starting at reg, e.g. after a reset or a broadcast write, pending writes are dropped
+ */
+StatusCode i2c_regcache_invalidate(I2cRegCache *cache, uint16_t reg, uint16_t count);
+
+/**
+ * Get the cache statistics, optionally resetting them
+ */
+StatusCode i2c_regcache_get_stats(I2cRegCache *cache, I2cRegCacheStats *stats, int reset);
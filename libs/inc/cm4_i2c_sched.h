@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "cm4_i2c.h"
+
+/* Every i2c transaction goes through a per-bus scheduler thread. Requests are
+   queued by priority class and run strictly in class order, earliest deadline
+   first within a class, so an actuator update waits for at most the one
+   transaction already on the bus. i2c_write, i2c_write_then_read and
+   i2c_transfer_batch submit a request and wait for it, using the class
+   registered for the target address with i2c_sched_set_addr_prio. */
+
+// a request without an explicit deadline gets submit time + its class budget
+#define I2C_SCHED_ACTUATOR_BUDGET_NS  (5ULL * 1000 * 1000)
+#define I2C_SCHED_TELEMETRY_BUDGET_NS (20ULL * 1000 * 1000)
+#define I2C_SCHED_BULK_BUDGET_NS      (100ULL * 1000 * 1000)
+
+typedef enum {
+  I2C_PRIO_ACTUATOR = 0,
+  I2C_PRIO_TELEMETRY,
+  I2C_PRIO_BULK,
+  I2C_PRIO_NUM_CLASSES,
+} I2cPrio;
+
+typedef struct I2cRequest I2cRequest;
+
+/* Runs on the scheduler thread once the request completes, must not block
+   but may submit further requests or use the synchronous calls */
+typedef void (*I2cCallback)(I2cRequest *req, void *arg);
+
+/* Caller owned, must stay valid until the request completes */
+struct I2cRequest {
+  I2cMsg *msgs;
+  uint32_t n;
+  I2cPrio prio;
+  uint64_t deadline_ns; // CLOCK_MONOTONIC, 0 uses the class budget
+  I2cCallback cb;
+  void *cb_arg;
+
+  // filled in by the scheduler
+  StatusCode status;
+  uint64_t due_ns;
+  uint64_t submit_ns;
+  uint64_t start_ns;
+  uint64_t done_ns;
+  _Atomic uint32_t done;
+  I2cRequest *next;
+};
+
+typedef struct {
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t deadline_misses;
+  uint64_t wait_ns_total; // submit to start of transfer
+  uint64_t wait_ns_max;
+  uint64_t service_ns_total; // start to end of transfer
+  uint64_t service_ns_max;
+  uint32_t depth;
+  uint32_t depth_max;
+} I2cSchedStats;
+
+/**
+ * Start the scheduler thread of a bus, called by the backend once the bus is open
+ */
+StatusCode i2c_sched_start(I2cBus i2c_bus);
+
+/**
+ * Stop the scheduler thread of a bus, requests still queued complete with STATUS_CODE_NOT_INITIALIZED
+ */
+StatusCode i2c_sched_stop(I2cBus i2c_bus);
+
+/**
+ * Queue a request, returns immediately - completion is signalled through cb and i2c_sched_wait
+ * Up to I2C_BATCH_MAX_MSGS messages form one transaction, longer requests are split like i2c_transfer_batch
+ */
+StatusCode i2c_sched_submit(I2cBus i2c_bus, I2cRequest *req);
+
+/**
+ * Wait for a submitted request to complete and return its status (< 0 waits forever)
+ * Returns STATUS_CODE_TIMEOUT if it is still pending, in which case it must not be reused yet
+ */
+StatusCode i2c_sched_wait(I2cRequest *req, int timeout_ms);
+
+/**
+ * Set the priority class the synchronous calls use for an address, addresses default to telemetry
+ */
+StatusCode i2c_sched_set_addr_prio(I2cBus i2c_bus, uint8_t addr, I2cPrio prio);
+
+/**
+ * Get the latency statistics of one priority class on a bus, optionally resetting them
+ */
+StatusCode i2c_sched_get_stats(I2cBus i2c_bus, I2cPrio prio, I2cSchedStats *stats, int reset);
+
+/**
+ * Run one transaction of at most I2C_BATCH_MAX_MSGS messages on the bus and set each message's
+ * status - implemented by each backend and only called from the scheduler thread
+ */
+StatusCode i2c_backend_transfer(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "cm4_i2c.h"
+
+/* Simulated i2c buses used by the sim backend. Devices are register models
+   that plug into a bus at an address, every message is routed to the device
+   it addresses and a missing device NACKs like on hardware. Each transaction
+   is costed on a bus timing model (start, address and data bytes with their
+   ACK bit, stop) at the configured SCL rate, optionally paced in real time.
+   The bsc_sim build puts a BSC register model in front of the same buses so
+   i2c_bsc.c runs unchanged; it shifts bytes at the rate its DIV register
+   sets against the real clock, so realtime pacing is not needed there. */
+
+#define I2C_SIM_MAX_DEVICES 8
+#define I2C_SIM_DEFAULT_HZ  KHZ(100)
+
+/* A device gets each message addressed to it whole, a write usually sets the
+   register pointer with its first byte. Returning anything but STATUS_CODE_OK NACKs */
+typedef struct {
+  const char *name;
+  uint8_t addr;
+  void *ctx;
+  StatusCode (*write)(void *ctx, const uint8_t *buf, uint16_t len);
+  StatusCode (*read)(void *ctx, uint8_t *buf, uint16_t len);
+} I2cSimDevice;
+
+typedef struct {
+  uint64_t transactions;
+  uint64_t msgs;
+  uint64_t bytes;
+  uint64_t nacks;
+  uint64_t busy_ns;   // modelled time the bus was driven
+  uint64_t window_ns; // time since the stats were last reset
+} I2cSimBusStats;
+
+/**
+ * Plug a device model into a bus, replaces any device already at the same address
+ */
+StatusCode i2c_sim_attach(I2cBus i2c_bus, const I2cSimDevice *dev);
+
+/**
+ * Remove the device at addr from a bus
+ */
+StatusCode i2c_sim_detach(I2cBus i2c_bus, uint8_t addr);
+
+/**
+ * Set the modelled SCL rate of a bus, standard mode (100 kHz) or fast mode (400 kHz)
+ */
+StatusCode i2c_sim_set_bus_speed(I2cBus i2c_bus, uint32_t hz);
+
+/**
+ * Block each transaction for its modelled bus time so callers see hardware throughput, off by default
+ */
+void i2c_sim_set_realtime(int enable);
+
+/**
+ * Print every message on the bus, off by default
+ */
+void i2c_sim_set_trace(int enable);
+
+/**
+ * Route a transaction to the devices on a bus and count it in the stats without pacing it,
+ * for register level models like the BSC one that keep their own time
+ */
+StatusCode i2c_sim_bus_transfer(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n);
+
+/**
+ * Register block of a bus's BSC model, backs i2c_init in the bsc_sim build
+ */
+volatile uint32_t *i2c_bsc_sim_map_regs(I2cBus i2c_bus);
+
+/**
+ * Get the bus statistics, busy_ns / window_ns is the utilisation, optionally resetting them
+ */
+StatusCode i2c_sim_get_stats(I2cBus i2c_bus, I2cSimBusStats *stats, int reset);
@@ -13,6 +13,7 @@ typedef enum {
   STATUS_CODE_MEM_ACCESS_FAILURE  = -5,
   STATUS_CODE_OUT_OF_MEMORY       = -6,
   STATUS_CODE_FAILED              = -7,
+  STATUS_CODE_TIMEOUT             = -8,
 } StatusCode;
 
 #define TRY(expr)                                                              \
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global_enums.h"
+#include "spsc_ring.h"
+
+/* Bytes of storage a ring of capacity elements needs, a sequence word per slot then the slots */
+#define MPSC_RING_STORAGE_BYTES(elem_size, capacity)                           \
+        ((size_t)(capacity) * (sizeof(uint32_t) + (elem_size)))
+
+/* Lock-free multi-producer/single-consumer ring of fixed size elements.
+   Producers reserve a run of slots with one CAS on head, fill them and then
+   publish each slot by storing its position in the slot's sequence word, so
+   producers never wait on each other's copies. The consumer only takes the
+   run of published slots starting at tail, which keeps every producer's
+   elements in order and contiguous. A push is all or nothing: when the run
+   does not fit it is dropped and counted. Sleeping and waking the consumer
+   works as in SpscRing. */
+typedef struct {
+  alignas(SPSC_CACHE_LINE_BYTES) _Atomic uint32_t head;
+  _Atomic uint32_t dropped;
+
+  alignas(SPSC_CACHE_LINE_BYTES) _Atomic uint32_t tail;
+  _Atomic uint32_t waiting;
+  _Atomic uint32_t wake_seq;
+  _Atomic uint32_t kicked;
+
+  alignas(SPSC_CACHE_LINE_BYTES) _Atomic uint32_t *seq;
+  uint8_t *data;
+  uint32_t elem_size;
+  uint32_t capacity;
+} MpscRing;
+
+/**
+ * Initialize a ring over caller owned storage of MPSC_RING_STORAGE_BYTES, capacity must be a power of two
+ */
+StatusCode mpsc_ring_init(MpscRing *rb, void *storage, uint32_t elem_size,
+                          uint32_t capacity);
+
+/**
+ * Push n elements as one contiguous run (any thread), returns n or 0 if the run did not fit
+ */
+uint32_t mpsc_ring_push(MpscRing *rb, const void *elems, uint32_t n);
+
+/**
+ * Pop up to max_n published elements without blocking (consumer only), returns how many were popped
+ */
+uint32_t mpsc_ring_pop(MpscRing *rb, void *out, uint32_t max_n);
+
+/**
+ * Pop up to max_n elements, sleeping until data arrives or timeout_ms elapses (consumer only)
+ * timeout_ms < 0 waits forever, 0 does not block. May return 0 early if woken with mpsc_ring_wake
+ */
+uint32_t mpsc_ring_pop_wait(MpscRing *rb, void *out, uint32_t max_n,
+                            int timeout_ms);
+
+/**
+ * Wake a consumer blocked in mpsc_ring_pop_wait, used on shutdown
+ */
+void mpsc_ring_wake(MpscRing *rb);
+
+/**
+ * Number of elements dropped because the ring was full, optionally resetting the counter
+ */
+uint32_t mpsc_ring_get_dropped(MpscRing *rb, int reset);
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "cm4_i2c_regcache.h"
 #include "global_enums.h"
 
 #define PCA_REG_SIZE_BITS 8
@@ -49,9 +52,27 @@ typedef enum {
   PCA_LED3_ON_L       = 0x12,
   PCA_LED4_ON_L       = 0x16,
   PCA_LED5_ON_L       = 0x1A,
+  PCA_LED6_ON_L       = 0x1E,
+  PCA_LED7_ON_L       = 0x22,
+  PCA_LED8_ON_L       = 0x26,
+  PCA_LED9_ON_L       = 0x2A,
+  PCA_LED10_ON_L      = 0x2E,
+  PCA_LED11_ON_L      = 0x32,
+  PCA_LED12_ON_L      = 0x36,
+  PCA_LED13_ON_L      = 0x3A,
+  PCA_LED14_ON_L      = 0x3E,
+  PCA_LED15_ON_L      = 0x42,
   INVALID_PCA_CHANNEL = -1,
 } PCAChannel;
 
+#define PCA_NUM_CHANNELS  16
+#define PCA_LED_ON_L(n)   (PCA_LED0_ON_L + 4 * (n))
+
+// one of LED0_ON_L..LED15_ON_L, the only values a channel argument may take
+#define PCA_CHANNEL_VALID(ch)                                                      \
+        (((ch) >= PCA_LED0_ON_L) && ((ch) <= PCA_LED15_ON_L)                       \
+         && ((((ch) - PCA_LED0_ON_L) % 4) == 0))
+
 #define LEDX_FULL_OFF     (1U << 4)
 #define LEDX_FULL_ON      (1U << 4)
 
@@ -65,6 +86,33 @@ typedef enum {
 #define PCA_PRE_SCALE     0xFE
 #define PCA_TESTMODE      0xFF
 
+#define PWM_FANOUT_MAX_DEVS I2C_REGCACHE_MAX_GROUP
+
+/* One PCA9685, caller owned. pwm_controller_* without a handle drive the
+   default one at PCA_I2C_ADDR on I2C_BUS_2 */
+typedef struct {
+  I2cBus bus;
+  uint8_t addr;
+  uint32_t pwm_freq;
+  uint64_t period_ns;        // from the prescaler actually written
+  uint64_t period_origin_ns; // CLOCK_MONOTONIC estimate of when the counter last started at 0
+  bool initialized;
+  I2cRegCache cache; // every write goes through here so unchanged channels cost no bus time
+} PwmController;
+
+typedef struct {
+  PCAChannel channel;
+  float delay_percentage;
+  float duty_cycle;
+} PwmChannelUpdate;
+
+typedef struct {
+  PwmController *pwm;
+  PCAChannel channel;
+  float delay_percentage;
+  float duty_cycle;
+} PwmFanoutUpdate;
+
 /**
  * Check if the pwm controller has been initialized
  */
@@ -85,6 +133,21 @@ StatusCode pwm_controller_deinit();
  */
 StatusCode pwm_controller_set_channel(PCAChannel channel, float delay_percentage, float duty_cycle);
 
+/**
+ * Set the pwm output of several channels in one bus transaction, the outputs change in the same pwm period
+ */
+StatusCode pwm_controller_set_channels(const PwmChannelUpdate *updates, size_t n);
+
+/**
+ * Sets every pwm channel to 0% duty cycle with one broadcast write
+ */
+StatusCode pwm_controller_all_off();
+
+/**
+ * Sets every pwm channel to 100% duty cycle with one broadcast write
+ */
+StatusCode pwm_controller_all_on();
+
 /**
  * Sets pwm channel to 0% duty cycle
  */
@@ -93,4 +156,62 @@ StatusCode pwm_controller_stop_channel(PCAChannel channel);
 /**
  * Sets pwm channel to 100% duty cycle
  */
-StatusCode pwm_controller_digital_set_channel(PCAChannel channel);
\ No newline at end of file
+StatusCode pwm_controller_digital_set_channel(PCAChannel channel);
+
+/**
+ * Get how many register writes the controller's shadow registers saved, optionally resetting the count
+ */
+StatusCode pwm_controller_get_cache_stats(I2cRegCacheStats *stats, int reset);
+
+/**
+ * Get the handle of the default controller the functions above drive
+ */
+PwmController *pwm_controller_get_default();
+
+/**
+ * Initialize a pwm controller at addr on i2c_bus, the bus must be initialized
+ */
+StatusCode pwm_controller_dev_init(PwmController *pwm, I2cBus i2c_bus, uint8_t addr, uint32_t pwm_freq);
+
+/**
+ * Turn every output of a pwm controller off and put it to sleep, in one transaction
+ */
+StatusCode pwm_controller_dev_deinit(PwmController *pwm);
+
+/**
+ * Check if a pwm controller has been initialized
+ */
+StatusCode pwm_controller_dev_get_initialized(const PwmController *pwm);
+
+/**
+ * Set the pwm output of several channels of one controller in one bus transaction
+ */
+StatusCode pwm_controller_dev_set_channels(PwmController *pwm, const PwmChannelUpdate *updates,
+                                           size_t n);
+
+/**
+ * Sets every channel of one controller to 0% duty cycle with one broadcast write
+ */
+StatusCode pwm_controller_dev_all_off(PwmController *pwm);
+
+/**
+ * Sets every channel of one controller to 100% duty cycle with one broadcast write
+ */
+StatusCode pwm_controller_dev_all_on(PwmController *pwm);
+
+/**
+ * Get the pwm period of a controller and when, on CLOCK_MONOTONIC, its counter started
+ * The origin is the host's estimate at wake up and drifts with the chip's internal oscillator
+ */
+StatusCode pwm_controller_dev_get_timing(const PwmController *pwm, uint64_t *period_ns,
+                                        uint64_t *origin_ns);
+
+/**
+ * Get the shadow register statistics of one controller, optionally resetting them
+ */
+StatusCode pwm_controller_dev_get_cache_stats(PwmController *pwm, I2cRegCacheStats *stats, int reset);
+
+/**
+ * Set channels across up to PWM_FANOUT_MAX_DEVS controllers, one batched transfer per bus
+ */
+StatusCode pwm_controller_set_fanout(const PwmFanoutUpdate *updates, size_t n);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "global_enums.h"
+
+#define SPSC_CACHE_LINE_BYTES 64
+
+/* Lock-free single-producer/single-consumer ring of fixed size elements.
+   head is only written by the producer and tail only by the consumer, each on
+   its own cache line so the two threads never bounce a line on the fast path.
+   When full, new elements are dropped and counted rather than overwriting the
+   oldest, since the producer may not move tail. A consumer with nothing to do
+   sleeps on a futex and is only woken by the producer while it is waiting. */
+typedef struct {
+  alignas(SPSC_CACHE_LINE_BYTES) _Atomic uint32_t head;
+  _Atomic uint32_t dropped;
+
+  alignas(SPSC_CACHE_LINE_BYTES) _Atomic uint32_t tail;
+  _Atomic uint32_t waiting;
+  _Atomic uint32_t wake_seq;
+  _Atomic uint32_t kicked;
+
+  alignas(SPSC_CACHE_LINE_BYTES) uint8_t *data;
+  uint32_t elem_size;
+  uint32_t capacity;
+} SpscRing;
+
+/**
+ * Initialize a ring over caller owned storage of capacity * elem_size bytes, capacity must be a power of two
+ */
+StatusCode spsc_ring_init(SpscRing *rb, void *storage, uint32_t elem_size,
+                          uint32_t capacity);
+
+/**
+ * Number of elements currently queued
+ */
+uint32_t spsc_ring_count(SpscRing *rb);
+
+/**
+ * Push up to n elements (producer only), returns how many fit - the rest are dropped and counted
+ */
+uint32_t spsc_ring_push(SpscRing *rb, const void *elems, uint32_t n);
+
+/**
+ * Pop up to max_n elements without blocking (consumer only), returns how many were popped
+ */
+uint32_t spsc_ring_pop(SpscRing *rb, void *out, uint32_t max_n);
+
+/**
+ * Pop up to max_n elements, sleeping until data arrives or timeout_ms elapses (consumer only)
+ * timeout_ms < 0 waits forever, 0 does not block. May return 0 early if woken with spsc_ring_wake
+ */
+uint32_t spsc_ring_pop_wait(SpscRing *rb, void *out, uint32_t max_n,
+                            int timeout_ms);
+
+/**
+ * Wake a consumer blocked in spsc_ring_pop_wait, used on shutdown
+ */
+void spsc_ring_wake(SpscRing *rb);
+
+/**
+ * Number of elements dropped because the ring was full, optionally resetting the counter
+ */
+uint32_t spsc_ring_get_dropped(SpscRing *rb, int reset);
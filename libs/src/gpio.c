@@ -1,13 +1,35 @@
+#define _GNU_SOURCE // ppoll
+
 #include "cm4_gpio.h"
+#ifdef CM4_GPIO_SIM
+#include "cm4_gpio_sim.h"
+#endif
 
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 static volatile uint32_t *s_gpio_regs = NULL;
 
+// register accesses go through GPIO_REG_WRITE/READ so the sim backend can model their side effects
+#define GPIO_WRITE_REG(index, val) GPIO_REG_WRITE(&s_gpio_regs[(index)], (val))
+#define GPIO_READ_REG(index)       GPIO_REG_READ(&s_gpio_regs[(index)])
+
+// edge event line requests on the gpio character device, one per pin
+static GpioEdge s_edge_cfg[GPIO_NUM_PINS];
+static int s_edge_fd[GPIO_NUM_PINS];
+static pthread_mutex_t s_edge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static StatusCode gpio_open_edge_fd(int pin);
+
 StatusCode gpio_get_regs_initialized()
 {
   if (!s_gpio_regs) {
@@ -23,6 +45,9 @@ StatusCode gpio_regs_init(void)
     return STATUS_CODE_ALREADY_INITIALIZED;
   }
 
+#ifdef CM4_GPIO_SIM
+  s_gpio_regs = gpio_sim_map_regs();
+#else
   int fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
 
   if (fd < 0) {
@@ -40,6 +65,12 @@ StatusCode gpio_regs_init(void)
     s_gpio_regs = NULL;
     return STATUS_CODE_INVALID_ARGS;
   }
+#endif
+
+  for (int pin = 0; pin < GPIO_NUM_PINS; pin++) {
+    s_edge_cfg[pin] = GPIO_EDGE_NONE;
+    s_edge_fd[pin] = -1;
+  }
 
   return STATUS_CODE_OK;
 }
@@ -57,10 +88,10 @@ StatusCode gpio_set_mode(int pin, GpioMode mode)
   int reg_index = GPFSEL0_INDEX + (pin / 10);
   int shift = (pin % 10) * 3;
 
-  uint32_t val = s_gpio_regs[reg_index];
+  uint32_t val = GPIO_READ_REG(reg_index);
   val &= ~(0b111 << shift);
   val |= (mode << shift);
-  s_gpio_regs[reg_index] = val;
+  GPIO_WRITE_REG(reg_index, val);
 
   return STATUS_CODE_OK;
 }
@@ -78,12 +109,12 @@ StatusCode gpio_write(int pin, int value)
   if (value) {
     // high
     int reg_index = GPSET0_INDEX + (pin / 32);
-    s_gpio_regs[reg_index] = (1U << (pin % 32));
+    GPIO_WRITE_REG(reg_index, (1U << (pin % 32)));
   }
   else {
     // low
     int reg_index = GPCLR0_INDEX + (pin / 32);
-    s_gpio_regs[reg_index] = (1U << (pin % 32));
+    GPIO_WRITE_REG(reg_index, (1U << (pin % 32)));
   }
 
   return STATUS_CODE_OK;
@@ -100,7 +131,7 @@ StatusCode gpio_read(int pin, int *state)
   }
 
   int reg_index = GPLEV0_INDEX + (pin / 32);
-  uint32_t val = s_gpio_regs[reg_index];
+  uint32_t val = GPIO_READ_REG(reg_index);
 
   *state = (val & (1U << (pin % 32))) ? 1 : 0;
 
@@ -117,21 +148,7 @@ StatusCode gpio_toggle(int pin)
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  int state;
-  StatusCode ret = gpio_read(pin, &state);
-  if (ret != STATUS_CODE_OK) {
-    printf("gpio_read failed with exit code: %u\n", ret);
-    return ret;
-  }
-
-  if (state == 1) {
-    ret = gpio_write(pin, 0);
-  }
-  else if (state == 0) {
-    ret = gpio_write(pin, 1);
-  }
-
-  return ret;
+  return gpio_toggle_mask(pin / 32, 1U << (pin % 32));
 }
 
 StatusCode gpio_set_edge(int pin, GpioEdge edge)
@@ -161,10 +178,10 @@ StatusCode gpio_set_edge(int pin, GpioEdge edge)
   uint8_t eds_index = GPEDS0_INDEX + bank;
 
   // clear pending event
-  s_gpio_regs[eds_index] = mask;
+  GPIO_WRITE_REG(eds_index, mask);
 
-  uint32_t ren = s_gpio_regs[ren_index];
-  uint32_t fen = s_gpio_regs[fen_index];
+  uint32_t ren = GPIO_READ_REG(ren_index);
+  uint32_t fen = GPIO_READ_REG(fen_index);
 
   // clear existing config
 
@@ -184,8 +201,17 @@ StatusCode gpio_set_edge(int pin, GpioEdge edge)
     // nothing to do
   }
 
-  s_gpio_regs[ren_index] = ren;
-  s_gpio_regs[fen_index] = fen;
+  GPIO_WRITE_REG(ren_index, ren);
+  GPIO_WRITE_REG(fen_index, fen);
+
+  // an open event request was made for the old edge, reopen it lazily
+  pthread_mutex_lock(&s_edge_mutex);
+  s_edge_cfg[pin] = edge;
+  if (s_edge_fd[pin] >= 0) {
+    close(s_edge_fd[pin]);
+    s_edge_fd[pin] = -1;
+  }
+  pthread_mutex_unlock(&s_edge_mutex);
 
   return STATUS_CODE_OK;
 }
@@ -214,7 +240,7 @@ StatusCode gpio_get_edge_event(int pin, int *event)
 
   uint8_t eds_index = GPEDS0_INDEX + bank;
 
-  uint32_t eds = s_gpio_regs[eds_index];
+  uint32_t eds = GPIO_READ_REG(eds_index);
 
   if (eds & mask) {
     *event = 1;
@@ -249,7 +275,277 @@ StatusCode gpio_clear_edge(int pin)
   uint32_t mask = (1U << bit);
   uint8_t eds_index = GPEDS0_INDEX + bank;
 
-  s_gpio_regs[eds_index] = mask;
+  GPIO_WRITE_REG(eds_index, mask);
+
+  return STATUS_CODE_OK;
+}
+
+static inline StatusCode gpio_check_bank(int bank, uint32_t mask)
+{
+  if (!s_gpio_regs) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  if ((bank < 0) || (bank >= GPIO_NUM_BANKS)
+      || (mask & ~GPIO_BANK_VALID_MASK(bank))) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode gpio_write_mask(int bank, uint32_t set_mask, uint32_t clr_mask)
+{
+  StatusCode ret = gpio_check_bank(bank, set_mask | clr_mask);
+  if (ret != STATUS_CODE_OK) {
+    return ret;
+  }
+
+  if (set_mask & clr_mask) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  // writing 0 bits to GPSET/GPCLR has no effect, so skip empty masks
+  if (set_mask) {
+    GPIO_WRITE_REG(GPSET0_INDEX + bank, set_mask);
+  }
+  if (clr_mask) {
+    GPIO_WRITE_REG(GPCLR0_INDEX + bank, clr_mask);
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode gpio_read_bank(int bank, uint32_t *levels)
+{
+  StatusCode ret = gpio_check_bank(bank, 0);
+  if (ret != STATUS_CODE_OK) {
+    return ret;
+  }
+
+  if (!levels) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  *levels = GPIO_READ_REG(GPLEV0_INDEX + bank) & GPIO_BANK_VALID_MASK(bank);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode gpio_toggle_mask(int bank, uint32_t mask)
+{
+  StatusCode ret = gpio_check_bank(bank, mask);
+  if (ret != STATUS_CODE_OK) {
+    return ret;
+  }
+
+  uint32_t lev = GPIO_READ_REG(GPLEV0_INDEX + bank);
+
+  uint32_t set_mask = ~lev & mask;
+  uint32_t clr_mask = lev & mask;
+
+  if (set_mask) {
+    GPIO_WRITE_REG(GPSET0_INDEX + bank, set_mask);
+  }
+  if (clr_mask) {
+    GPIO_WRITE_REG(GPCLR0_INDEX + bank, clr_mask);
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode gpio_get_edge_events_bank(int bank, uint32_t *events)
+{
+  StatusCode ret = gpio_check_bank(bank, 0);
+  if (ret != STATUS_CODE_OK) {
+    return ret;
+  }
+
+  if (!events) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  *events = GPIO_READ_REG(GPEDS0_INDEX + bank) & GPIO_BANK_VALID_MASK(bank);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode gpio_clear_edges_mask(int bank, uint32_t mask)
+{
+  StatusCode ret = gpio_check_bank(bank, mask);
+  if (ret != STATUS_CODE_OK) {
+    return ret;
+  }
+
+  // GPEDS is write 1 to clear
+  GPIO_WRITE_REG(GPEDS0_INDEX + bank, mask);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode gpio_pin_open(int pin, GpioPin *handle)
+{
+  if (!s_gpio_regs) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  if ((pin < 0) || (pin > 53) || !handle) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  handle->set = &s_gpio_regs[GPSET0_INDEX + (pin / 32)];
+  handle->clr = &s_gpio_regs[GPCLR0_INDEX + (pin / 32)];
+  handle->lev = &s_gpio_regs[GPLEV0_INDEX + (pin / 32)];
+  handle->mask = 1U << (pin % 32);
+  handle->pin = pin;
 
   return STATUS_CODE_OK;
-}
\ No newline at end of file
+}
+
+static StatusCode gpio_open_edge_fd(int pin)
+{
+  uint64_t flags = GPIO_V2_LINE_FLAG_INPUT;
+
+  if (s_edge_cfg[pin] & GPIO_EDGE_RISING) {
+    flags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+  }
+  if (s_edge_cfg[pin] & GPIO_EDGE_FALLING) {
+    flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  }
+
+  if (s_edge_cfg[pin] == GPIO_EDGE_NONE) {
+    printf("gpio %d has no edge configured\n", pin);
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+#ifdef CM4_GPIO_SIM
+  (void)flags;
+  return gpio_sim_line_request(pin, s_edge_cfg[pin], &s_edge_fd[pin]);
+#else
+  int chip_fd = open(GPIO_CHIP_DEV, O_RDWR | O_CLOEXEC);
+  if (chip_fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s (errno=%d)\n", GPIO_CHIP_DEV,
+            strerror(errno), errno);
+    return STATUS_CODE_MEM_ACCESS_FAILURE;
+  }
+
+  struct gpio_v2_line_request req;
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = (uint32_t)pin;
+  req.num_lines = 1;
+  req.config.flags = flags;
+  req.event_buffer_size = GPIO_EDGE_EVENT_BUFFER;
+  snprintf(req.consumer, sizeof(req.consumer), "cm4_fw");
+
+  int ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  close(chip_fd);
+
+  if (ret < 0) {
+    fprintf(stderr, "gpio %d line request failed: %s (errno=%d)\n", pin,
+            strerror(errno), errno);
+    return STATUS_CODE_FAILED;
+  }
+
+  s_edge_fd[pin] = req.fd;
+  return STATUS_CODE_OK;
+#endif
+}
+
+#ifdef CM4_GPIO_SIM
+void gpio_sim_drop_edges(void)
+{
+  // the fds are only set up by gpio_regs_init
+  if (!s_gpio_regs) {
+    return;
+  }
+
+  pthread_mutex_lock(&s_edge_mutex);
+  for (int pin = 0; pin < GPIO_NUM_PINS; pin++) {
+    if (s_edge_fd[pin] >= 0) {
+      close(s_edge_fd[pin]);
+      s_edge_fd[pin] = -1;
+    }
+    s_edge_cfg[pin] = GPIO_EDGE_NONE;
+  }
+  pthread_mutex_unlock(&s_edge_mutex);
+}
+#endif
+
+StatusCode gpio_get_edge_fd(int pin, int *fd)
+{
+  if (!s_gpio_regs) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  if ((pin < 0) || (pin > 53) || !fd) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  StatusCode ret = STATUS_CODE_OK;
+
+  pthread_mutex_lock(&s_edge_mutex);
+  if (s_edge_fd[pin] < 0) {
+    ret = gpio_open_edge_fd(pin);
+  }
+  *fd = s_edge_fd[pin];
+  pthread_mutex_unlock(&s_edge_mutex);
+
+  return ret;
+}
+
+StatusCode gpio_wait_edge(int pin, int64_t timeout_ns, uint64_t *timestamp_ns)
+{
+  int fd = -1;
+  StatusCode ret = gpio_get_edge_fd(pin, &fd);
+  if (ret != STATUS_CODE_OK) {
+    return ret;
+  }
+
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  struct timespec timeout = {
+    .tv_sec = timeout_ns / 1000000000LL, .tv_nsec = timeout_ns % 1000000000LL
+  };
+
+  int ready;
+  do {
+    ready = ppoll(&pfd, 1, (timeout_ns < 0) ? NULL : &timeout, NULL);
+  } while ((ready < 0) && (errno == EINTR));
+
+  if (ready < 0) {
+    return STATUS_CODE_FAILED;
+  }
+  if (ready == 0) {
+    return STATUS_CODE_TIMEOUT;
+  }
+
+  struct gpio_v2_line_event event;
+  if (read(fd, &event, sizeof(event)) != (ssize_t)sizeof(event)) {
+    return STATUS_CODE_FAILED;
+  }
+
+  if (timestamp_ns) {
+    *timestamp_ns = event.timestamp_ns;
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode gpio_release_edge(int pin)
+{
+  if (!s_gpio_regs) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  if ((pin < 0) || (pin > 53)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&s_edge_mutex);
+  if (s_edge_fd[pin] >= 0) {
+    close(s_edge_fd[pin]);
+    s_edge_fd[pin] = -1;
+  }
+  pthread_mutex_unlock(&s_edge_mutex);
+
+  return STATUS_CODE_OK;
+}
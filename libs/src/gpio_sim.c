@@ -1,130 +1,437 @@
+#define _GNU_SOURCE // MSG_NOSIGNAL
+
 #include "cm4_gpio.h"
+#include "cm4_gpio_sim.h"
+#include "cm4_time.h"
+
+#include <errno.h>
+#include <linux/gpio.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// the register block as gpio.c sees it, reads are plain loads so GPSET/GPCLR
+// are never stored and always read back as 0 like on hardware
+static volatile uint32_t s_regs[GPIO_BLOCK_SIZE / 4];
+
+// pin state behind the registers, GPLEV is recomputed from these on every change
+static uint32_t s_out_latch[GPIO_NUM_BANKS];
+static uint32_t s_ext_level[GPIO_NUM_BANKS];
+static uint32_t s_out_mode[GPIO_NUM_BANKS];
+static pthread_mutex_t s_model_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int s_trace = 0;
 
-static int s_gpio_regs = 0;
-static int pin_modes[40];
-static int pin_values[40];
+// edge line requests, the fd handed to gpio.c is the other end of a seqpacket
+// socket so every read returns exactly one gpio_v2_line_event
+static GpioEdge s_line_edge[GPIO_NUM_PINS];
+static int s_line_fd[GPIO_NUM_PINS] = {[0 ... GPIO_NUM_PINS - 1] = -1};
+static uint32_t s_line_seqno[GPIO_NUM_PINS];
+static uint32_t s_line_mask[GPIO_NUM_BANKS];
 
-StatusCode gpio_get_regs_initialized()
+// waveform player
+static pthread_t s_wave_thread;
+static int s_wave_started = 0;
+static int s_wave_stop = 0;
+static GpioSimStep *s_wave_steps = NULL;
+static uint32_t s_wave_count = 0;
+static uint32_t s_wave_repeat = 0;
+static pthread_mutex_t s_wave_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_wave_cond;
+static pthread_once_t s_wave_once = PTHREAD_ONCE_INIT;
+
+static void sim_decode_fsel(void);
+static void sim_update_level(int bank);
+static void sim_latch_level_detect(int bank);
+static void sim_notify_lines(int bank, uint32_t rising, uint32_t falling);
+static void sim_close_lines(void);
+static void sim_wave_init_cond(void);
+static void *sim_wave_thread_func(void *arg);
+
+/* Rebuild the output pin masks from all GPFSEL registers */
+static void sim_decode_fsel(void)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  uint32_t out_mode[GPIO_NUM_BANKS] = {0, 0};
+
+  for (int pin = 0; pin < GPIO_NUM_PINS; pin++) {
+    uint32_t fsel = s_regs[GPFSEL0_INDEX + (pin / 10)];
+    if (((fsel >> ((pin % 10) * 3)) & 0b111) == GPIO_MODE_OUTPUT) {
+      out_mode[pin / 32] |= 1U << (pin % 32);
+    }
   }
 
-  return STATUS_CODE_OK;
+  s_out_mode[0] = out_mode[0];
+  s_out_mode[1] = out_mode[1];
+}
+
+/* Level sensitive detection keeps setting GPEDS for as long as the level holds */
+static void sim_latch_level_detect(int bank)
+{
+  uint32_t lev = s_regs[GPLEV0_INDEX + bank];
+  uint32_t eds = (lev & s_regs[GPHEN0_INDEX + bank])
+                 | (~lev & s_regs[GPLEN0_INDEX + bank]);
+
+  s_regs[GPEDS0_INDEX + bank] |= eds & GPIO_BANK_VALID_MASK(bank);
 }
 
-StatusCode gpio_regs_init(void)
+/* Recompute GPLEV for a bank and latch any enabled edges, model mutex held */
+static void sim_update_level(int bank)
 {
-  if (s_gpio_regs != 0) {
-    return STATUS_CODE_ALREADY_INITIALIZED;     // already initialized
+  uint32_t old = s_regs[GPLEV0_INDEX + bank];
+  uint32_t lev = ((s_out_latch[bank] & s_out_mode[bank])
+                  | (s_ext_level[bank] & ~s_out_mode[bank]))
+                 & GPIO_BANK_VALID_MASK(bank);
+
+  s_regs[GPLEV0_INDEX + bank] = lev;
+
+  uint32_t changed = old ^ lev;
+  if (changed) {
+    uint32_t rising = changed & lev;
+    uint32_t falling = changed & old;
+
+    s_regs[GPEDS0_INDEX + bank] |=
+      (rising & (s_regs[GPREN0_INDEX + bank] | s_regs[GPAREN0_INDEX + bank]))
+      | (falling & (s_regs[GPFEN0_INDEX + bank] | s_regs[GPAFEN0_INDEX + bank]));
+
+    if (s_trace) {
+      printf("[SIM] Bank %d level 0x%08X -> 0x%08X\n", bank, old, lev);
+    }
+
+    if (changed & s_line_mask[bank]) {
+      sim_notify_lines(bank, rising, falling);
+    }
   }
 
-  s_gpio_regs = 1;
-  printf("[SIM] gpio_init()\n");
-  return STATUS_CODE_OK;
+  sim_latch_level_detect(bank);
 }
 
-StatusCode gpio_set_mode(int pin, GpioMode mode)
+static void sim_notify_lines(int bank, uint32_t rising, uint32_t falling)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  uint64_t now = time_now_ns();
+  uint32_t pending = (rising | falling) & s_line_mask[bank];
+
+  while (pending) {
+    int bit = __builtin_ctz(pending);
+    pending &= pending - 1;
+
+    int pin = 32 * bank + bit;
+    struct gpio_v2_line_event event;
+    memset(&event, 0, sizeof(event));
+
+    if ((rising & (1U << bit)) && (s_line_edge[pin] & GPIO_EDGE_RISING)) {
+      event.id = GPIO_V2_LINE_EVENT_RISING_EDGE;
+    }
+    else if ((falling & (1U << bit)) && (s_line_edge[pin] & GPIO_EDGE_FALLING)) {
+      event.id = GPIO_V2_LINE_EVENT_FALLING_EDGE;
+    }
+    else {
+      continue;
+    }
+
+    event.timestamp_ns = now;
+    event.offset = (uint32_t)pin;
+    event.seqno = event.line_seqno = ++s_line_seqno[pin];
+
+    // like the kernel, events that do not fit the buffer are lost
+    if ((send(s_line_fd[pin], &event, sizeof(event), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        && (errno != EAGAIN)) {
+      // gpio.c closed its end of the line
+      close(s_line_fd[pin]);
+      s_line_fd[pin] = -1;
+      s_line_mask[bank] &= ~(1U << bit);
+    }
   }
+}
 
-  if ((pin < 0) || (pin > 53)) {
-    return STATUS_CODE_INVALID_ARGS;
+static void sim_close_lines(void)
+{
+  for (int pin = 0; pin < GPIO_NUM_PINS; pin++) {
+    if (s_line_fd[pin] >= 0) {
+      close(s_line_fd[pin]);
+      s_line_fd[pin] = -1;
+    }
   }
 
-  pin_modes[pin] = mode;
-  printf("[SIM] Set pin %d mode = %s\n", pin, MODE_TO_STR(mode));
-  return STATUS_CODE_OK;
+  s_line_mask[0] = 0;
+  s_line_mask[1] = 0;
 }
 
-StatusCode gpio_write(int pin, int value)
+volatile uint32_t *gpio_sim_map_regs(void)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  return s_regs;
+}
+
+void gpio_sim_reg_write(volatile uint32_t *reg, uint32_t val)
+{
+  long index = (long)(reg - s_regs);
+
+  if ((index < 0) || (index >= GPIO_BLOCK_SIZE / 4)) {
+    return;
   }
 
-  if ((pin < 0) || (pin > 53)) {
-    return STATUS_CODE_INVALID_ARGS;
+  pthread_mutex_lock(&s_model_mutex);
+
+  if (s_trace) {
+    printf("[SIM] gpio reg 0x%03lX <- 0x%08X\n", (unsigned long)index * 4, val);
   }
 
-  pin_values[pin] = value;
-  printf("[SIM] Pin %d -> %d\n", pin, value);
-  return STATUS_CODE_OK;
+  if (index < GPFSEL0_INDEX + GPFSEL_NUM_REGS) {
+    s_regs[index] = val;
+    sim_decode_fsel();
+    sim_update_level(0);
+    sim_update_level(1);
+  }
+  else if ((index == GPSET0_INDEX) || (index == GPSET0_INDEX + 1)) {
+    s_out_latch[index - GPSET0_INDEX] |= val;
+    sim_update_level((int)(index - GPSET0_INDEX));
+  }
+  else if ((index == GPCLR0_INDEX) || (index == GPCLR0_INDEX + 1)) {
+    s_out_latch[index - GPCLR0_INDEX] &= ~val;
+    sim_update_level((int)(index - GPCLR0_INDEX));
+  }
+  else if ((index == GPLEV0_INDEX) || (index == GPLEV0_INDEX + 1)) {
+    // read only
+  }
+  else if ((index == GPEDS0_INDEX) || (index == GPEDS0_INDEX + 1)) {
+    // write 1 to clear
+    s_regs[index] &= ~val;
+    sim_latch_level_detect((int)(index - GPEDS0_INDEX));
+  }
+  else if ((index == GPHEN0_INDEX) || (index == GPHEN0_INDEX + 1)) {
+    s_regs[index] = val;
+    sim_latch_level_detect((int)(index - GPHEN0_INDEX));
+  }
+  else if ((index == GPLEN0_INDEX) || (index == GPLEN0_INDEX + 1)) {
+    s_regs[index] = val;
+    sim_latch_level_detect((int)(index - GPLEN0_INDEX));
+  }
+  else {
+    s_regs[index] = val;
+  }
+
+  pthread_mutex_unlock(&s_model_mutex);
 }
 
-StatusCode gpio_read(int pin, int *state)
+uint32_t gpio_sim_reg_read(volatile uint32_t *reg)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  long index = (long)(reg - s_regs);
+
+  if ((index < 0) || (index >= GPIO_BLOCK_SIZE / 4)) {
+    return 0;
   }
 
-  if ((pin < 0) || (pin > 53)) {
+  return s_regs[index];
+}
+
+StatusCode gpio_sim_line_request(int pin, GpioEdge edge, int *fd)
+{
+  if ((pin < 0) || (pin > 53) || (edge == GPIO_EDGE_NONE) || !fd) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  printf("[SIM] Read pin %d = %d\n", pin, pin_values[pin]);
-  *state = pin_values[pin];
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    fprintf(stderr, "gpio %d sim line request failed: %s (errno=%d)\n", pin,
+            strerror(errno), errno);
+    return STATUS_CODE_FAILED;
+  }
+
+  pthread_mutex_lock(&s_model_mutex);
+  if (s_line_fd[pin] >= 0) {
+    close(s_line_fd[pin]);
+  }
+  s_line_fd[pin] = sv[1];
+  s_line_edge[pin] = edge;
+  s_line_seqno[pin] = 0;
+  s_line_mask[pin / 32] |= 1U << (pin % 32);
+  pthread_mutex_unlock(&s_model_mutex);
+
+  *fd = sv[0];
   return STATUS_CODE_OK;
 }
 
-StatusCode gpio_toggle(int pin)
+void gpio_sim_reset(void)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  gpio_sim_stop_waveform();
+
+  // before the model mutex, gpio.c takes its edge lock first when it requests a line
+  gpio_sim_drop_edges();
+
+  pthread_mutex_lock(&s_model_mutex);
+  for (int i = 0; i < GPIO_BLOCK_SIZE / 4; i++) {
+    s_regs[i] = 0;
+  }
+  for (int bank = 0; bank < GPIO_NUM_BANKS; bank++) {
+    s_out_latch[bank] = 0;
+    s_ext_level[bank] = 0;
+    s_out_mode[bank] = 0;
   }
+  sim_close_lines();
+  pthread_mutex_unlock(&s_model_mutex);
+}
 
-  if ((pin < 0) || (pin > 53)) {
+void gpio_sim_set_trace(int enable)
+{
+  s_trace = enable;
+}
+
+StatusCode gpio_sim_drive_input_mask(int bank, uint32_t set_mask, uint32_t clr_mask)
+{
+  if ((bank < 0) || (bank >= GPIO_NUM_BANKS)
+      || ((set_mask | clr_mask) & ~GPIO_BANK_VALID_MASK(bank))
+      || (set_mask & clr_mask)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  pin_values[pin] = !pin_values[pin];
-  printf("[SIM] Pin %d -> %d\n", pin, pin_values[pin]);
+  pthread_mutex_lock(&s_model_mutex);
+  s_ext_level[bank] = (s_ext_level[bank] | set_mask) & ~clr_mask;
+  sim_update_level(bank);
+  pthread_mutex_unlock(&s_model_mutex);
+
   return STATUS_CODE_OK;
 }
 
-StatusCode gpio_set_edge(int pin, GpioEdge edge)
+StatusCode gpio_sim_drive_input(int pin, int level)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  if ((pin < 0) || (pin > 53)) {
+    return STATUS_CODE_INVALID_ARGS;
   }
 
-  if ((pin < 0) || (pin > 53)) {
+  uint32_t mask = 1U << (pin % 32);
+  return gpio_sim_drive_input_mask(pin / 32, level ? mask : 0, level ? 0 : mask);
+}
+
+StatusCode gpio_sim_inject_edge(int pin, GpioEdge edge)
+{
+  if ((pin < 0) || (pin > 53)
+      || ((edge != GPIO_EDGE_RISING) && (edge != GPIO_EDGE_FALLING))) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  printf("[SIM] Set pin %d edge %s\n", pin, EDGE_TO_STR(edge));
+  int bank = pin / 32;
+  uint32_t mask = 1U << (pin % 32);
+  uint32_t target = (edge == GPIO_EDGE_RISING) ? mask : 0;
+
+  pthread_mutex_lock(&s_model_mutex);
+  if ((s_ext_level[bank] & mask) == target) {
+    s_ext_level[bank] ^= mask;
+    sim_update_level(bank);
+  }
+  s_ext_level[bank] ^= mask;
+  sim_update_level(bank);
+  pthread_mutex_unlock(&s_model_mutex);
+
   return STATUS_CODE_OK;
 }
 
-StatusCode gpio_get_edge_event(int pin, int *event)
+static void sim_wave_init_cond(void)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s_wave_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void *sim_wave_thread_func(void *arg)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  (void)arg;
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  for (uint32_t r = 0; (s_wave_repeat == 0) || (r < s_wave_repeat); r++) {
+    for (uint32_t i = 0; i < s_wave_count; i++) {
+      const GpioSimStep *step = &s_wave_steps[i];
+
+      next.tv_nsec += step->delay_ns;
+      while (next.tv_nsec >= 1000000000L) {
+        next.tv_nsec -= 1000000000L;
+        next.tv_sec++;
+      }
+
+      // absolute deadlines so the waveform does not drift with the update cost
+      pthread_mutex_lock(&s_wave_mutex);
+      int rc = 0;
+      while (!s_wave_stop && (rc != ETIMEDOUT)) {
+        rc = pthread_cond_timedwait(&s_wave_cond, &s_wave_mutex, &next);
+      }
+      int stop = s_wave_stop;
+      pthread_mutex_unlock(&s_wave_mutex);
+
+      if (stop) {
+        return NULL;
+      }
+
+      gpio_sim_drive_input_mask(step->bank, step->set_mask, step->clr_mask);
+    }
   }
 
-  if ((pin < 0) || (pin > 53)) {
+  return NULL;
+}
+
+StatusCode gpio_sim_play_waveform(const GpioSimStep *steps, uint32_t n, uint32_t repeat)
+{
+  if (!steps || (n == 0)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  *event = 1;
+  for (uint32_t i = 0; i < n; i++) {
+    if ((steps[i].bank >= GPIO_NUM_BANKS)
+        || ((steps[i].set_mask | steps[i].clr_mask) & ~GPIO_BANK_VALID_MASK(steps[i].bank))
+        || (steps[i].set_mask & steps[i].clr_mask)) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+  }
+
+  gpio_sim_stop_waveform();
+  pthread_once(&s_wave_once, sim_wave_init_cond);
 
-  printf("[SIM] Pin %d = %d\n", pin, *event);
+  s_wave_steps = malloc(n * sizeof(GpioSimStep));
+  if (!s_wave_steps) {
+    return STATUS_CODE_FAILED;
+  }
+  memcpy(s_wave_steps, steps, n * sizeof(GpioSimStep));
+  s_wave_count = n;
+  s_wave_repeat = repeat;
+  s_wave_stop = 0;
+
+  if (pthread_create(&s_wave_thread, NULL, sim_wave_thread_func, NULL) != 0) {
+    printf("Failed to create waveform thread\n");
+    free(s_wave_steps);
+    s_wave_steps = NULL;
+    return STATUS_CODE_FAILED;
+  }
+
+  s_wave_started = 1;
   return STATUS_CODE_OK;
 }
 
-StatusCode gpio_clear_edge(int pin)
+void gpio_sim_wait_waveform(void)
 {
-  if (!s_gpio_regs) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  if (!s_wave_started) {
+    return;
   }
 
-  if ((pin < 0) || (pin > 53)) {
-    return STATUS_CODE_INVALID_ARGS;
+  pthread_join(s_wave_thread, NULL);
+  s_wave_started = 0;
+  free(s_wave_steps);
+  s_wave_steps = NULL;
+}
+
+void gpio_sim_stop_waveform(void)
+{
+  if (!s_wave_started) {
+    return;
   }
 
-  printf("[SIM] Pin  %d edge cleared\n", pin);
-  return STATUS_CODE_OK;
-}
\ No newline at end of file
+  pthread_mutex_lock(&s_wave_mutex);
+  s_wave_stop = 1;
+  pthread_cond_signal(&s_wave_cond);
+  pthread_mutex_unlock(&s_wave_mutex);
+
+  gpio_sim_wait_waveform();
+}
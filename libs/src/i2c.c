@@ -1,4 +1,5 @@
 #include "cm4_i2c.h"
+#include "cm4_i2c_sched.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -8,31 +9,61 @@
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include  <pthread.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "cm4_gpio.h"
 
-static int i2c_fd_1 = -1;
-static int i2c_fd_2 = -1;
+// everything a bus needs is kept per bus, so traffic on one never waits for the other
+typedef struct {
+  const char *dev;
+  int fd;
+  int slave_addr; // last I2C_SLAVE target, -1 when unknown
+  pthread_mutex_t mutex;
+} I2cBusCtx;
 
-static pthread_mutex_t s_i2c_mutex = PTHREAD_MUTEX_INITIALIZER;
+static I2cBusCtx s_i2c_buses[2] = {
+  {.dev = "/dev/i2c-1", .fd = -1, .slave_addr = -1, .mutex = PTHREAD_MUTEX_INITIALIZER},
+  {.dev = "/dev/i2c-3", .fd = -1, .slave_addr = -1, .mutex = PTHREAD_MUTEX_INITIALIZER},
+};
 
-StatusCode i2c_get_initialized(I2cBus i2c_bus)
+static I2cBusCtx *i2c_get_ctx(I2cBus i2c_bus)
 {
-
-  int *fdp = NULL;
   if (i2c_bus == I2C_BUS_1) {
-    fdp = &i2c_fd_1;
+    return &s_i2c_buses[0];
   }
   else if (i2c_bus == I2C_BUS_2) {
-    fdp = &i2c_fd_2;
+    return &s_i2c_buses[1];
+  }
+
+  return NULL;
+}
+
+/* Point the fd at a slave for the smbus and read/write paths, ctx mutex held */
+static int i2c_select_slave(I2cBusCtx *ctx, uint8_t addr)
+{
+  if (ctx->slave_addr == addr) {
+    return 0;
+  }
+
+  if (ioctl(ctx->fd, I2C_SLAVE, addr) < 0) {
+    ctx->slave_addr = -1;
+    return -1;
   }
-  else {
+
+  ctx->slave_addr = addr;
+  return 0;
+}
+
+StatusCode i2c_get_initialized(I2cBus i2c_bus)
+{
+  I2cBusCtx *ctx = i2c_get_ctx(i2c_bus);
+
+  if (!ctx) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  if (!fdp || (*fdp < 0)) {
+  if (ctx->fd < 0) {
     return STATUS_CODE_NOT_INITIALIZED;
   }
 
@@ -50,70 +81,66 @@ StatusCode i2c_init(I2cBus i2c_bus)
     return ret;
   }
 
-  const char *dev = NULL;
-  int *fdp = NULL;
+  I2cBusCtx *ctx = i2c_get_ctx(i2c_bus);
 
-  if (i2c_bus == I2C_BUS_1) {
-    dev = "/dev/i2c-1";
-    fdp = &i2c_fd_1;
-  }
-  else if (i2c_bus == I2C_BUS_2) {
-    dev = "/dev/i2c-3";
-    fdp = &i2c_fd_2;
-  }
-  else {
+  if (!ctx) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  if (dev == NULL) {
-    return STATUS_CODE_INVALID_ARGS;
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->fd >= 0) {
+    pthread_mutex_unlock(&ctx->mutex);
+    return STATUS_CODE_ALREADY_INITIALIZED;
   }
 
-  int fd = open(dev, O_RDWR);
+  int fd = open(ctx->dev, O_RDWR);
   if (fd < 0) {
+    pthread_mutex_unlock(&ctx->mutex);
     printf("Failed to access memory\n");
-    fprintf(stderr, "open(%s) failed: %s (errno=%d)\n", dev, strerror(errno), errno);
+    fprintf(stderr, "open(%s) failed: %s (errno=%d)\n", ctx->dev, strerror(errno), errno);
     return STATUS_CODE_MEM_ACCESS_FAILURE;
   }
 
-  *fdp = fd;
-
   int timeout = 2;
-  ioctl(*fdp, I2C_TIMEOUT, timeout);
+  ioctl(fd, I2C_TIMEOUT, timeout);
 
   int retries = 1;
-  ioctl(*fdp, I2C_RETRIES, retries);
+  ioctl(fd, I2C_RETRIES, retries);
+
+  ctx->fd = fd;
+  ctx->slave_addr = -1;
+  pthread_mutex_unlock(&ctx->mutex);
 
   TRY(i2c_scan(i2c_bus));
+  TRY(i2c_sched_start(i2c_bus));
 
   return STATUS_CODE_OK;
 }
 
 StatusCode i2c_deinit(I2cBus i2c_bus)
 {
-  int *fdp = NULL;
+  I2cBusCtx *ctx = i2c_get_ctx(i2c_bus);
 
-  if (i2c_bus == I2C_BUS_1) {
-    fdp = &i2c_fd_1;
-  }
-  else if (i2c_bus == I2C_BUS_2) {
-    fdp = &i2c_fd_2;
-  }
-  else {
+  if (!ctx) {
     perror("i2c_bus");
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  if (!fdp) {
-    return STATUS_CODE_OK;
-  }
+  // drain the scheduler first, it is the only user of the fd
+  i2c_sched_stop(i2c_bus);
 
-  fdp = NULL;
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->fd >= 0) {
+    close(ctx->fd);
+  }
+  ctx->fd = -1;
+  ctx->slave_addr = -1;
+  pthread_mutex_unlock(&ctx->mutex);
 
   return STATUS_CODE_OK;
 }
 
-static int smbus_quick(int fd, uint8_t addr)
+static int smbus_quick(I2cBusCtx *ctx, uint8_t addr)
 {
   struct i2c_smbus_ioctl_data args = {
     .read_write = I2C_SMBUS_WRITE,
@@ -122,133 +149,82 @@ static int smbus_quick(int fd, uint8_t addr)
     .data = NULL,
   };
 
-  if (ioctl(fd, I2C_SLAVE, addr) < 0) {
+  if (i2c_select_slave(ctx, addr) < 0) {
     return -1;
   }
-  return ioctl(fd, I2C_SMBUS, &args);
+  return ioctl(ctx->fd, I2C_SMBUS, &args);
 }
 
 StatusCode i2c_scan(I2cBus i2c_bus)
 {
-  int *fdp = NULL;
+  I2cBusCtx *ctx = i2c_get_ctx(i2c_bus);
 
-  if (i2c_bus == I2C_BUS_1) {
-    fdp = &i2c_fd_1;
-  }
-  else if (i2c_bus == I2C_BUS_2) {
-    fdp = &i2c_fd_2;
-  }
-  else {
+  if (!ctx) {
     perror("i2c_bus");
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  if (*fdp < 0) {
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->fd < 0) {
+    pthread_mutex_unlock(&ctx->mutex);
     return STATUS_CODE_NOT_INITIALIZED;
   }
 
   for (uint8_t addr = 0x03; addr <= 0x77; addr++) {
-    if (smbus_quick(*fdp, addr) == 0) {
+    if (smbus_quick(ctx, addr) == 0) {
       printf("Found device at 0x%02X\n", addr);
     }
   }
+  pthread_mutex_unlock(&ctx->mutex);
+
   return STATUS_CODE_OK;
 }
 
-StatusCode i2c_write(I2cBus i2c_bus, uint8_t addr, const uint8_t *buf,
-                     uint32_t len)
+StatusCode i2c_backend_transfer(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n)
 {
-  int *fdp = NULL;
-  if (i2c_bus == I2C_BUS_1) {
-    fdp = &i2c_fd_1;
-  }
-  else if (i2c_bus == I2C_BUS_2) {
-    fdp = &i2c_fd_2;
-  }
-  else {
-    return STATUS_CODE_INVALID_ARGS;
-  }
+  I2cBusCtx *ctx = i2c_get_ctx(i2c_bus);
 
-  if (!fdp || (*fdp < 0)) {
-    return STATUS_CODE_NOT_INITIALIZED;
+  if (!ctx) {
+    return STATUS_CODE_INVALID_ARGS;
   }
-  if (!buf || (len == 0)) {
+  if (!msgs || (n == 0) || (n > I2C_BATCH_MAX_MSGS)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  pthread_mutex_lock(&s_i2c_mutex);
-  if (ioctl(*fdp, I2C_SLAVE, addr) < 0) {
-    printf("ioctl failed\n");
-    pthread_mutex_unlock(&s_i2c_mutex);
-    return STATUS_CODE_FAILED;
-  }
-  pthread_mutex_unlock(&s_i2c_mutex);
+  struct i2c_msg kmsgs[I2C_BATCH_MAX_MSGS];
 
-  ssize_t w = write(*fdp, buf, len);
-  if (w < 0) {
-    fprintf(stderr, "I2C write to 0x%02X failed: %s (errno=%d)\n",
-            addr, strerror(errno), errno);
-    return STATUS_CODE_FAILED;
+  for (uint32_t i = 0; i < n; i++) {
+    kmsgs[i].addr = msgs[i].addr;
+    kmsgs[i].flags = (msgs[i].flags & I2C_MSG_FLAG_READ) ? I2C_M_RD : 0;
+    kmsgs[i].len = msgs[i].len;
+    kmsgs[i].buf = msgs[i].buf;
   }
-  if ((uint32_t)w != len) {
-    fprintf(stderr, "I2C write short: wrote %zd/%u to 0x%02X\n", w, len, addr);
-    return STATUS_CODE_FAILED;
-  }
-
-  // printf("I2C wrote to 0x%02X\n", addr);
 
-  return STATUS_CODE_OK;
-}
-
-StatusCode i2c_write_byte(I2cBus i2c_bus, uint8_t addr, uint8_t data)
-{
-  uint8_t data_buf[1];
-  data_buf[0] = data;
-  StatusCode ret = i2c_write(i2c_bus, addr, data_buf, 1);
-  return ret;
-}
-
-StatusCode i2c_write_then_read(I2cBus i2c_bus, uint8_t addr,
-                               const uint8_t *wbuf, uint32_t wlen,
-                               uint8_t *rbuf, uint32_t rlen)
-{
-  int *fdp = NULL;
-
-  if (i2c_bus == I2C_BUS_1) {
-    fdp = &i2c_fd_1;
-  }
-  else if (i2c_bus == I2C_BUS_2) {
-    fdp = &i2c_fd_2;
-  }
-  else {
-    return STATUS_CODE_INVALID_ARGS;
-  }
+  struct i2c_rdwr_ioctl_data data = {
+    .msgs = kmsgs,
+    .nmsgs = n,
+  };
 
-  if (!fdp || (*fdp < 0)) {
-    printf("i2c not initialized, fdp: %d\n", *fdp);
+  // I2C_RDWR carries the address in every message, so the whole transaction
+  // is atomic on the bus and the cached I2C_SLAVE target stays valid
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->fd < 0) {
+    pthread_mutex_unlock(&ctx->mutex);
     return STATUS_CODE_NOT_INITIALIZED;
   }
-  if (!wbuf || !rbuf) {
-    return STATUS_CODE_INVALID_ARGS;
-  }
+  int done = ioctl(ctx->fd, I2C_RDWR, &data);
+  pthread_mutex_unlock(&ctx->mutex);
 
-  struct i2c_msg msgs[2] = {
-    {.addr = addr, .flags = 0, .len = (uint16_t)wlen, .buf = (uint8_t *)wbuf},
-    {.addr = addr, .flags = I2C_M_RD, .len = (uint16_t)rlen, .buf = rbuf},
-  };
-
-  struct i2c_rdwr_ioctl_data data = {
-    .msgs = msgs,
-    .nmsgs = 2,
-  };
-
-  pthread_mutex_lock(&s_i2c_mutex);
-  if (ioctl(*fdp, I2C_RDWR, &data) < 0) {
-    printf("ioctl failed\n");
-    pthread_mutex_unlock(&s_i2c_mutex);
+  if (done < 0) {
+    fprintf(stderr, "I2C transfer of %u msgs to 0x%02X failed: %s (errno=%d)\n",
+            n, msgs[0].addr, strerror(errno), errno);
     return STATUS_CODE_FAILED;
   }
-  pthread_mutex_unlock(&s_i2c_mutex);
 
-  return STATUS_CODE_OK;
-}
\ No newline at end of file
+  // the adapter reports how many messages went out before it gave up
+  for (uint32_t i = 0; (i < (uint32_t)done) && (i < n); i++) {
+    msgs[i].status = STATUS_CODE_OK;
+  }
+
+  return ((uint32_t)done == n) ? STATUS_CODE_OK : STATUS_CODE_FAILED;
+}
@@ -0,0 +1,361 @@
+#include "cm4_i2c.h"
+#include "cm4_i2c_bsc.h"
+#include "cm4_i2c_sched.h"
+#ifdef CM4_I2C_BSC_SIM
+#include "cm4_i2c_sim.h"
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cm4_gpio.h"
+#include "cm4_time.h"
+
+#define BSC_PAGE_SIZE         4096UL
+#define BSC_TIMEOUT_SLACK_NS  (10ULL * 1000 * 1000)
+
+typedef struct {
+  unsigned long base;
+  int sda_pin;
+  int scl_pin;
+  GpioMode alt;
+  uint32_t hz;
+  volatile uint32_t *map; // page aligned mapping, regs points into it
+  volatile uint32_t *regs;
+  pthread_mutex_t mutex;
+} BscBusCtx;
+
+static BscBusCtx s_bsc_buses[2] = {
+  {.base = BSC1_BASE, .sda_pin = 2, .scl_pin = 3, .alt = GPIO_MODE_ALT0,
+   .hz = BSC_DEFAULT_HZ, .mutex = PTHREAD_MUTEX_INITIALIZER},
+  {.base = BSC2_BASE, .sda_pin = 4, .scl_pin = 5, .alt = GPIO_MODE_ALT5,
+   .hz = BSC_DEFAULT_HZ, .mutex = PTHREAD_MUTEX_INITIALIZER},
+};
+
+#define BSC_WRITE_REG(ctx, index, val) BSC_REG_WRITE(&(ctx)->regs[(index)], (val))
+#define BSC_READ_REG(ctx, index)       BSC_REG_READ(&(ctx)->regs[(index)])
+
+static BscBusCtx *bsc_get_ctx(I2cBus i2c_bus)
+{
+  if (i2c_bus == I2C_BUS_1) {
+    return &s_bsc_buses[0];
+  }
+  else if (i2c_bus == I2C_BUS_2) {
+    return &s_bsc_buses[1];
+  }
+
+  return NULL;
+}
+
+static uint32_t bsc_cdiv_for(uint32_t hz)
+{
+  uint32_t cdiv = (BSC_CORE_CLK_HZ + hz - 1) / hz;
+
+  // the divider ignores bit 0
+  return (cdiv + 1) & ~1U & BSC_CDIV_MASK;
+}
+
+/* Program DIV, DEL and CLKT for ctx->hz, ctx mutex held */
+static void bsc_apply_clock(BscBusCtx *ctx)
+{
+  uint32_t cdiv = bsc_cdiv_for(ctx->hz);
+
+  // sample and shift away from the SCL edges like i2c-bcm2835 does
+  uint32_t fedl = (cdiv / 16) ? (cdiv / 16) : 1;
+  uint32_t redl = (cdiv / 4) ? (cdiv / 4) : 1;
+
+  uint32_t clkt = (uint32_t)(((uint64_t)ctx->hz * BSC_CLKT_TIMEOUT_MS) / 1000);
+  if (clkt > BSC_CLKT_MAX) {
+    clkt = BSC_CLKT_MAX;
+  }
+
+  BSC_WRITE_REG(ctx, BSC_DIV, cdiv);
+  BSC_WRITE_REG(ctx, BSC_DEL, (fedl << BSC_DEL_FEDL_SHIFT) | (redl << BSC_DEL_REDL_SHIFT));
+  BSC_WRITE_REG(ctx, BSC_CLKT, clkt);
+}
+
+static StatusCode bsc_map_regs(I2cBus i2c_bus, BscBusCtx *ctx)
+{
+#ifdef CM4_I2C_BSC_SIM
+  ctx->map = i2c_bsc_sim_map_regs(i2c_bus);
+  ctx->regs = ctx->map;
+#else
+  (void)i2c_bus;
+
+  int fd = open("/dev/mem", O_RDWR | O_SYNC);
+
+  if (fd < 0) {
+    perror("open /dev/mem");
+    return STATUS_CODE_MEM_ACCESS_FAILURE;
+  }
+
+  unsigned long page = ctx->base & ~(BSC_PAGE_SIZE - 1);
+  void *map = mmap(NULL, BSC_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   (off_t)page);
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return STATUS_CODE_MEM_ACCESS_FAILURE;
+  }
+
+  ctx->map = map;
+  ctx->regs = (volatile uint32_t *)((volatile uint8_t *)map + (ctx->base - page));
+#endif
+
+  return STATUS_CODE_OK;
+}
+
+static void bsc_unmap_regs(BscBusCtx *ctx)
+{
+#ifndef CM4_I2C_BSC_SIM
+  munmap((void *)ctx->map, BSC_PAGE_SIZE);
+#endif
+  ctx->map = NULL;
+  ctx->regs = NULL;
+}
+
+/* Run one message as start, address, data, stop. The FIFO only holds 16
+   bytes, longer messages are fed or drained while the controller shifts,
+   it stretches the clock rather than underrun. ctx mutex held */
+static StatusCode bsc_xfer_msg(BscBusCtx *ctx, I2cMsg *msg)
+{
+  int is_read = (msg->flags & I2C_MSG_FLAG_READ) != 0;
+  uint32_t len = msg->len;
+  uint32_t pos = 0;
+
+  // wire time of address plus data, twice over for clock stretching
+  uint64_t wire_ns = ((uint64_t)(len + 1) * 9 * 1000000000ULL) / ctx->hz;
+  uint64_t deadline = time_now_ns() + 2 * wire_ns + BSC_TIMEOUT_SLACK_NS;
+
+  BSC_WRITE_REG(ctx, BSC_C, C_I2CEN | C_CLEAR);
+  BSC_WRITE_REG(ctx, BSC_S, S_CLKT | S_ERR | S_DONE);
+  BSC_WRITE_REG(ctx, BSC_A, msg->addr);
+  BSC_WRITE_REG(ctx, BSC_DLEN, len);
+
+  if (!is_read) {
+    // preload so the first data byte is ready when the address is acked
+    while ((pos < len) && (pos < BSC_FIFO_DEPTH)) {
+      BSC_WRITE_REG(ctx, BSC_FIFO, msg->buf[pos++]);
+    }
+  }
+
+  BSC_WRITE_REG(ctx, BSC_C, C_I2CEN | C_ST | (is_read ? C_READ : 0));
+
+  uint32_t s;
+  for (;;) {
+    s = BSC_READ_REG(ctx, BSC_S);
+
+    if (is_read) {
+      while ((s & S_RXD) && (pos < len)) {
+        msg->buf[pos++] = (uint8_t)BSC_READ_REG(ctx, BSC_FIFO);
+        s = BSC_READ_REG(ctx, BSC_S);
+      }
+    }
+    else {
+      while ((s & S_TXD) && (pos < len)) {
+        BSC_WRITE_REG(ctx, BSC_FIFO, msg->buf[pos++]);
+        s = BSC_READ_REG(ctx, BSC_S);
+      }
+    }
+
+    if (s & (S_DONE | S_ERR | S_CLKT)) {
+      break;
+    }
+
+    if (time_now_ns() > deadline) {
+      BSC_WRITE_REG(ctx, BSC_C, C_I2CEN | C_CLEAR);
+      printf("BSC transfer to 0x%02X timed out\n", msg->addr);
+      return STATUS_CODE_TIMEOUT;
+    }
+
+    // a byte takes ~90us at 100kHz, let the other bus's thread poll meanwhile
+    sched_yield();
+  }
+
+  // the tail of a read can still be sitting in the FIFO when DONE comes up
+  while (is_read && (pos < len) && (BSC_READ_REG(ctx, BSC_S) & S_RXD)) {
+    msg->buf[pos++] = (uint8_t)BSC_READ_REG(ctx, BSC_FIFO);
+  }
+
+  BSC_WRITE_REG(ctx, BSC_S, S_CLKT | S_ERR | S_DONE);
+
+  if (s & (S_ERR | S_CLKT)) {
+    // ERR is a NACK, CLKT a slave that stretched the clock for too long
+    BSC_WRITE_REG(ctx, BSC_C, C_I2CEN | C_CLEAR);
+    return STATUS_CODE_FAILED;
+  }
+
+  if (pos != len) {
+    return STATUS_CODE_FAILED;
+  }
+
+  msg->status = STATUS_CODE_OK;
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_get_initialized(I2cBus i2c_bus)
+{
+  BscBusCtx *ctx = bsc_get_ctx(i2c_bus);
+
+  if (!ctx) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (!ctx->regs) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_init(I2cBus i2c_bus)
+{
+  StatusCode ret = gpio_get_regs_initialized();
+
+  if (ret != STATUS_CODE_OK) {
+    printf("gpio regs are not initialized");
+    return ret;
+  }
+
+  BscBusCtx *ctx = bsc_get_ctx(i2c_bus);
+
+  if (!ctx) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->regs) {
+    pthread_mutex_unlock(&ctx->mutex);
+    return STATUS_CODE_ALREADY_INITIALIZED;
+  }
+
+  ret = bsc_map_regs(i2c_bus, ctx);
+  if (ret != STATUS_CODE_OK) {
+    pthread_mutex_unlock(&ctx->mutex);
+    return ret;
+  }
+
+  // nothing in the kernel muxes the pins for us
+  gpio_set_mode(ctx->sda_pin, ctx->alt);
+  gpio_set_mode(ctx->scl_pin, ctx->alt);
+
+  BSC_WRITE_REG(ctx, BSC_C, C_I2CEN | C_CLEAR);
+  BSC_WRITE_REG(ctx, BSC_S, S_CLKT | S_ERR | S_DONE);
+  bsc_apply_clock(ctx);
+  pthread_mutex_unlock(&ctx->mutex);
+
+  TRY(i2c_scan(i2c_bus));
+  TRY(i2c_sched_start(i2c_bus));
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_deinit(I2cBus i2c_bus)
+{
+  BscBusCtx *ctx = bsc_get_ctx(i2c_bus);
+
+  if (!ctx) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  i2c_sched_stop(i2c_bus);
+
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->regs) {
+    BSC_WRITE_REG(ctx, BSC_C, C_CLEAR);
+    bsc_unmap_regs(ctx);
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_scan(I2cBus i2c_bus)
+{
+  TRY(i2c_get_initialized(i2c_bus));
+
+  BscBusCtx *ctx = bsc_get_ctx(i2c_bus);
+
+  // the controller cannot send an address only write, probe with a one byte read
+  pthread_mutex_lock(&ctx->mutex);
+  for (uint8_t addr = 0x03; addr <= 0x77; addr++) {
+    uint8_t byte;
+    I2cMsg probe = I2C_MSG_READ(addr, &byte, 1);
+    if (bsc_xfer_msg(ctx, &probe) == STATUS_CODE_OK) {
+      printf("Found device at 0x%02X\n", addr);
+    }
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_backend_transfer(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n)
+{
+  BscBusCtx *ctx = bsc_get_ctx(i2c_bus);
+
+  if (!ctx) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+  if (!msgs || (n == 0) || (n > I2C_BATCH_MAX_MSGS)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  StatusCode ret = STATUS_CODE_OK;
+
+  pthread_mutex_lock(&ctx->mutex);
+  if (!ctx->regs) {
+    pthread_mutex_unlock(&ctx->mutex);
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  for (uint32_t i = 0; i < n; i++) {
+    ret = bsc_xfer_msg(ctx, &msgs[i]);
+    if (ret != STATUS_CODE_OK) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return ret;
+}
+
+StatusCode i2c_bsc_set_clock(I2cBus i2c_bus, uint32_t hz)
+{
+  BscBusCtx *ctx = bsc_get_ctx(i2c_bus);
+
+  if (!ctx || (hz < BSC_MIN_HZ) || (hz > BSC_MAX_HZ)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&ctx->mutex);
+  ctx->hz = hz;
+  if (ctx->regs) {
+    bsc_apply_clock(ctx);
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_bsc_get_clock(I2cBus i2c_bus, uint32_t *hz)
+{
+  BscBusCtx *ctx = bsc_get_ctx(i2c_bus);
+
+  if (!ctx || !hz) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&ctx->mutex);
+  *hz = BSC_CORE_CLK_HZ / bsc_cdiv_for(ctx->hz);
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return STATUS_CODE_OK;
+}
@@ -0,0 +1,293 @@
+#include "cm4_i2c.h"
+#include "cm4_i2c_bsc.h"
+#include "cm4_i2c_sim.h"
+#include "cm4_time.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BSC_SIM_NUM_REGS  (BSC_LEN / 4)
+#define BSC_SIM_MAX_DLEN  0xFFFFU
+
+/* Register model of one BSC block. Bytes move between the 16 byte FIFO and
+   the wire at one byte per 9 SCL periods, SCL being BSC_CORE_CLK_HZ / DIV,
+   measured against CLOCK_MONOTONIC whenever the driver touches a register.
+   An empty FIFO on a write or a full one on a read stalls the wire like the
+   real controller stretching SCL. A read fetches its data from the slave
+   when it starts, a write is handed to the slave whole at the stop, so a
+   missing slave shows up as ERR after the address byte or at the stop. */
+typedef struct {
+  volatile uint32_t regs[BSC_SIM_NUM_REGS];
+  pthread_mutex_t mutex;
+  int active;
+  int is_read;
+  int nack;
+  uint8_t addr;
+  uint32_t dlen;
+  uint32_t shifted;  // data bytes clocked over the wire so far
+  uint64_t clock_ns; // wire time accounted up to here
+  uint8_t fifo[BSC_FIFO_DEPTH];
+  uint32_t fifo_head;
+  uint32_t fifo_count;
+  uint32_t status; // latched DONE, ERR and CLKT
+  uint8_t data[BSC_SIM_MAX_DLEN];
+} BscSimBus;
+
+static BscSimBus s_bsc_sim[2] = {
+  {.mutex = PTHREAD_MUTEX_INITIALIZER},
+  {.mutex = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static I2cBus bsc_sim_bus_id(const BscSimBus *bus)
+{
+  return (bus == &s_bsc_sim[0]) ? I2C_BUS_1 : I2C_BUS_2;
+}
+
+/* Find the block and register index a mapped address belongs to */
+static BscSimBus *bsc_sim_lookup(volatile uint32_t *reg, uint32_t *index)
+{
+  for (int i = 0; i < 2; i++) {
+    volatile uint32_t *base = s_bsc_sim[i].regs;
+    if ((reg >= base) && (reg < base + BSC_SIM_NUM_REGS)) {
+      *index = (uint32_t)(reg - base);
+      return &s_bsc_sim[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Effective divider, bit 0 is ignored and 0 means 32768 */
+static uint32_t bsc_sim_cdiv(const BscSimBus *bus)
+{
+  uint32_t cdiv = bus->regs[BSC_DIV] & BSC_CDIV_MASK & ~1U;
+
+  return cdiv ? cdiv : 32768;
+}
+
+/* SCL periods of one byte plus its ACK */
+static uint64_t bsc_sim_byte_ns(const BscSimBus *bus)
+{
+  return (9ULL * bsc_sim_cdiv(bus) * 1000000000ULL) / BSC_CORE_CLK_HZ;
+}
+
+static void bsc_sim_fifo_push(BscSimBus *bus, uint8_t byte)
+{
+  if (bus->fifo_count < BSC_FIFO_DEPTH) {
+    bus->fifo[(bus->fifo_head + bus->fifo_count) % BSC_FIFO_DEPTH] = byte;
+    bus->fifo_count++;
+  }
+}
+
+static uint8_t bsc_sim_fifo_pop(BscSimBus *bus)
+{
+  if (bus->fifo_count == 0) {
+    return 0;
+  }
+
+  uint8_t byte = bus->fifo[bus->fifo_head];
+  bus->fifo_head = (bus->fifo_head + 1) % BSC_FIFO_DEPTH;
+  bus->fifo_count--;
+  return byte;
+}
+
+static void bsc_sim_finish(BscSimBus *bus, int err)
+{
+  bus->active = 0;
+  bus->status |= S_DONE | (err ? S_ERR : 0);
+}
+
+static void bsc_sim_start(BscSimBus *bus, uint32_t c)
+{
+  bus->active = 1;
+  bus->is_read = (c & C_READ) != 0;
+  bus->addr = (uint8_t)(bus->regs[BSC_A] & 0x7F);
+  bus->dlen = bus->regs[BSC_DLEN] & BSC_SIM_MAX_DLEN;
+  bus->shifted = 0;
+  bus->nack = 0;
+  bus->status &= ~S_DONE;
+  bus->clock_ns = time_now_ns() + bsc_sim_byte_ns(bus); // start and address
+
+  if (bus->is_read) {
+    I2cMsg msg = I2C_MSG_READ(bus->addr, bus->data, bus->dlen);
+    bus->nack = i2c_sim_bus_transfer(bsc_sim_bus_id(bus), &msg, 1) != STATUS_CODE_OK;
+  }
+}
+
+/* Clock bytes between the FIFO and the wire up to now, model mutex held */
+static void bsc_sim_advance(BscSimBus *bus)
+{
+  if (!bus->active) {
+    return;
+  }
+
+  uint64_t now = time_now_ns();
+  uint64_t byte_ns = bsc_sim_byte_ns(bus);
+
+  if (bus->nack) {
+    if (now >= bus->clock_ns) {
+      bsc_sim_finish(bus, 1);
+    }
+    return;
+  }
+
+  while ((bus->shifted < bus->dlen) && (now >= bus->clock_ns + byte_ns)) {
+    if (!bus->is_read && (bus->fifo_count == 0)) {
+      bus->clock_ns = now; // out of data, SCL held low
+      return;
+    }
+    if (bus->is_read && (bus->fifo_count == BSC_FIFO_DEPTH)) {
+      bus->clock_ns = now; // nowhere to put the next byte
+      return;
+    }
+
+    if (bus->is_read) {
+      bsc_sim_fifo_push(bus, bus->data[bus->shifted++]);
+    }
+    else {
+      bus->data[bus->shifted++] = bsc_sim_fifo_pop(bus);
+    }
+    bus->clock_ns += byte_ns;
+  }
+
+  // stop condition, about one SCL period
+  if ((bus->shifted == bus->dlen) && (now >= bus->clock_ns + byte_ns / 9)) {
+    int err = 0;
+    if (!bus->is_read) {
+      I2cMsg msg = I2C_MSG_WRITE(bus->addr, bus->data, bus->dlen);
+      err = i2c_sim_bus_transfer(bsc_sim_bus_id(bus), &msg, 1) != STATUS_CODE_OK;
+    }
+    bsc_sim_finish(bus, err);
+  }
+}
+
+static uint32_t bsc_sim_status(const BscSimBus *bus)
+{
+  uint32_t s = bus->status;
+
+  if (bus->active) {
+    s |= S_TA;
+    if (!bus->is_read && (bus->fifo_count < BSC_FIFO_DEPTH)) {
+      s |= S_TXW;
+    }
+    if (bus->is_read && (bus->fifo_count == BSC_FIFO_DEPTH)) {
+      s |= S_RXR;
+    }
+  }
+
+  if (bus->fifo_count < BSC_FIFO_DEPTH) {
+    s |= S_TXD;
+  }
+  if (bus->fifo_count > 0) {
+    s |= S_RXD;
+  }
+  if (bus->fifo_count == 0) {
+    s |= S_TXE;
+  }
+  if (bus->fifo_count == BSC_FIFO_DEPTH) {
+    s |= S_RXF;
+  }
+
+  return s;
+}
+
+volatile uint32_t *i2c_bsc_sim_map_regs(I2cBus i2c_bus)
+{
+  BscSimBus *bus = (i2c_bus == I2C_BUS_1) ? &s_bsc_sim[0] : &s_bsc_sim[1];
+
+  pthread_mutex_lock(&bus->mutex);
+  memset((void *)bus->regs, 0, sizeof(bus->regs));
+  bus->regs[BSC_DIV] = 0x5DC; // reset values from the datasheet
+  bus->regs[BSC_DEL] = 0x00300030;
+  bus->regs[BSC_CLKT] = 0x40;
+  bus->active = 0;
+  bus->fifo_head = 0;
+  bus->fifo_count = 0;
+  bus->status = 0;
+  pthread_mutex_unlock(&bus->mutex);
+
+  // the bus stats window starts when the driver takes the block over
+  I2cSimBusStats discard;
+  i2c_sim_get_stats(i2c_bus, &discard, 1);
+  i2c_sim_set_bus_speed(i2c_bus, BSC_CORE_CLK_HZ / 0x5DC);
+
+  return bus->regs;
+}
+
+void i2c_bsc_sim_reg_write(volatile uint32_t *reg, uint32_t val)
+{
+  uint32_t index;
+  BscSimBus *bus = bsc_sim_lookup(reg, &index);
+
+  if (!bus) {
+    return;
+  }
+
+  pthread_mutex_lock(&bus->mutex);
+  bsc_sim_advance(bus);
+
+  switch (index) {
+    case BSC_C:
+      if (val & C_CLEAR) {
+        bus->fifo_head = 0;
+        bus->fifo_count = 0;
+      }
+      if ((val & C_ST) && (val & C_I2CEN)) {
+        bsc_sim_start(bus, val);
+      }
+      else if (!(val & C_I2CEN)) {
+        bus->active = 0;
+      }
+      bus->regs[BSC_C] = val & ~(C_ST | C_CLEAR);
+      break;
+    case BSC_S:
+      bus->status &= ~(val & (S_DONE | S_ERR | S_CLKT));
+      break;
+    case BSC_FIFO:
+      bsc_sim_fifo_push(bus, (uint8_t)val);
+      break;
+    case BSC_DIV:
+      bus->regs[BSC_DIV] = val;
+      // keep the bus model's busy time in step with the rate the driver picked
+      i2c_sim_set_bus_speed(bsc_sim_bus_id(bus), BSC_CORE_CLK_HZ / bsc_sim_cdiv(bus));
+      break;
+    default:
+      bus->regs[index] = val;
+      break;
+  }
+
+  pthread_mutex_unlock(&bus->mutex);
+}
+
+uint32_t i2c_bsc_sim_reg_read(volatile uint32_t *reg)
+{
+  uint32_t index;
+  BscSimBus *bus = bsc_sim_lookup(reg, &index);
+
+  if (!bus) {
+    return 0;
+  }
+
+  uint32_t val;
+
+  pthread_mutex_lock(&bus->mutex);
+  bsc_sim_advance(bus);
+
+  switch (index) {
+    case BSC_S:
+      val = bsc_sim_status(bus);
+      break;
+    case BSC_FIFO:
+      val = bsc_sim_fifo_pop(bus);
+      break;
+    default:
+      val = bus->regs[index];
+      break;
+  }
+
+  pthread_mutex_unlock(&bus->mutex);
+
+  return val;
+}
@@ -0,0 +1,411 @@
+#include "cm4_i2c_regcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The messages one cache puts on the bus in a flush, built with its mutex held */
+typedef struct {
+  uint8_t data[I2C_REGCACHE_MAX_REGS * (I2C_REGCACHE_MAX_WIDTH + 1)];
+  I2cMsg msgs[I2C_REGCACHE_MAX_REGS];
+  uint16_t first[I2C_REGCACHE_MAX_REGS];
+  uint16_t last[I2C_REGCACHE_MAX_REGS];
+  uint32_t n;
+} RegCacheFlush;
+
+static bool regcache_range_ok(const I2cRegCache *cache, uint16_t reg, uint16_t count)
+{
+  return cache && (count > 0) && ((uint32_t)reg + count <= cache->num_regs);
+}
+
+/* A clean register may be rewritten with its cached value to join two bursts */
+static bool regcache_can_bridge(const I2cRegCache *cache, uint16_t reg)
+{
+  return cache->valid[reg] && (cache->kind[reg] != I2C_REG_VOLATILE);
+}
+
+/* Last register of the burst starting at reg, bridging at most max_gap clean
+   registers at a time, cache mutex held */
+static uint16_t regcache_burst_end(const I2cRegCache *cache, uint16_t reg, uint16_t max_gap)
+{
+  uint16_t end = reg;
+
+  if (!cache->auto_inc) {
+    return end;
+  }
+
+  uint16_t next = reg + 1;
+  while (next < cache->num_regs) {
+    if (cache->dirty[next]) {
+      end = next++;
+      continue;
+    }
+
+    // look past a short run of clean registers for more dirty ones
+    uint16_t gap_end = next;
+    while ((gap_end < cache->num_regs) && !cache->dirty[gap_end]
+           && ((gap_end - next) < max_gap)
+           && regcache_can_bridge(cache, gap_end)) {
+      gap_end++;
+    }
+
+    if ((gap_end >= cache->num_regs) || !cache->dirty[gap_end]) {
+      break;
+    }
+    next = gap_end;
+  }
+
+  return end;
+}
+
+static void regcache_collect_locked(const I2cRegCache *cache, uint16_t max_gap, RegCacheFlush *f)
+{
+  uint32_t pos = 0;
+
+  f->n = 0;
+
+  for (uint16_t reg = 0; reg < cache->num_regs; reg++) {
+    if (!cache->dirty[reg]) {
+      continue;
+    }
+
+    uint16_t end = regcache_burst_end(cache, reg, max_gap);
+    uint32_t len = (uint32_t)(end - reg + 1) * cache->width;
+
+    f->data[pos] = (uint8_t)reg;
+    memcpy(&f->data[pos + 1], &cache->values[reg * cache->width], len);
+
+    f->msgs[f->n] = I2C_MSG_WRITE(cache->addr, &f->data[pos], len + 1);
+    f->first[f->n] = reg;
+    f->last[f->n] = end;
+    f->n++;
+    pos += len + 1;
+    reg = end;
+  }
+}
+
+/* Apply the per message results of a collected flush, cache mutex held */
+static void regcache_complete_locked(I2cRegCache *cache, const RegCacheFlush *f)
+{
+  for (uint32_t i = 0; i < f->n; i++) {
+    for (uint16_t reg = f->first[i]; reg <= f->last[i]; reg++) {
+      if (f->msgs[i].status == STATUS_CODE_OK) {
+        cache->dirty[reg] = false;
+      }
+      else {
+        // the device may hold the old value, the new one or garbage
+        cache->valid[reg] = false;
+      }
+    }
+
+    if (f->msgs[i].status == STATUS_CODE_OK) {
+      cache->stats.regs_sent += f->last[i] - f->first[i] + 1;
+      cache->stats.msgs_sent++;
+    }
+  }
+}
+
+static StatusCode regcache_flush_locked(I2cRegCache *cache, uint16_t max_gap)
+{
+  RegCacheFlush f;
+
+  regcache_collect_locked(cache, max_gap, &f);
+  if (f.n == 0) {
+    return STATUS_CODE_OK;
+  }
+
+  // the transfer can fail before the scheduler sees a message, nothing counts as sent until
+  // the scheduler says so
+  for (uint32_t i = 0; i < f.n; i++) {
+    f.msgs[i].status = STATUS_CODE_FAILED;
+  }
+
+  StatusCode ret = i2c_transfer_batch(cache->bus, f.msgs, f.n);
+  regcache_complete_locked(cache, &f);
+
+  return ret;
+}
+
+static int regcache_cmp_addr(const void *a, const void *b)
+{
+  uintptr_t pa = (uintptr_t)*(I2cRegCache *const *)a;
+  uintptr_t pb = (uintptr_t)*(I2cRegCache *const *)b;
+
+  return (pa > pb) - (pa < pb);
+}
+
+StatusCode i2c_regcache_init(I2cRegCache *cache, I2cBus i2c_bus, uint8_t addr,
+                             uint16_t num_regs, uint8_t width)
+{
+  if (!cache || (num_regs == 0) || (num_regs > I2C_REGCACHE_MAX_REGS) || (width == 0)
+      || (width > I2C_REGCACHE_MAX_WIDTH) || (addr > 0x7F)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  memset(cache, 0, sizeof(*cache));
+  cache->bus = i2c_bus;
+  cache->addr = addr;
+  cache->num_regs = num_regs;
+  cache->width = width;
+  pthread_mutex_init(&cache->mutex, NULL);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_regcache_set_kind(I2cRegCache *cache, uint16_t reg, uint16_t count,
+                                 I2cRegKind kind)
+{
+  if (!regcache_range_ok(cache, reg, count) || (kind < I2C_REG_VOLATILE)
+      || (kind > I2C_REG_WRITE_ONLY)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  for (uint16_t i = 0; i < count; i++) {
+    cache->kind[reg + i] = (uint8_t)kind;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+void i2c_regcache_set_auto_inc(I2cRegCache *cache, bool enable)
+{
+  pthread_mutex_lock(&cache->mutex);
+  cache->auto_inc = enable;
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+StatusCode i2c_regcache_seed(I2cRegCache *cache, uint16_t reg, const uint8_t *vals,
+                             uint16_t count)
+{
+  if (!regcache_range_ok(cache, reg, count) || !vals) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  memcpy(&cache->values[reg * cache->width], vals, (size_t)count * cache->width);
+  for (uint16_t i = 0; i < count; i++) {
+    cache->valid[reg + i] = true;
+    cache->dirty[reg + i] = false;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_regcache_write(I2cRegCache *cache, uint16_t reg, const uint8_t *vals,
+                              uint16_t count)
+{
+  if (!regcache_range_ok(cache, reg, count) || !vals) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  for (uint16_t i = 0; i < count; i++) {
+    uint16_t r = reg + i;
+    uint8_t *slot = &cache->values[r * cache->width];
+    const uint8_t *val = &vals[i * cache->width];
+
+    cache->stats.writes++;
+
+    if ((cache->kind[r] != I2C_REG_VOLATILE) && cache->valid[r]
+        && (memcmp(slot, val, cache->width) == 0)) {
+      cache->stats.writes_dropped++;
+      continue;
+    }
+
+    memcpy(slot, val, cache->width);
+    cache->valid[r] = true;
+    cache->dirty[r] = true;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_regcache_flush(I2cRegCache *cache)
+{
+  if (!cache) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  StatusCode ret = regcache_flush_locked(cache, I2C_REGCACHE_MAX_GAP);
+  pthread_mutex_unlock(&cache->mutex);
+
+  return ret;
+}
+
+StatusCode i2c_regcache_flush_burst(I2cRegCache *cache)
+{
+  if (!cache) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  StatusCode ret = regcache_flush_locked(cache, cache->num_regs);
+  pthread_mutex_unlock(&cache->mutex);
+
+  return ret;
+}
+
+StatusCode i2c_regcache_flush_group(I2cRegCache *const *caches, uint32_t n)
+{
+  if (!caches || (n == 0) || (n > I2C_REGCACHE_MAX_GROUP)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  I2cRegCache *sorted[I2C_REGCACHE_MAX_GROUP];
+  for (uint32_t i = 0; i < n; i++) {
+    if (!caches[i] || (caches[i]->bus != caches[0]->bus)) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+    sorted[i] = caches[i];
+  }
+
+  // always lock in address order so two overlapping groups cannot deadlock
+  qsort(sorted, n, sizeof(sorted[0]), regcache_cmp_addr);
+  for (uint32_t i = 0; i < n; i++) {
+    if ((i > 0) && (sorted[i] == sorted[i - 1])) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+  }
+
+  // a few kB per device, too much for the stack once the group grows
+  RegCacheFlush *flushes = malloc(n * sizeof(*flushes));
+  I2cMsg *msgs = malloc(n * I2C_REGCACHE_MAX_REGS * sizeof(*msgs));
+  if (!flushes || !msgs) {
+    printf("i2c_regcache_flush_group - malloc failed\n");
+    free(flushes);
+    free(msgs);
+    return STATUS_CODE_OUT_OF_MEMORY;
+  }
+
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    pthread_mutex_lock(&sorted[i]->mutex);
+    regcache_collect_locked(sorted[i], sorted[i]->num_regs, &flushes[i]);
+    memcpy(&msgs[total], flushes[i].msgs, flushes[i].n * sizeof(*msgs));
+    total += flushes[i].n;
+  }
+
+  // as for a single flush, only messages the scheduler completed count as sent
+  for (uint32_t i = 0; i < total; i++) {
+    msgs[i].status = STATUS_CODE_FAILED;
+  }
+
+  StatusCode ret = STATUS_CODE_OK;
+  if (total > 0) {
+    ret = i2c_transfer_batch(sorted[0]->bus, msgs, total);
+  }
+
+  total = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    for (uint32_t m = 0; m < flushes[i].n; m++) {
+      flushes[i].msgs[m].status = msgs[total++].status;
+    }
+    regcache_complete_locked(sorted[i], &flushes[i]);
+    pthread_mutex_unlock(&sorted[i]->mutex);
+  }
+
+  free(flushes);
+  free(msgs);
+
+  return ret;
+}
+
+StatusCode i2c_regcache_read(I2cRegCache *cache, uint16_t reg, uint8_t *vals, uint16_t count)
+{
+  if (!regcache_range_ok(cache, reg, count) || !vals) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  uint32_t len = (uint32_t)count * cache->width;
+
+  pthread_mutex_lock(&cache->mutex);
+
+  bool known = true;
+  for (uint16_t i = 0; i < count; i++) {
+    uint16_t r = reg + i;
+    if ((cache->kind[r] == I2C_REG_VOLATILE) || !cache->valid[r]) {
+      known = false;
+    }
+  }
+
+  if (known) {
+    memcpy(vals, &cache->values[reg * cache->width], len);
+    cache->stats.reads_cached++;
+    pthread_mutex_unlock(&cache->mutex);
+    return STATUS_CODE_OK;
+  }
+
+  StatusCode ret = regcache_flush_locked(cache, I2C_REGCACHE_MAX_GAP);
+
+  if (ret == STATUS_CODE_OK) {
+    if (cache->auto_inc || (count == 1)) {
+      uint8_t start = (uint8_t)reg;
+      ret = i2c_write_then_read(cache->bus, cache->addr, &start, 1, vals, len);
+    }
+    else {
+      for (uint16_t i = 0; (i < count) && (ret == STATUS_CODE_OK); i++) {
+        uint8_t r = (uint8_t)(reg + i);
+        ret = i2c_write_then_read(cache->bus, cache->addr, &r, 1, &vals[i * cache->width],
+                                  cache->width);
+      }
+    }
+  }
+
+  if (ret == STATUS_CODE_OK) {
+    cache->stats.reads_bus++;
+
+    for (uint16_t i = 0; i < count; i++) {
+      uint16_t r = reg + i;
+      uint8_t *slot = &cache->values[r * cache->width];
+
+      if (cache->kind[r] == I2C_REG_CACHED) {
+        memcpy(slot, &vals[i * cache->width], cache->width);
+        cache->valid[r] = true;
+      }
+      else if ((cache->kind[r] == I2C_REG_WRITE_ONLY) && cache->valid[r]) {
+        // the device reads back junk here, report what was written
+        memcpy(&vals[i * cache->width], slot, cache->width);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return ret;
+}
+
+StatusCode i2c_regcache_invalidate(I2cRegCache *cache, uint16_t reg, uint16_t count)
+{
+  if (!regcache_range_ok(cache, reg, count)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  for (uint16_t i = 0; i < count; i++) {
+    cache->valid[reg + i] = false;
+    cache->dirty[reg + i] = false;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_regcache_get_stats(I2cRegCache *cache, I2cRegCacheStats *stats, int reset)
+{
+  if (!cache || !stats) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  *stats = cache->stats;
+  if (reset) {
+    memset(&cache->stats, 0, sizeof(cache->stats));
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  return STATUS_CODE_OK;
+}
@@ -0,0 +1,440 @@
+#include "cm4_i2c.h"
+#include "cm4_i2c_sched.h"
+#include "cm4_time.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  pthread_t thread;
+  int running;
+  int stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  I2cRequest *queue[I2C_PRIO_NUM_CLASSES]; // sorted by deadline
+  I2cSchedStats stats[I2C_PRIO_NUM_CLASSES];
+  uint8_t addr_prio[128];
+} SchedBus;
+
+static SchedBus s_sched[2] = {
+  {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER},
+  {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER},
+};
+
+static const uint64_t s_class_budget_ns[I2C_PRIO_NUM_CLASSES] = {
+  I2C_SCHED_ACTUATOR_BUDGET_NS,
+  I2C_SCHED_TELEMETRY_BUDGET_NS,
+  I2C_SCHED_BULK_BUDGET_NS,
+};
+
+static void *i2c_sched_thread_func(void *arg);
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected,
+                       const struct timespec *timeout)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, expected, timeout,
+          NULL, 0);
+}
+
+static void futex_wake_all(_Atomic uint32_t *addr)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, __INT_MAX__, NULL, NULL, 0);
+}
+
+static SchedBus *sched_get_bus(I2cBus i2c_bus)
+{
+  if (i2c_bus == I2C_BUS_1) {
+    return &s_sched[0];
+  }
+  else if (i2c_bus == I2C_BUS_2) {
+    return &s_sched[1];
+  }
+
+  return NULL;
+}
+
+static I2cBus sched_bus_id(const SchedBus *bus)
+{
+  return (bus == &s_sched[0]) ? I2C_BUS_1 : I2C_BUS_2;
+}
+
+/* Publish a finished request and wake anyone waiting on it, bus mutex not held */
+static void sched_complete(I2cRequest *req)
+{
+  // the callback may reuse the request, so fetch it before publishing done
+  I2cCallback cb = req->cb;
+  void *cb_arg = req->cb_arg;
+
+  atomic_store_explicit(&req->done, 1, memory_order_release);
+  futex_wake_all(&req->done);
+
+  if (cb) {
+    cb(req, cb_arg);
+  }
+}
+
+static StatusCode sched_run_request(SchedBus *bus, I2cRequest *req)
+{
+  for (uint32_t i = 0; i < req->n; i++) {
+    req->msgs[i].status = STATUS_CODE_FAILED;
+  }
+
+  for (uint32_t start = 0; start < req->n; start += I2C_BATCH_MAX_MSGS) {
+    uint32_t count = req->n - start;
+    if (count > I2C_BATCH_MAX_MSGS) {
+      count = I2C_BATCH_MAX_MSGS;
+    }
+
+    StatusCode ret = i2c_backend_transfer(sched_bus_id(bus), &req->msgs[start], count);
+    if (ret != STATUS_CODE_OK) {
+      return ret;
+    }
+  }
+
+  return STATUS_CODE_OK;
+}
+
+static void sched_record(SchedBus *bus, const I2cRequest *req)
+{
+  I2cSchedStats *st = &bus->stats[req->prio];
+  uint64_t wait_ns = req->start_ns - req->submit_ns;
+  uint64_t service_ns = req->done_ns - req->start_ns;
+
+  st->completed++;
+  if (req->status != STATUS_CODE_OK) {
+    st->failed++;
+  }
+  if (req->done_ns > req->due_ns) {
+    st->deadline_misses++;
+  }
+
+  st->wait_ns_total += wait_ns;
+  if (wait_ns > st->wait_ns_max) {
+    st->wait_ns_max = wait_ns;
+  }
+
+  st->service_ns_total += service_ns;
+  if (service_ns > st->service_ns_max) {
+    st->service_ns_max = service_ns;
+  }
+}
+
+static I2cRequest *sched_pop_next(SchedBus *bus)
+{
+  for (int prio = 0; prio < I2C_PRIO_NUM_CLASSES; prio++) {
+    I2cRequest *req = bus->queue[prio];
+    if (req) {
+      bus->queue[prio] = req->next;
+      bus->stats[prio].depth--;
+      return req;
+    }
+  }
+
+  return NULL;
+}
+
+static void *i2c_sched_thread_func(void *arg)
+{
+  SchedBus *bus = arg;
+
+  pthread_mutex_lock(&bus->mutex);
+  while (!bus->stopping) {
+    I2cRequest *req = sched_pop_next(bus);
+    if (!req) {
+      pthread_cond_wait(&bus->cond, &bus->mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&bus->mutex);
+
+    req->start_ns = time_now_ns();
+    req->status = sched_run_request(bus, req);
+    req->done_ns = time_now_ns();
+
+    pthread_mutex_lock(&bus->mutex);
+    sched_record(bus, req);
+    pthread_mutex_unlock(&bus->mutex);
+
+    sched_complete(req);
+
+    pthread_mutex_lock(&bus->mutex);
+  }
+  pthread_mutex_unlock(&bus->mutex);
+
+  return NULL;
+}
+
+StatusCode i2c_sched_start(I2cBus i2c_bus)
+{
+  SchedBus *bus = sched_get_bus(i2c_bus);
+
+  if (!bus) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&bus->mutex);
+  if (bus->running) {
+    pthread_mutex_unlock(&bus->mutex);
+    return STATUS_CODE_ALREADY_INITIALIZED;
+  }
+
+  bus->stopping = 0;
+  if (pthread_create(&bus->thread, NULL, i2c_sched_thread_func, bus) != 0) {
+    pthread_mutex_unlock(&bus->mutex);
+    printf("Failed to create i2c scheduler thread\n");
+    return STATUS_CODE_THREAD_FAILURE;
+  }
+  bus->running = 1;
+  pthread_mutex_unlock(&bus->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_sched_stop(I2cBus i2c_bus)
+{
+  SchedBus *bus = sched_get_bus(i2c_bus);
+
+  if (!bus) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&bus->mutex);
+  if (!bus->running) {
+    pthread_mutex_unlock(&bus->mutex);
+    return STATUS_CODE_OK;
+  }
+
+  bus->stopping = 1;
+  bus->running = 0;
+  pthread_cond_signal(&bus->cond);
+  pthread_mutex_unlock(&bus->mutex);
+
+  pthread_join(bus->thread, NULL);
+
+  // fail whatever never made it onto the bus
+  pthread_mutex_lock(&bus->mutex);
+  I2cRequest *pending = NULL;
+  I2cRequest *req;
+  while ((req = sched_pop_next(bus)) != NULL) {
+    req->next = pending;
+    pending = req;
+  }
+  pthread_mutex_unlock(&bus->mutex);
+
+  while (pending) {
+    req = pending;
+    pending = req->next;
+    req->status = STATUS_CODE_NOT_INITIALIZED;
+    req->done_ns = time_now_ns();
+    sched_complete(req);
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_sched_submit(I2cBus i2c_bus, I2cRequest *req)
+{
+  SchedBus *bus = sched_get_bus(i2c_bus);
+
+  if (!bus || !req || !req->msgs || (req->n == 0)
+      || (req->prio < 0) || (req->prio >= I2C_PRIO_NUM_CLASSES)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  for (uint32_t i = 0; i < req->n; i++) {
+    if (!req->msgs[i].buf || (req->msgs[i].len == 0)) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+  }
+
+  req->status = STATUS_CODE_FAILED;
+  req->submit_ns = time_now_ns();
+  req->start_ns = 0;
+  req->done_ns = 0;
+  req->due_ns = req->deadline_ns ? req->deadline_ns
+                : req->submit_ns + s_class_budget_ns[req->prio];
+  atomic_store_explicit(&req->done, 0, memory_order_relaxed);
+
+  pthread_mutex_lock(&bus->mutex);
+  if (!bus->running) {
+    pthread_mutex_unlock(&bus->mutex);
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  // earliest deadline first, ties keep submission order
+  I2cRequest **link = &bus->queue[req->prio];
+  while (*link && ((*link)->due_ns <= req->due_ns)) {
+    link = &(*link)->next;
+  }
+  req->next = *link;
+  *link = req;
+
+  I2cSchedStats *st = &bus->stats[req->prio];
+  if (++st->depth > st->depth_max) {
+    st->depth_max = st->depth;
+  }
+
+  pthread_cond_signal(&bus->cond);
+  pthread_mutex_unlock(&bus->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_sched_wait(I2cRequest *req, int timeout_ms)
+{
+  if (!req) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000 * 1000;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while (!atomic_load_explicit(&req->done, memory_order_acquire)) {
+    if (timeout_ms < 0) {
+      futex_wait(&req->done, 0, NULL);
+      continue;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t left_ns = (int64_t)(deadline.tv_sec - now.tv_sec) * 1000000000LL
+                      + (deadline.tv_nsec - now.tv_nsec);
+    if (left_ns <= 0) {
+      return STATUS_CODE_TIMEOUT;
+    }
+
+    struct timespec left = {
+      .tv_sec = left_ns / 1000000000LL, .tv_nsec = left_ns % 1000000000LL
+    };
+    futex_wait(&req->done, 0, &left);
+  }
+
+  return req->status;
+}
+
+StatusCode i2c_sched_set_addr_prio(I2cBus i2c_bus, uint8_t addr, I2cPrio prio)
+{
+  SchedBus *bus = sched_get_bus(i2c_bus);
+
+  if (!bus || (addr > 0x7F) || (prio < 0) || (prio >= I2C_PRIO_NUM_CLASSES)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  // stored offset by one so the zeroed table means telemetry
+  pthread_mutex_lock(&bus->mutex);
+  bus->addr_prio[addr] = (uint8_t)(prio + 1);
+  pthread_mutex_unlock(&bus->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_sched_get_stats(I2cBus i2c_bus, I2cPrio prio, I2cSchedStats *stats, int reset)
+{
+  SchedBus *bus = sched_get_bus(i2c_bus);
+
+  if (!bus || !stats || (prio < 0) || (prio >= I2C_PRIO_NUM_CLASSES)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&bus->mutex);
+  *stats = bus->stats[prio];
+  if (reset) {
+    uint32_t depth = bus->stats[prio].depth;
+    memset(&bus->stats[prio], 0, sizeof(I2cSchedStats));
+    bus->stats[prio].depth = depth;
+    bus->stats[prio].depth_max = depth;
+  }
+  pthread_mutex_unlock(&bus->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+/* Submit and wait, or run inline when called from a completion callback so
+   the scheduler thread never waits on itself */
+static StatusCode i2c_sched_run_sync(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n)
+{
+  SchedBus *bus = sched_get_bus(i2c_bus);
+
+  if (!bus) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&bus->mutex);
+  uint8_t stored = bus->addr_prio[msgs[0].addr & 0x7F];
+  int on_sched_thread = bus->running && pthread_equal(pthread_self(), bus->thread);
+  pthread_mutex_unlock(&bus->mutex);
+
+  I2cRequest req = {
+    .msgs = msgs,
+    .n = n,
+    .prio = stored ? (I2cPrio)(stored - 1) : I2C_PRIO_TELEMETRY,
+  };
+
+  if (on_sched_thread) {
+    return sched_run_request(bus, &req);
+  }
+
+  TRY(i2c_sched_submit(i2c_bus, &req));
+  return i2c_sched_wait(&req, -1);
+}
+
+StatusCode i2c_write(I2cBus i2c_bus, uint8_t addr, const uint8_t *buf,
+                     uint32_t len)
+{
+  TRY(i2c_get_initialized(i2c_bus));
+
+  if (!buf || (len == 0) || (len > UINT16_MAX)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  I2cMsg msg = I2C_MSG_WRITE(addr, buf, (uint16_t)len);
+  return i2c_sched_run_sync(i2c_bus, &msg, 1);
+}
+
+StatusCode i2c_write_byte(I2cBus i2c_bus, uint8_t addr, uint8_t data)
+{
+  uint8_t data_buf[1];
+  data_buf[0] = data;
+  StatusCode ret = i2c_write(i2c_bus, addr, data_buf, 1);
+  return ret;
+}
+
+StatusCode i2c_write_then_read(I2cBus i2c_bus, uint8_t addr,
+                               const uint8_t *wbuf, uint32_t wlen,
+                               uint8_t *rbuf, uint32_t rlen)
+{
+  TRY(i2c_get_initialized(i2c_bus));
+
+  if (!wbuf || !rbuf || (wlen == 0) || (rlen == 0)
+      || (wlen > UINT16_MAX) || (rlen > UINT16_MAX)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  I2cMsg msgs[] = {
+    I2C_MSG_WRITE(addr, wbuf, (uint16_t)wlen),
+    I2C_MSG_READ(addr, rbuf, (uint16_t)rlen),
+  };
+
+  return i2c_sched_run_sync(i2c_bus, msgs, I2C_NUM_MSGS(msgs));
+}
+
+StatusCode i2c_transfer_batch(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n)
+{
+  TRY(i2c_get_initialized(i2c_bus));
+
+  if (!msgs || (n == 0)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  return i2c_sched_run_sync(i2c_bus, msgs, n);
+}
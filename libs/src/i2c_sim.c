@@ -1,28 +1,141 @@
 #include "cm4_i2c.h"
+#include "cm4_i2c_sched.h"
+#include "cm4_i2c_sim.h"
 
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "cm4_gpio.h"
+#include "cm4_time.h"
 
-static uint32_t *bsc1 = NULL;
-static uint32_t *bsc2 = NULL;
+// start/repeated start and stop each hold the bus for about one SCL period,
+// every byte including the address is 8 bits plus the ACK
+#define I2C_SIM_START_BITS 1
+#define I2C_SIM_STOP_BITS  1
+#define I2C_SIM_BYTE_BITS  9
 
-StatusCode i2c_get_initialized(I2cBus i2c_bus)
-{
-  uint32_t *bsc = NULL;
+typedef struct {
+  int initialized;
+  uint32_t hz;
+  I2cSimDevice devices[I2C_SIM_MAX_DEVICES];
+  uint8_t num_devices;
+  I2cSimBusStats stats;
+  uint64_t stats_start_ns;
+  uint64_t free_at_ns;
+  pthread_mutex_t mutex;
+} SimBus;
+
+static SimBus s_buses[2] = {
+  {.hz = I2C_SIM_DEFAULT_HZ, .mutex = PTHREAD_MUTEX_INITIALIZER},
+  {.hz = I2C_SIM_DEFAULT_HZ, .mutex = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static volatile int s_realtime = 0;
+static volatile int s_trace = 0;
 
+static SimBus *sim_get_bus(I2cBus i2c_bus)
+{
   if (i2c_bus == I2C_BUS_1) {
-    bsc = bsc1;
+    return &s_buses[0];
   }
   else if (i2c_bus == I2C_BUS_2) {
-    bsc = bsc2;
+    return &s_buses[1];
   }
-  else {
-    perror("i2c_bus");
+
+  return NULL;
+}
+
+static I2cSimDevice *sim_find_device(SimBus *bus, uint8_t addr)
+{
+  for (uint8_t i = 0; i < bus->num_devices; i++) {
+    if (bus->devices[i].addr == addr) {
+      return &bus->devices[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Route one transaction (start, messages joined by repeated starts, stop) and charge its bus time */
+static StatusCode sim_bus_transfer(SimBus *bus, I2cMsg *msgs, uint32_t n, int paced)
+{
+  StatusCode ret = STATUS_CODE_OK;
+  uint64_t bits = I2C_SIM_STOP_BITS;
+
+  pthread_mutex_lock(&bus->mutex);
+
+  for (uint32_t i = 0; i < n; i++) {
+    I2cMsg *m = &msgs[i];
+    int is_read = (m->flags & I2C_MSG_FLAG_READ) != 0;
+    I2cSimDevice *dev = sim_find_device(bus, m->addr);
+
+    bits += I2C_SIM_START_BITS + I2C_SIM_BYTE_BITS;
+
+    StatusCode st = STATUS_CODE_FAILED;
+    if (dev && (m->len == 0)) {
+      st = STATUS_CODE_OK;
+    }
+    else if (dev && is_read && dev->read) {
+      st = dev->read(dev->ctx, m->buf, m->len);
+    }
+    else if (dev && !is_read && dev->write) {
+      st = dev->write(dev->ctx, m->buf, m->len);
+    }
+
+    if (s_trace) {
+      printf("[SIM] i2c %s 0x%02X %u bytes%s\n", is_read ? "read " : "write",
+             m->addr, m->len, (st == STATUS_CODE_OK) ? "" : " NACK");
+    }
+
+    if (st != STATUS_CODE_OK) {
+      // the adapter sends a stop after the NACK and drops the rest of the transaction
+      bus->stats.nacks++;
+      ret = STATUS_CODE_FAILED;
+      break;
+    }
+
+    bits += (uint64_t)I2C_SIM_BYTE_BITS * m->len;
+    m->status = STATUS_CODE_OK;
+    bus->stats.msgs++;
+    bus->stats.bytes += m->len;
+  }
+
+  uint64_t bus_ns = (bits * 1000000000ULL) / bus->hz;
+  bus->stats.transactions++;
+  bus->stats.busy_ns += bus_ns;
+
+  if (paced && s_realtime) {
+    // the bus is held for the whole transaction, later callers queue behind it
+    uint64_t now = time_now_ns();
+    uint64_t start = (bus->free_at_ns > now) ? bus->free_at_ns : now;
+    bus->free_at_ns = start + bus_ns;
+
+    struct timespec until = {
+      .tv_sec = (time_t)(bus->free_at_ns / 1000000000ULL),
+      .tv_nsec = (long)(bus->free_at_ns % 1000000000ULL)
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0) {
+    }
+  }
+
+  pthread_mutex_unlock(&bus->mutex);
+
+  return ret;
+}
+
+// the bsc_sim build runs i2c_bsc.c on the BSC register model instead of this front end
+#ifndef CM4_I2C_BSC_SIM
+StatusCode i2c_get_initialized(I2cBus i2c_bus)
+{
+  SimBus *bus = sim_get_bus(i2c_bus);
+
+  if (!bus) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  if (!bsc) {
+  if (!bus->initialized) {
     return STATUS_CODE_NOT_INITIALIZED;
   }
 
@@ -31,121 +144,191 @@ StatusCode i2c_get_initialized(I2cBus i2c_bus)
 
 StatusCode i2c_init(I2cBus i2c_bus)
 {
-  uint32_t *bsc = NULL;
+  StatusCode ret = gpio_get_regs_initialized();
 
-  if (i2c_bus == I2C_BUS_1) {
-    bsc = bsc1;
+  if (ret != STATUS_CODE_OK) {
+    printf("gpio regs are not initialized");
+    return ret;
   }
-  else if (i2c_bus == I2C_BUS_2) {
-    bsc = bsc2;
-  }
-  else {
-    perror("phys_base");
+
+  SimBus *bus = sim_get_bus(i2c_bus);
+
+  if (!bus) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  if (bsc != NULL) {
+  if (bus->initialized) {
     return STATUS_CODE_ALREADY_INITIALIZED;
   }
 
-  *bsc = 1U;
-
   if (i2c_bus == I2C_BUS_1) {
     gpio_set_mode(2, GPIO_MODE_ALT0);
     gpio_set_mode(3, GPIO_MODE_ALT0);
   }
-  else if (i2c_bus == I2C_BUS_2) {
+  else {
     gpio_set_mode(4, GPIO_MODE_ALT5);
     gpio_set_mode(5, GPIO_MODE_ALT5);
   }
-  else {
-    return STATUS_CODE_INVALID_ARGS;
-  }
 
-  printf("[SIM] i2c_init() bus: %u\n", i2c_bus);
+  pthread_mutex_lock(&bus->mutex);
+  bus->initialized = 1;
+  memset(&bus->stats, 0, sizeof(bus->stats));
+  bus->stats_start_ns = time_now_ns();
+  pthread_mutex_unlock(&bus->mutex);
 
   TRY(i2c_scan(i2c_bus));
+  TRY(i2c_sched_start(i2c_bus));
 
   return STATUS_CODE_OK;
 }
 
 StatusCode i2c_deinit(I2cBus i2c_bus)
 {
-  uint32_t *bsc = NULL;
+  SimBus *bus = sim_get_bus(i2c_bus);
 
-  if (i2c_bus == I2C_BUS_1) {
-    bsc = bsc1;
-  }
-  else if (i2c_bus == I2C_BUS_2) {
-    bsc = bsc2;
-  }
-  else {
-    perror("i2c_bus");
+  if (!bus) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  if (bsc) {
-    bsc = NULL;
-  }
+  i2c_sched_stop(i2c_bus);
+
+  pthread_mutex_lock(&bus->mutex);
+  bus->initialized = 0;
+  pthread_mutex_unlock(&bus->mutex);
 
-  printf("[SIM] i2c_deinit() bus: %u\n", i2c_bus);
   return STATUS_CODE_OK;
 }
 
 StatusCode i2c_scan(I2cBus i2c_bus)
 {
-  if (i2c_bus == I2C_BUS_1) {
-    if (!bsc1) {
-      return STATUS_CODE_NOT_INITIALIZED;
-    }
-  }
-  else if (i2c_bus == I2C_BUS_2) {
-    if (!bsc2) {
-      return STATUS_CODE_NOT_INITIALIZED;
+  TRY(i2c_get_initialized(i2c_bus));
+
+  SimBus *bus = sim_get_bus(i2c_bus);
+
+  // address only quick writes, like the real backend's smbus probe
+  for (uint8_t addr = 0x03; addr <= 0x77; addr++) {
+    I2cMsg probe = I2C_MSG_WRITE(addr, NULL, 0);
+    if (sim_bus_transfer(bus, &probe, 1, 1) == STATUS_CODE_OK) {
+      printf("Found device at 0x%02X\n", addr);
     }
   }
-  else {
-    perror("i2c_bus");
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode i2c_backend_transfer(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n)
+{
+  TRY(i2c_get_initialized(i2c_bus));
+
+  if (!msgs || (n == 0) || (n > I2C_BATCH_MAX_MSGS)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  printf("[SIM] i2c scan on bus %d\n", i2c_bus);
+  return sim_bus_transfer(sim_get_bus(i2c_bus), msgs, n, 1);
+}
+#endif
 
-  return STATUS_CODE_OK;
+StatusCode i2c_sim_bus_transfer(I2cBus i2c_bus, I2cMsg *msgs, uint32_t n)
+{
+  SimBus *bus = sim_get_bus(i2c_bus);
+
+  if (!bus || !msgs || (n == 0)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  return sim_bus_transfer(bus, msgs, n, 0);
 }
 
-StatusCode i2c_write(I2cBus i2c_bus, uint8_t addr, const uint8_t *buf,
-                     uint32_t len)
+StatusCode i2c_sim_attach(I2cBus i2c_bus, const I2cSimDevice *dev)
 {
+  SimBus *bus = sim_get_bus(i2c_bus);
 
-  if (i2c_bus == I2C_BUS_1) {
-    if (!bsc1) {
-      return STATUS_CODE_NOT_INITIALIZED;
-    }
+  if (!bus || !dev || (dev->addr > 0x7F)) {
+    return STATUS_CODE_INVALID_ARGS;
   }
-  else if (i2c_bus == I2C_BUS_2) {
-    if (!bsc2) {
-      return STATUS_CODE_NOT_INITIALIZED;
-    }
+
+  StatusCode ret = STATUS_CODE_OK;
+
+  pthread_mutex_lock(&bus->mutex);
+  I2cSimDevice *slot = sim_find_device(bus, dev->addr);
+  if (!slot && (bus->num_devices < I2C_SIM_MAX_DEVICES)) {
+    slot = &bus->devices[bus->num_devices++];
+  }
+
+  if (slot) {
+    *slot = *dev;
   }
   else {
-    perror("i2c_bus");
+    ret = STATUS_CODE_OUT_OF_MEMORY;
+  }
+  pthread_mutex_unlock(&bus->mutex);
+
+  return ret;
+}
+
+StatusCode i2c_sim_detach(I2cBus i2c_bus, uint8_t addr)
+{
+  SimBus *bus = sim_get_bus(i2c_bus);
+
+  if (!bus) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  printf("[SIM] i2c_write(): ");
+  StatusCode ret = STATUS_CODE_INVALID_ARGS;
 
-  for (uint32_t i = 0; i < len; i++) {
-    printf("%u ", buf[i]);
+  pthread_mutex_lock(&bus->mutex);
+  I2cSimDevice *slot = sim_find_device(bus, addr);
+  if (slot) {
+    *slot = bus->devices[--bus->num_devices];
+    ret = STATUS_CODE_OK;
   }
-  printf("at address: %u on bus: %u\n", addr, i2c_bus);
+  pthread_mutex_unlock(&bus->mutex);
+
+  return ret;
+}
+
+StatusCode i2c_sim_set_bus_speed(I2cBus i2c_bus, uint32_t hz)
+{
+  SimBus *bus = sim_get_bus(i2c_bus);
+
+  if (!bus || (hz == 0)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&bus->mutex);
+  bus->hz = hz;
+  pthread_mutex_unlock(&bus->mutex);
+
   return STATUS_CODE_OK;
 }
 
-StatusCode i2c_write_byte(I2cBus i2c_bus, uint8_t addr, uint8_t data)
+void i2c_sim_set_realtime(int enable)
 {
-  uint8_t data_buf[1];
-  data_buf[0] = data;
-  StatusCode ret = i2c_write(i2c_bus, addr, data_buf, 1);
-  return ret;
+  s_realtime = enable;
+}
+
+void i2c_sim_set_trace(int enable)
+{
+  s_trace = enable;
+}
+
+StatusCode i2c_sim_get_stats(I2cBus i2c_bus, I2cSimBusStats *stats, int reset)
+{
+  SimBus *bus = sim_get_bus(i2c_bus);
+
+  if (!bus || !stats) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&bus->mutex);
+  uint64_t now = time_now_ns();
+  *stats = bus->stats;
+  stats->window_ns = now - bus->stats_start_ns;
+  if (reset) {
+    memset(&bus->stats, 0, sizeof(bus->stats));
+    bus->stats_start_ns = now;
+  }
+  pthread_mutex_unlock(&bus->mutex);
+
+  return STATUS_CODE_OK;
 }
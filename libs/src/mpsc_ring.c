@@ -0,0 +1,161 @@
+#include "mpsc_ring.h"
+
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected,
+                       const struct timespec *timeout)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, expected, timeout,
+          NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+StatusCode mpsc_ring_init(MpscRing *rb, void *storage, uint32_t elem_size,
+                          uint32_t capacity)
+{
+  if (!rb || !storage || (elem_size == 0) || (capacity == 0)
+      || ((capacity & (capacity - 1)) != 0)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  atomic_init(&rb->head, 0);
+  atomic_init(&rb->dropped, 0);
+  atomic_init(&rb->tail, 0);
+  atomic_init(&rb->waiting, 0);
+  atomic_init(&rb->wake_seq, 0);
+  atomic_init(&rb->kicked, 0);
+  rb->seq = (_Atomic uint32_t *)storage;
+  rb->data = (uint8_t *)storage + (size_t)capacity * sizeof(uint32_t);
+  rb->elem_size = elem_size;
+  rb->capacity = capacity;
+
+  // slot i holds position i + 1 once published, so a fresh ring reads as empty
+  for (uint32_t i = 0; i < capacity; i++) {
+    atomic_init(&rb->seq[i], 0);
+  }
+
+  return STATUS_CODE_OK;
+}
+
+uint32_t mpsc_ring_push(MpscRing *rb, const void *elems, uint32_t n)
+{
+  if (n == 0) {
+    return 0;
+  }
+
+  uint32_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+  do {
+    uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    if (rb->capacity - (head - tail) < n) {
+      atomic_fetch_add_explicit(&rb->dropped, n, memory_order_relaxed);
+      return 0;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&rb->head, &head, head + n,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed));
+
+  // the slots from head on are ours, anything they held was consumed before tail moved past it
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t pos = head + i;
+    uint32_t slot = pos & (rb->capacity - 1);
+
+    memcpy(&rb->data[slot * rb->elem_size], (const uint8_t *)elems + i * rb->elem_size,
+           rb->elem_size);
+    atomic_store_explicit(&rb->seq[slot], pos + 1, memory_order_release);
+  }
+
+  // pairs with the fence in mpsc_ring_pop_wait so a sleeping consumer cannot
+  // miss the publish
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&rb->waiting, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&rb->wake_seq, 1, memory_order_relaxed);
+    futex_wake(&rb->wake_seq);
+  }
+
+  return n;
+}
+
+uint32_t mpsc_ring_pop(MpscRing *rb, void *out, uint32_t max_n)
+{
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  uint32_t count = 0;
+
+  // stop at the first slot whose producer has not finished with it yet
+  while (count < max_n) {
+    uint32_t pos = tail + count;
+    uint32_t slot = pos & (rb->capacity - 1);
+
+    if (atomic_load_explicit(&rb->seq[slot], memory_order_acquire) != pos + 1) {
+      break;
+    }
+
+    memcpy((uint8_t *)out + count * rb->elem_size, &rb->data[slot * rb->elem_size],
+           rb->elem_size);
+    count++;
+  }
+
+  if (count > 0) {
+    atomic_store_explicit(&rb->tail, tail + count, memory_order_release);
+  }
+
+  return count;
+}
+
+static int mpsc_ring_published(MpscRing *rb)
+{
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  uint32_t slot = tail & (rb->capacity - 1);
+
+  return atomic_load_explicit(&rb->seq[slot], memory_order_relaxed) == tail + 1;
+}
+
+uint32_t mpsc_ring_pop_wait(MpscRing *rb, void *out, uint32_t max_n,
+                            int timeout_ms)
+{
+  uint32_t n = mpsc_ring_pop(rb, out, max_n);
+  if ((n > 0) || (timeout_ms == 0)) {
+    return n;
+  }
+
+  struct timespec timeout = {
+    .tv_sec = timeout_ms / 1000, .tv_nsec = (long)(timeout_ms % 1000) * 1000 * 1000
+  };
+
+  uint32_t seq = atomic_load_explicit(&rb->wake_seq, memory_order_relaxed);
+
+  atomic_store_explicit(&rb->waiting, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  // only sleep if nothing was published and nobody kicked us since we looked
+  if (!mpsc_ring_published(rb) && !atomic_exchange_explicit(&rb->kicked, 0, memory_order_relaxed)) {
+    futex_wait(&rb->wake_seq, seq, (timeout_ms < 0) ? NULL : &timeout);
+  }
+
+  atomic_store_explicit(&rb->waiting, 0, memory_order_relaxed);
+
+  return mpsc_ring_pop(rb, out, max_n);
+}
+
+void mpsc_ring_wake(MpscRing *rb)
+{
+  atomic_store_explicit(&rb->kicked, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&rb->wake_seq, 1, memory_order_seq_cst);
+  futex_wake(&rb->wake_seq);
+}
+
+uint32_t mpsc_ring_get_dropped(MpscRing *rb, int reset)
+{
+  if (reset) {
+    return atomic_exchange_explicit(&rb->dropped, 0, memory_order_relaxed);
+  }
+  return atomic_load_explicit(&rb->dropped, memory_order_relaxed);
+}
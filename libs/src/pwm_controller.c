@@ -2,21 +2,107 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cm4_i2c.h"
+#include "cm4_i2c_regcache.h"
+#include "cm4_i2c_sched.h"
+#include "cm4_time.h"
 
-#define PCA_WRITE_REG(reg, val)                                                \
-        i2c_write(I2C_BUS_2, PCA_I2C_ADDR, (uint8_t[]) {reg, val}, 2);
+#define PCA_NUM_REGS (PCA9685_LEN + 1)
 
-#define PCA_DEINIT_CHANNEL(channelNum) \
-        pwm_controller_stop_channel(PCA_LED##channelNum##_ON_L);
+static PwmController s_pwm_default = {
+  .bus = I2C_BUS_2,
+  .addr = PCA_I2C_ADDR,
+};
 
-static bool isInitialized = false;
+static const uint8_t s_led_all_off[4] = {0x00, 0x00, 0x00, LEDX_FULL_OFF};
+static const uint8_t s_led_all_on[4] = {0x00, LEDX_FULL_ON, 0x00, 0x00};
 
-StatusCode pwm_controller_get_initialized()
+static StatusCode pca_write_reg(PwmController *pwm, uint8_t reg, uint8_t val)
+{
+  return i2c_regcache_write(&pwm->cache, reg, &val, 1);
+}
+
+static bool pca_channel_valid(PCAChannel channel)
+{
+  return PCA_CHANNEL_VALID(channel);
+}
+
+static bool pca_update_valid(PCAChannel channel, float delay_percentage, float duty_cycle)
+{
+  return pca_channel_valid(channel) && (delay_percentage >= 0.0f) && (duty_cycle >= 0.0f)
+         && (delay_percentage + duty_cycle <= 1.0f);
+}
+
+/* LEDn_ON_L..OFF_H for a pulse starting at delay and lasting duty, both fractions of a period */
+static void pca_channel_regs(float delay_percentage, float duty_cycle, uint8_t buf[4])
+{
+  if (duty_cycle >= 1.0f) {
+    // 4096 counts would wrap to an off count of 0 and keep the output low
+    memcpy(buf, s_led_all_on, 4);
+    return;
+  }
+
+  uint16_t high_start = delay_percentage * PWM_RESOLUTION;
+  uint16_t low_start = high_start + (duty_cycle * PWM_RESOLUTION);
+
+  buf[0] = high_start & 0xFF;
+  buf[1] = (high_start >> 8) & 0xF;
+  buf[2] = low_start & 0xFF;
+  buf[3] = (low_start >> 8) & 0xF;
+}
+
+/* A broadcast sets every LEDn register behind the cache's back, mirror it */
+static StatusCode pca_seed_all_channels(PwmController *pwm, const uint8_t led[4])
 {
-  if (isInitialized) {
+  for (uint8_t channel = 0; channel < PCA_NUM_CHANNELS; channel++) {
+    TRY(i2c_regcache_seed(&pwm->cache, PCA_LED_ON_L(channel), led, 4));
+  }
+
+  return i2c_regcache_seed(&pwm->cache, PCA_ALL_LED_ON_L, led, 4);
+}
+
+static StatusCode pca_broadcast(PwmController *pwm, const uint8_t led[4])
+{
+  TRY(pwm_controller_dev_get_initialized(pwm));
+
+  uint8_t buf[5] = {PCA_ALL_LED_ON_L, led[0], led[1], led[2], led[3]};
+  I2cMsg msg = I2C_MSG_WRITE(pwm->addr, buf, sizeof(buf));
+
+  StatusCode ret = i2c_transfer_batch(pwm->bus, &msg, 1);
+  if (ret != STATUS_CODE_OK) {
+    // some channels may have taken it, the rest still hold their old value
+    i2c_regcache_invalidate(&pwm->cache, PCA_LED0_ON_L, PCA_NUM_CHANNELS * 4);
+    return ret;
+  }
+
+  return pca_seed_all_channels(pwm, led);
+}
+
+/* Stage one update, the caller has validated it */
+static StatusCode pca_stage_channel(PwmController *pwm, PCAChannel channel, float delay_percentage,
+                                    float duty_cycle)
+{
+  uint8_t buf[4];
+
+  pca_channel_regs(delay_percentage, duty_cycle, buf);
+
+  return i2c_regcache_write(&pwm->cache, channel, buf, 4);
+}
+
+// ================================
+// Per device
+// ================================
+StatusCode pwm_controller_dev_get_initialized(const PwmController *pwm)
+{
+  if (!pwm) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (pwm->initialized) {
     return STATUS_CODE_OK;
   }
   else {
@@ -24,110 +110,318 @@ StatusCode pwm_controller_get_initialized()
   }
 }
 
-StatusCode pwm_controller_init(uint32_t pwm_freq)
+StatusCode pwm_controller_dev_init(PwmController *pwm, I2cBus i2c_bus, uint8_t addr, uint32_t pwm_freq)
 {
-  if ((pwm_freq < 24) || (pwm_freq > 1526)) {
+  if (!pwm || (addr > 0x7F) || (pwm_freq < 24) || (pwm_freq > 1526)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  StatusCode ret = i2c_get_initialized(I2C_BUS_2);
+  StatusCode ret = i2c_get_initialized(i2c_bus);
   if (ret != STATUS_CODE_OK) {
     printf("i2c bus: %u is not initialized\n", ret);
     return ret;
   }
 
-  uint8_t mode1 = 0;
+  pwm->bus = i2c_bus;
+  pwm->addr = addr;
+  pwm->initialized = false;
 
-  ret = i2c_write_then_read(I2C_BUS_2, PCA_I2C_ADDR, (uint8_t[]) {PCA_MODE1}, 1,
-                            &mode1, 1);
+  // servo frames go ahead of telemetry and fifo drains on the shared bus
+  TRY(i2c_sched_set_addr_prio(i2c_bus, addr, I2C_PRIO_ACTUATOR));
 
+  // MODE1 to PRE_SCALE only change when we write them, the ALL_LED
+  // registers read back as zero and TESTMODE stays uncached
+  TRY(i2c_regcache_init(&pwm->cache, i2c_bus, addr, PCA_NUM_REGS, 1));
+  TRY(i2c_regcache_set_kind(&pwm->cache, PCA_MODE1, PCA_PRE_SCALE + 1, I2C_REG_CACHED));
+  TRY(i2c_regcache_set_kind(&pwm->cache, PCA_ALL_LED_ON_L, 4, I2C_REG_WRITE_ONLY));
+
+  // the chip may have been left configured by a previous run, this is the only read
+  uint8_t mode1 = 0;
 
+  ret = i2c_regcache_read(&pwm->cache, PCA_MODE1, &mode1, 1);
   if (ret != STATUS_CODE_OK) {
-    printf("i2c_write_then_read() failed with exit code %d\n", ret);
+    printf("i2c_regcache_read() failed with exit code %d\n", ret);
     return ret;
   }
 
   uint8_t mode1_sleep = (mode1 & ~MODE1_RESTART) | MODE1_SLEEP;
 
-  PCA_WRITE_REG(PCA_MODE1, mode1_sleep);
-
   float prescale_f = (float)(PCA_DEFAULT_FREQ / (4096 * (float)pwm_freq)) - 1;
 
   uint8_t prescale_val = (uint8_t)(prescale_f + 0.5f);   // rounding
 
-  PCA_WRITE_REG(PCA_PRE_SCALE, prescale_val);
+  // prescale can only be written while the oscillator is asleep, a flush
+  // sends MODE1 before PRE_SCALE
+  TRY(pca_write_reg(pwm, PCA_MODE1, mode1_sleep));
+  TRY(pca_write_reg(pwm, PCA_PRE_SCALE, prescale_val));
+  ret = i2c_regcache_flush(&pwm->cache);
+  if (ret == STATUS_CODE_OK) {
+    TRY(pca_write_reg(pwm, PCA_MODE1, mode1_sleep & ~MODE1_SLEEP));
+    ret = i2c_regcache_flush(&pwm->cache);
+  }
+  if (ret != STATUS_CODE_OK) {
+    printf("i2c_regcache_flush() failed with exit code %d\n", ret);
+    return ret;
+  }
 
-  PCA_WRITE_REG(PCA_MODE1, mode1_sleep & ~MODE1_SLEEP);
+  // the counter starts over when the oscillator wakes, periods are counted from here
+  pwm->period_origin_ns = time_now_ns();
+  pwm->period_ns = (uint64_t)PWM_RESOLUTION * (prescale_val + 1) * 1000000000ULL / PCA_DEFAULT_FREQ;
 
+  // oscillator needs 500us to stabilize before restart
   usleep(1000);
-  PCA_WRITE_REG(PCA_MODE1,
-                (mode1_sleep & ~MODE1_SLEEP) | MODE1_RESTART | MODE1_AI);
-  PCA_WRITE_REG(PCA_MODE2, MODE2_OUTDRV);
 
-  uint8_t mode_read = 0;
+  uint8_t mode1_awake = (mode1_sleep & ~MODE1_SLEEP) | MODE1_AI;
 
+  TRY(pca_write_reg(pwm, PCA_MODE1, mode1_awake | MODE1_RESTART));
+  TRY(pca_write_reg(pwm, PCA_MODE2, MODE2_OUTDRV));
+  ret = i2c_regcache_flush(&pwm->cache);
+  if (ret != STATUS_CODE_OK) {
+    printf("i2c_regcache_flush() failed with exit code %d\n", ret);
+    return ret;
+  }
 
-  i2c_write_then_read(I2C_BUS_2, PCA_I2C_ADDR, (uint8_t[]) {PCA_MODE1}, 1,
-                      &mode_read, 1);
+  // RESTART clears itself once the outputs are back, and from here on the
+  // register pointer auto increments so channel updates go out as bursts
+  TRY(i2c_regcache_seed(&pwm->cache, PCA_MODE1, &mode1_awake, 1));
+  i2c_regcache_set_auto_inc(&pwm->cache, true);
 
-  printf("PCA9685 MODE1 = 0x%02X\n", mode_read);
-  i2c_write_then_read(I2C_BUS_2, PCA_I2C_ADDR, (uint8_t[]) {PCA_MODE2}, 1,
-                      &mode_read, 1);
+  uint8_t mode_read[2] = {0, 0};
+  TRY(i2c_regcache_read(&pwm->cache, PCA_MODE1, mode_read, 2));
 
-  printf("PCA9685 MODE2 = 0x%02X\n", mode_read);
+  printf("PCA9685 0x%02X MODE1 = 0x%02X\n", addr, mode_read[0]);
+  printf("PCA9685 0x%02X MODE2 = 0x%02X\n", addr, mode_read[1]);
 
-  isInitialized = true;
+  pwm->pwm_freq = pwm_freq;
+  pwm->initialized = true;
   return STATUS_CODE_OK;
 }
 
-StatusCode pwm_controller_deinit()
+StatusCode pwm_controller_dev_deinit(PwmController *pwm)
 {
+  TRY(pwm_controller_dev_get_initialized(pwm));
+
+  // every channel off before the oscillator stops, in one transaction. A
+  // flush would send MODE1 first, so the order is spelled out here
+  uint8_t all_off[5] = {PCA_ALL_LED_ON_L, s_led_all_off[0], s_led_all_off[1], s_led_all_off[2],
+                        s_led_all_off[3]};
+  uint8_t sleep[2] = {PCA_MODE1, MODE1_SLEEP};
+  I2cMsg msgs[2] = {
+    I2C_MSG_WRITE(pwm->addr, all_off, sizeof(all_off)),
+    I2C_MSG_WRITE(pwm->addr, sleep, sizeof(sleep)),
+  };
+
+  StatusCode ret = i2c_transfer_batch(pwm->bus, msgs, 2);
+  if (ret != STATUS_CODE_OK) {
+    printf("i2c_transfer_batch() failed with exit code %d\n", ret);
+    i2c_regcache_invalidate(&pwm->cache, PCA_MODE1, PCA_NUM_REGS);
+    return ret;
+  }
 
-  PCA_DEINIT_CHANNEL(0);
-  PCA_DEINIT_CHANNEL(1);
-  PCA_DEINIT_CHANNEL(2);
-  PCA_DEINIT_CHANNEL(3);
-  PCA_DEINIT_CHANNEL(4);
-  PCA_DEINIT_CHANNEL(5);
+  TRY(pca_seed_all_channels(pwm, s_led_all_off));
+  TRY(i2c_regcache_seed(&pwm->cache, PCA_MODE1, &sleep[1], 1));
 
-  PCA_WRITE_REG(PCA_MODE1, MODE1_SLEEP);
+  // that also turned auto increment off
+  i2c_regcache_set_auto_inc(&pwm->cache, false);
 
   return STATUS_CODE_OK;
 }
 
-StatusCode pwm_controller_set_channel(PCAChannel channel, float delay_percentage, float duty_cycle)
+StatusCode pwm_controller_dev_set_channels(PwmController *pwm, const PwmChannelUpdate *updates,
+                                           size_t n)
 {
-  if (delay_percentage + duty_cycle > 1.0f) {
+  if (!updates || (n == 0)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  uint16_t high_start = delay_percentage * PWM_RESOLUTION;
-  uint16_t low_start = high_start + (duty_cycle * PWM_RESOLUTION);
+  TRY(pwm_controller_dev_get_initialized(pwm));
 
-  uint8_t buf[5];
-  buf[0] = channel;
-  buf[1] = high_start & 0xFF;
-  buf[2] = (high_start >> 8) & 0xF;
-  buf[3] = low_start & 0xFF;
-  buf[4] = (low_start >> 8) & 0xF;
+  // reject the whole set before staging any of it
+  for (size_t i = 0; i < n; i++) {
+    if (!pca_update_valid(updates[i].channel, updates[i].delay_percentage, updates[i].duty_cycle)) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+  }
 
-  StatusCode ret = i2c_write(I2C_BUS_2, PCA_I2C_ADDR, buf, 5);
+  for (size_t i = 0; i < n; i++) {
+    TRY(pca_stage_channel(pwm, updates[i].channel, updates[i].delay_percentage,
+                          updates[i].duty_cycle));
+  }
+
+  // the chip latches new counts at the stop, so one message from the lowest
+  // changed register to the highest moves every output in the same period
+  return i2c_regcache_flush_burst(&pwm->cache);
+}
+
+StatusCode pwm_controller_dev_all_off(PwmController *pwm)
+{
+  return pca_broadcast(pwm, s_led_all_off);
+}
+
+StatusCode pwm_controller_dev_all_on(PwmController *pwm)
+{
+  return pca_broadcast(pwm, s_led_all_on);
+}
+
+StatusCode pwm_controller_dev_get_timing(const PwmController *pwm, uint64_t *period_ns,
+                                        uint64_t *origin_ns)
+{
+  if (!period_ns || !origin_ns) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  TRY(pwm_controller_dev_get_initialized(pwm));
+
+  *period_ns = pwm->period_ns;
+  *origin_ns = pwm->period_origin_ns;
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode pwm_controller_dev_get_cache_stats(PwmController *pwm, I2cRegCacheStats *stats, int reset)
+{
+  if (!pwm) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  return i2c_regcache_get_stats(&pwm->cache, stats, reset);
+}
+
+StatusCode pwm_controller_set_fanout(const PwmFanoutUpdate *updates, size_t n)
+{
+  if (!updates || (n == 0)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  PwmController *devs[PWM_FANOUT_MAX_DEVS];
+  uint32_t num_devs = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    TRY(pwm_controller_dev_get_initialized(updates[i].pwm));
+    if (!pca_update_valid(updates[i].channel, updates[i].delay_percentage, updates[i].duty_cycle)) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+
+    uint32_t d = 0;
+    while ((d < num_devs) && (devs[d] != updates[i].pwm)) {
+      d++;
+    }
+    if (d == num_devs) {
+      if (num_devs == PWM_FANOUT_MAX_DEVS) {
+        return STATUS_CODE_INVALID_ARGS;
+      }
+      devs[num_devs++] = updates[i].pwm;
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    TRY(pca_stage_channel(updates[i].pwm, updates[i].channel, updates[i].delay_percentage,
+                          updates[i].duty_cycle));
+  }
+
+  // one burst per chip, the chips sharing a bus go out in one batch
+  StatusCode ret = STATUS_CODE_OK;
+  bool sent[PWM_FANOUT_MAX_DEVS] = {false};
+
+  for (uint32_t d = 0; d < num_devs; d++) {
+    if (sent[d]) {
+      continue;
+    }
+
+    I2cRegCache *caches[PWM_FANOUT_MAX_DEVS];
+    uint32_t num_caches = 0;
+    for (uint32_t o = d; o < num_devs; o++) {
+      if (!sent[o] && (devs[o]->bus == devs[d]->bus)) {
+        caches[num_caches++] = &devs[o]->cache;
+        sent[o] = true;
+      }
+    }
+
+    StatusCode bus_ret = i2c_regcache_flush_group(caches, num_caches);
+    if (bus_ret != STATUS_CODE_OK) {
+      ret = bus_ret;
+    }
+  }
 
   return ret;
 }
 
+// ================================
+// Default device
+// ================================
+PwmController *pwm_controller_get_default()
+{
+  return &s_pwm_default;
+}
+
+StatusCode pwm_controller_get_initialized()
+{
+  return pwm_controller_dev_get_initialized(&s_pwm_default);
+}
+
+StatusCode pwm_controller_init(uint32_t pwm_freq)
+{
+  return pwm_controller_dev_init(&s_pwm_default, I2C_BUS_2, PCA_I2C_ADDR, pwm_freq);
+}
+
+StatusCode pwm_controller_deinit()
+{
+  return pwm_controller_dev_deinit(&s_pwm_default);
+}
+
+StatusCode pwm_controller_set_channel(PCAChannel channel, float delay_percentage, float duty_cycle)
+{
+  PwmChannelUpdate update = {
+    .channel = channel,
+    .delay_percentage = delay_percentage,
+    .duty_cycle = duty_cycle,
+  };
+
+  return pwm_controller_dev_set_channels(&s_pwm_default, &update, 1);
+}
+
+StatusCode pwm_controller_set_channels(const PwmChannelUpdate *updates, size_t n)
+{
+  return pwm_controller_dev_set_channels(&s_pwm_default, updates, n);
+}
+
+StatusCode pwm_controller_all_off()
+{
+  return pwm_controller_dev_all_off(&s_pwm_default);
+}
+
+StatusCode pwm_controller_all_on()
+{
+  return pwm_controller_dev_all_on(&s_pwm_default);
+}
+
 StatusCode pwm_controller_stop_channel(PCAChannel channel)
 {
+  if (!pca_channel_valid(channel)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
   // write to channel LEDX_OFF_H
-  StatusCode ret = PCA_WRITE_REG(channel + 1, 0x00);
-  ret = PCA_WRITE_REG(channel + 3, LEDX_FULL_OFF);
-  return ret;
+  TRY(pca_write_reg(&s_pwm_default, channel + 1, 0x00));
+  TRY(pca_write_reg(&s_pwm_default, channel + 3, LEDX_FULL_OFF));
+
+  return i2c_regcache_flush(&s_pwm_default.cache);
 }
 
 StatusCode pwm_controller_digital_set_channel(PCAChannel channel)
 {
-  // write to channel LEDX_ON_H
-  StatusCode ret = PCA_WRITE_REG(channel + 3, 0x00);
-  ret = PCA_WRITE_REG(channel + 1, LEDX_FULL_ON);
-  return ret;
-}
\ No newline at end of file
+  if (!pca_channel_valid(channel)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  // write to channel LEDX_ON_H, FULL_OFF wins until OFF_H is cleared in the same flush
+  TRY(pca_write_reg(&s_pwm_default, channel + 3, 0x00));
+  TRY(pca_write_reg(&s_pwm_default, channel + 1, LEDX_FULL_ON));
+
+  return i2c_regcache_flush(&s_pwm_default.cache);
+}
+
+StatusCode pwm_controller_get_cache_stats(I2cRegCacheStats *stats, int reset)
+{
+  return pwm_controller_dev_get_cache_stats(&s_pwm_default, stats, reset);
+}
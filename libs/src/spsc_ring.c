@@ -0,0 +1,163 @@
+#include "spsc_ring.h"
+
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline uint32_t rb_used(uint32_t tail, uint32_t head)
+{
+  return head - tail;
+}
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected,
+                       const struct timespec *timeout)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, expected, timeout,
+          NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+StatusCode spsc_ring_init(SpscRing *rb, void *storage, uint32_t elem_size,
+                          uint32_t capacity)
+{
+  if (!rb || !storage || (elem_size == 0) || (capacity == 0)
+      || ((capacity & (capacity - 1)) != 0)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  atomic_init(&rb->head, 0);
+  atomic_init(&rb->dropped, 0);
+  atomic_init(&rb->tail, 0);
+  atomic_init(&rb->waiting, 0);
+  atomic_init(&rb->wake_seq, 0);
+  atomic_init(&rb->kicked, 0);
+  rb->data = (uint8_t *)storage;
+  rb->elem_size = elem_size;
+  rb->capacity = capacity;
+
+  return STATUS_CODE_OK;
+}
+
+uint32_t spsc_ring_count(SpscRing *rb)
+{
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  uint32_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  return rb_used(tail, head);
+}
+
+uint32_t spsc_ring_push(SpscRing *rb, const void *elems, uint32_t n)
+{
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  uint32_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+  uint32_t space = rb->capacity - rb_used(tail, head);
+  uint32_t count = (n < space) ? n : space;
+
+  if (count < n) {
+    atomic_fetch_add_explicit(&rb->dropped, n - count, memory_order_relaxed);
+  }
+
+  if (count == 0) {
+    return 0;
+  }
+
+  uint32_t pos = head & (rb->capacity - 1);
+  uint32_t first = rb->capacity - pos;
+
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(&rb->data[pos * rb->elem_size], elems, first * rb->elem_size);
+  memcpy(&rb->data[0], (const uint8_t *)elems + first * rb->elem_size,
+         (count - first) * rb->elem_size);
+
+  atomic_store_explicit(&rb->head, head + count, memory_order_release);
+
+  // pairs with the fence in spsc_ring_pop_wait so a sleeping consumer cannot
+  // miss the head update
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&rb->waiting, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&rb->wake_seq, 1, memory_order_relaxed);
+    futex_wake(&rb->wake_seq);
+  }
+
+  return count;
+}
+
+uint32_t spsc_ring_pop(SpscRing *rb, void *out, uint32_t max_n)
+{
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+
+  uint32_t used = rb_used(tail, head);
+  uint32_t count = (used < max_n) ? used : max_n;
+
+  if (count == 0) {
+    return 0;
+  }
+
+  uint32_t pos = tail & (rb->capacity - 1);
+  uint32_t first = rb->capacity - pos;
+
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(out, &rb->data[pos * rb->elem_size], first * rb->elem_size);
+  memcpy((uint8_t *)out + first * rb->elem_size, &rb->data[0],
+         (count - first) * rb->elem_size);
+
+  atomic_store_explicit(&rb->tail, tail + count, memory_order_release);
+  return count;
+}
+
+uint32_t spsc_ring_pop_wait(SpscRing *rb, void *out, uint32_t max_n,
+                            int timeout_ms)
+{
+  uint32_t n = spsc_ring_pop(rb, out, max_n);
+  if ((n > 0) || (timeout_ms == 0)) {
+    return n;
+  }
+
+  struct timespec timeout = {
+    .tv_sec = timeout_ms / 1000, .tv_nsec = (long)(timeout_ms % 1000) * 1000 * 1000
+  };
+
+  uint32_t seq = atomic_load_explicit(&rb->wake_seq, memory_order_relaxed);
+
+  atomic_store_explicit(&rb->waiting, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  // only sleep if nothing was pushed and nobody kicked us since we looked
+  if ((rb_used(atomic_load_explicit(&rb->tail, memory_order_relaxed),
+               atomic_load_explicit(&rb->head, memory_order_relaxed)) == 0)
+      && !atomic_exchange_explicit(&rb->kicked, 0, memory_order_relaxed)) {
+    futex_wait(&rb->wake_seq, seq, (timeout_ms < 0) ? NULL : &timeout);
+  }
+
+  atomic_store_explicit(&rb->waiting, 0, memory_order_relaxed);
+
+  return spsc_ring_pop(rb, out, max_n);
+}
+
+void spsc_ring_wake(SpscRing *rb)
+{
+  atomic_store_explicit(&rb->kicked, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&rb->wake_seq, 1, memory_order_seq_cst);
+  futex_wake(&rb->wake_seq);
+}
+
+uint32_t spsc_ring_get_dropped(SpscRing *rb, int reset)
+{
+  if (reset) {
+    return atomic_exchange_explicit(&rb->dropped, 0, memory_order_relaxed);
+  }
+  return atomic_load_explicit(&rb->dropped, memory_order_relaxed);
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "global_enums.h"
 
 #define INA_I2C_ADDRESS   0x41
@@ -15,15 +18,83 @@
 
 #define INA_SHUNT_VOLTAGE 0x01
 #define INA_BUS_VOLTAGE   0x02
+
+#define BUS_VOLTAGE_SHIFT 3
+#define BUS_VOLTAGE_CNVR  (1U << 1) /*conversion ready, cleared by reading INA_POWER*/
+#define BUS_VOLTAGE_OVF   (1U << 0) /*math overflow, current and power are invalid*/
 #define INA_POWER         0x03
 #define INA_CURRENT       0x04
 #define INA_CALIBRATION   0x05
 
 #define MAX_CURRENT_AMPS  6
-#define CURRENT_LSB       MAX_CURRENT_AMPS / 32768
-#define R_SHUNT           0.01
+#define R_SHUNT_MOHM      10
+#define CURRENT_LSB_UA    200 /*MAX_CURRENT_AMPS / 32768 is 183uA, rounded up so CAL_VALUE is exact*/
+#define POWER_LSB_UW      (20 * CURRENT_LSB_UA)
+
+#define CURRENT_LSB       (CURRENT_LSB_UA * 1e-6f)
+#define POWER_LSB         (POWER_LSB_UW * 1e-6f)
+#define R_SHUNT           (R_SHUNT_MOHM * 1e-3f)
+
+/* 0.04096 / (CURRENT_LSB * R_SHUNT) in integer arithmetic, bit 0 is always 0 */
+#define CAL_VALUE         (uint16_t)(40960000UL / (CURRENT_LSB_UA * R_SHUNT_MOHM))
+
+#define SHUNT_LSB_V       10e-6f
+#define BUS_LSB_V         4e-3f
+
+#define CURRENTSENSE_BUFFER_SIZE    4096 /*must be a power of two, ~4s at the default conversion time*/
+#define CURRENTSENSE_MAX_WINDOWS    4
+#define CURRENTSENSE_WINDOW_BUCKETS 10 /*a window slides in steps of a tenth of its length*/
+#define CURRENTSENSE_MIN_WINDOW_MS  CURRENTSENSE_WINDOW_BUCKETS
+
+typedef struct {
+  uint64_t timestamp_ns; // CLOCK_MONOTONIC, when the conversion was read
+  float current_a;
+  float shunt_v;
+  float bus_v;
+  float power_w;
+  bool overflow; // the shunt voltage was out of the PGA range
+} CurrentSenseSample;
+
+typedef struct {
+  float min;
+  float max;
+  float mean;
+  float rms;
+} CurrentSenseStat;
 
-#define CAL_VALUE         (uint32_t)(0.04096 / (float)(CURRENT_LSB * R_SHUNT))
+/* One rolling window, covering the last window_ms give or take a tenth */
+typedef struct {
+  uint32_t window_ms;
+  uint32_t samples;
+  CurrentSenseStat current_a;
+  CurrentSenseStat bus_v;
+  CurrentSenseStat power_w;
+} CurrentSenseWindowStats;
+
+/* Energy and charge integrated from every conversion while sampling, trapezoid by trapezoid.
+   Discharge counts up, a negative current takes energy and charge back down */
+typedef struct {
+  double energy_mwh; // from the power register
+  double charge_mah; // from the shunt voltage
+  uint64_t samples;  // conversions integrated
+  uint64_t start_ns; // CLOCK_MONOTONIC of the first sample since the last reset, 0 if none
+  uint64_t end_ns;   // latest sample integrated
+} CurrentSenseEnergy;
+
+typedef struct {
+  // counters since sampling started or the last reset
+  uint64_t samples;        // conversions read
+  uint64_t polls;          // register reads, ready or not
+  uint64_t not_ready;      // polls that came before the conversion finished
+  uint64_t missed;         // conversions that finished and were overwritten before a read
+  uint64_t read_errors;
+  uint64_t overflows;
+  uint64_t pop_dropped;    // samples dropped because nobody popped them
+  uint32_t conversion_us;  // conversion time set by the ADC configuration
+  float rate_hz;           // measured conversion rate
+  uint32_t num_windows;
+  CurrentSenseWindowStats windows[CURRENTSENSE_MAX_WINDOWS];
+} CurrentSenseStats;
 
 /**
  * Initialize the current sense module
@@ -33,4 +104,47 @@ StatusCode currentsense_init();
 /**
  * Read the latest current sense value
  */
-StatusCode currentsense_read(float *current_val);
\ No newline at end of file
+StatusCode currentsense_read(float *current_val);
+
+/**
+ * Read the latest bus voltage and power, either may be NULL. While sampling they come from the
+ * newest sample without touching the bus, STATUS_CODE_FAILED until the first one is taken
+ */
+StatusCode currentsense_read_power(float *bus_v, float *power_w);
+
+/**
+ * Start continuous sampling: a thread reads every conversion as it completes, using the
+ * conversion ready flag, into a ring and the rolling windows. Reading all three registers
+ * once per conversion takes a fast mode bus at the default ~1ms conversion time
+ */
+StatusCode currentsense_start_sampling();
+
+/**
+ * Stop continuous sampling
+ */
+StatusCode currentsense_stop_sampling();
+
+/**
+ * Set the lengths of the rolling windows, each at least CURRENTSENSE_MIN_WINDOW_MS, and clear
+ * them. The default windows are 100ms, 1s and 10s
+ */
+StatusCode currentsense_set_windows(const uint32_t *window_ms, uint32_t n);
+
+/**
+ * Pop up to max_n samples in one call, waiting up to timeout_ms for the first one (< 0 waits
+ * forever, 0 never blocks). Returns the number popped or a negative StatusCode
+ * Note: must be called from a single consumer thread
+ */
+int currentsense_pop_samples(CurrentSenseSample *out, uint16_t max_n, int timeout_ms);
+
+/**
+ * Get the sampling counters and the rolling window statistics, optionally resetting the counters
+ */
+StatusCode currentsense_get_stats(CurrentSenseStats *stats, int reset);
+
+/**
+ * Get a snapshot of the energy and charge counters, optionally resetting them atomically so no
+ * conversion is counted twice or lost between snapshots. Nothing is integrated while sampling
+ * is stopped, the counters carry over to the next start
+ */
+StatusCode currentsense_get_energy(CurrentSenseEnergy *energy, int reset);
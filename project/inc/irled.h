@@ -1,9 +1,15 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "cm4_i2c.h"
+#include "cm4_i2c_sched.h"
 #include "global_enums.h"
+#include "ppg_dsp.h"
+#include "spsc_ring.h"
 
 #define MX_I2C_ADDR                   0x57
 
@@ -27,16 +33,25 @@
 #define MX_FIFO_RD_PTR                0x06
 #define MX_FIFO_DATA                  0x07
 
+#define MX_FIFO_DEPTH                 32
+#define MX_FIFO_SAMPLE_BYTES          6 /*3 bytes per LED in SpO2 mode*/
+
 #define MX_FIFO_CONFIG                0x08
 
+#define FIFO_CONFIG_SAMPLE_AVERAGE_SHIFT 5
+#define FIFO_CONFIG_SAMPLE_AVERAGE_1  (0b000 << 5)
+#define FIFO_CONFIG_SAMPLE_AVERAGE_2  (0b001 << 5)
 #define FIFO_CONFIG_SAMPLE_AVERAGE_4  (0b010 << 5)
 #define FIFO_CONFIG_SAMPLE_AVERAGE_8  (0b011 << 5)
+#define FIFO_CONFIG_SAMPLE_AVERAGE_16 (0b100 << 5)
+#define FIFO_CONFIG_SAMPLE_AVERAGE_32 (0b101 << 5)
 #define FIFO_CONFIG_ROLLOVER_EN       (1U << 4) /*Enables circular buffer*/
 #define FIFO_CONFIG_A_FULL_4_SAMPLES  0x4
 #define FIFO_CONFIG_A_FULL_8_SAMPLES  0x8
 #define FIFO_CONFIG_A_FULL_10_SAMPLES 0xA
 #define FIFO_CONFIG_A_FULL_12_SAMPLES 0xC
 #define FIFO_CONFIG_A_FULL_14_SAMPLES 0xE
+#define FIFO_CONFIG_A_FULL_MASK       0xF /*free slots left when A_FULL is raised*/
 
 #define MX_MODE_CONFIG                0x09
 
@@ -50,10 +65,15 @@
 #define SPO2_CONFIG_ADC_RGE_8192      (0b10 << 5)
 #define SPO2_CONFIG_ADC_RGE_16384     (0b11 << 5)
 
+#define SPO2_CONFIG_SAMPLE_RT_SHIFT   2
 #define SPO2_CONFIG_SAMPLE_RT_50      (0b000 << 2)
 #define SPO2_CONFIG_SAMPLE_RT_100     (0b001 << 2)
 #define SPO2_CONFIG_SAMPLE_RT_200     (0b010 << 2)
 #define SPO2_CONFIG_SAMPLE_RT_400     (0b011 << 2)
+#define SPO2_CONFIG_SAMPLE_RT_800     (0b100 << 2)
+#define SPO2_CONFIG_SAMPLE_RT_1000    (0b101 << 2)
+#define SPO2_CONFIG_SAMPLE_RT_1600    (0b110 << 2)
+#define SPO2_CONFIG_SAMPLE_RT_3200    (0b111 << 2)
 
 #define SPO2_CONFIG_LED_PW_15         (0b00 << 0)
 #define SPO2_CONFIG_LED_PW_16         (0b01 << 0)
@@ -73,19 +93,78 @@
 #define MX_REV_ID                     0xFE
 #define MX_PART_ID                    0xFF
 
-#define IRLED_THREAD_FREQ_HZ          10
-#define IRLED_THREAD_PERIOD_S         1 / IRLED_THREAD_FREQ_HZ
+#define IRLED_FIFO_BURST_RATE_HZ      400 /*fifo rates above this drain in one burst per wake*/
+
+#define IRLED_FIFO_DRAIN_CHUNK        4 /*samples per bus transaction, ~2.3ms at 100kHz*/
+#define IRLED_FIFO_WAKE_MARGIN        2 /*samples short of A_FULL the reader wakes at*/
+#define IRLED_FIFO_WAKE_MARGIN_US     5000 /*at least this early at high rates, for wake up jitter*/
+#define IRLED_FIFO_RATE_GAIN          0.25f /*weight of each WR_PTR rate measurement*/
+#define IRLED_RETRY_BACKOFF_MS        200
+#define IRLED_CLOCK_GAIN              0.125f /*weight of each pointer read on the sample clock*/
+#define IRLED_STATUS_READ_LEN         7 /*IS1 through RD_PTR*/
+
+#define IRLED_MAX_SENSORS             2 /*the address is fixed, one sensor per bus*/
+
+#define IRLED_IDLE_SAMPLE_RATE_HZ     50 /*chip rate while nothing touches the sensor*/
+#define IRLED_IDLE_CHIP_AVERAGE       2
+#define IRLED_IDLE_IR_LED_PA          0x0A /*2mA, red is off*/
+#define IRLED_PRESENCE_ABSENT_MS      1000 /*contact lost for this long before idling*/
+#define IRLED_PRESENCE_EVENTS         16 /*must be a power of two*/
 
 #define INT_PIN_1                     14
 #define INT_PIN_2                     15
 
-#define MAX30102_BUFFER_SIZE          256
+#define MAX30102_BUFFER_SIZE          1024 /*must be a power of two, ~0.6s at 1600 sps*/
 
 typedef struct {
   uint32_t ir;
   uint32_t red;
 } Max30102Sample;
 
+/* Acquisition settings. The chip samples at sample_rate_hz and puts the mean of every
+   chip_average samples in the fifo, the hr pipeline then low-pass filters and keeps one sample
+   in host_decimation. In SpO2 mode the pulse width caps the rate: 69us up to 1600 sps, 118us
+   up to 1000, 215us up to 800 and 411us up to 400 - 3200 sps is only reachable with one LED.
+   Above a few hundred samples per second in the fifo the bus has to run in fast mode.
+   Start from IRLED_CONFIG_DEFAULT, a zeroed LED amplitude turns that LED off */
+typedef struct {
+  uint16_t sample_rate_hz; // 50, 100, 200, 400, 800, 1000, 1600 or 3200
+  uint16_t pulse_width_us; // 69, 118, 215 or 411
+  uint16_t adc_range_na;   // full scale of 2048, 4096, 8192 or 16384 nA
+  uint8_t chip_average;    // 1, 2, 4, 8, 16 or 32
+  uint8_t host_decimation; // 1 to PPG_DECIM_MAX_FACTOR
+  uint8_t red_led_pa;      // MX_LED1_PULSE_AMP, 0.2mA per step
+  uint8_t ir_led_pa;       // MX_LED2_PULSE_AMP
+  uint32_t presence_counts; // IR DC level at ir_led_pa that means contact, 0 never idles
+} IrledConfig;
+
+#define IRLED_CONFIG_DEFAULT                                                   \
+        ((IrledConfig) {.sample_rate_hz = 400, .pulse_width_us = 411,             \
+                        .adc_range_na = 4096, .chip_average = 4, .host_decimation = 1, \
+                        .red_led_pa = 0x3C, .ir_led_pa = 0x3C, .presence_counts = 50000})
+
+/* A finger arriving on or leaving a sensor. While nobody touches it the sensor idles at
+   IRLED_IDLE_SAMPLE_RATE_HZ with only a dim IR LED and delivers no samples */
+typedef struct {
+  uint64_t timestamp_ns; // CLOCK_MONOTONIC, when the change was acted on
+  bool present;
+} IrledPresenceEvent;
+
+/* How the reader thread has kept up with the fifo since start or the last reset */
+typedef struct {
+  uint64_t wakeups;          // times the reader woke, scheduled or on the INT edge
+  uint64_t edge_wakeups;     // of those, A_FULL edges that beat the schedule
+  uint64_t drains;           // fifo reads that moved samples
+  uint64_t samples;          // samples read out of the fifo
+  uint64_t overflows;        // drains that found the fifo had rolled over
+  uint64_t lost_samples;     // samples overwritten before they were read
+  uint64_t pop_dropped;      // samples read but dropped because nobody popped them
+  uint64_t dsp_dropped;      // samples read but dropped because the hr thread fell behind
+  float expected_rate_hz;    // fifo fill rate set by MX_SPO2_CONFIG and MX_FIFO_CONFIG
+  float measured_rate_hz;    // fill rate seen from WR_PTR
+  uint32_t wake_interval_us; // time between scheduled wakes at the measured rate
+} IrledFifoStats;
+
 typedef enum {
   IRLED_STATE_WATING,
   IRLED_STATE_CALIB,
@@ -98,11 +177,169 @@ typedef struct {
   uint8_t reading;
 } IrledReading_s;
 
+/* A sample with the CLOCK_MONOTONIC time the chip took it. Every sensor keeps a sample clock
+   that follows its fifo pointer reads, so samples from sensors on different buses line up */
+typedef struct {
+  uint64_t timestamp_ns;
+  Max30102Sample sample;
+} IrledTimedSample;
+
+/* Fifo read schedule of one sensor */
+typedef struct {
+  float rate_hz;           // from the configuration registers
+  float measured_hz;       // from the WR_PTR advance
+  uint8_t a_full;          // unread samples that raise A_FULL
+  uint8_t target;          // unread samples a scheduled wake aims for
+  uint8_t chunk;           // samples per FIFO_DATA read
+  uint8_t last_wr;
+  uint64_t last_ptr_ns;    // when the pointers were last read, 0 before the first read
+  uint64_t next_wake_ns;
+  uint64_t last_sample_ns; // timestamp of the newest sample read, 0 until the clock is set
+} IrledFifoSched;
+
+/* Caller owned, one per sensor. Every sensor that is reading is serviced by one shared event
+   thread, which starts each fifo read as an asynchronous request on the sensor's bus, so reads
+   on different buses run in parallel */
+typedef struct {
+  I2cBus bus;
+  int int_pin;
+  int edge_fd; // -1 while not reading or when edge events are unavailable
+  bool initialized;
+  IrledConfig config;
+  IrledFifoSched sched;
+
+  // the fifo read in flight, passed from the event thread to the bus scheduler thread
+  atomic_bool busy;
+  bool from_edge;
+  I2cRequest req;
+  I2cMsg msgs[4];
+  uint8_t reg;
+  uint8_t mode_regs[11]; // register writes of a presence mode switch
+  uint8_t status[IRLED_STATUS_READ_LEN];
+  uint8_t count;
+  uint8_t drained;
+  uint8_t chunk_len;
+  uint8_t ovf;
+  uint64_t lost;
+  uint64_t ptr_ns;
+  uint8_t buf[MX_FIFO_DEPTH * MX_FIFO_SAMPLE_BYTES];
+
+  // filled from the bus scheduler thread, drained by the pop API and the hr thread
+  IrledTimedSample sample_buffer[MAX30102_BUFFER_SIZE];
+  SpscRing sample_ring;
+  Max30102Sample hr_buffer[MAX30102_BUFFER_SIZE];
+  SpscRing hr_ring;
+
+  atomic_bool reading;
+  pthread_t hr_thread;
+  PpgDsp dsp;
+  PpgDecimator decim;
+  atomic_int bpm;
+  atomic_int confidence_pct;
+  atomic_int spo2_x10;
+
+  // presence, changed from the bus scheduler thread
+  atomic_bool present;
+  atomic_bool dsp_reset;   // the hr thread restarts its pipeline before the next block
+  uint64_t absent_since_ns; // first sample below presence_counts, 0 while in contact
+  IrledPresenceEvent presence_buffer[IRLED_PRESENCE_EVENTS];
+  SpscRing presence_ring;
+
+  IrledFifoStats stats;
+  pthread_mutex_t mutex; // stats and the idle signal
+  pthread_cond_t idle;   // busy went false
+} IrledSensor;
+
+/**
+ * Initialize a sensor on a bus, with its INT line on int_pin
+ */
+StatusCode irled_dev_init(IrledSensor *sensor, I2cBus i2c_bus, int int_pin);
+
+/**
+ * Deinitialize a sensor, stopping it first if it is reading
+ */
+StatusCode irled_dev_deinit(IrledSensor *sensor);
+
+/**
+ * Change the sample rate, pulse width, ADC range and averaging, stopping and restarting the
+ * sensor around the change when it is reading. The fifo is cleared and the hr estimate restarts
+ */
+StatusCode irled_dev_set_config(IrledSensor *sensor, const IrledConfig *config);
+
+/**
+ * Get the acquisition settings a sensor is using
+ */
+StatusCode irled_dev_get_config(IrledSensor *sensor, IrledConfig *config);
+
+/**
+ * Start reading a sensor, the shared event thread starts with the first sensor
+ */
+StatusCode irled_dev_start_reading(IrledSensor *sensor);
+
+/**
+ * Stop reading a sensor, waiting for a fifo read in flight to finish
+ */
+StatusCode irled_dev_stop_reading(IrledSensor *sensor);
+
+/**
+ * Pop up to max_n timestamped samples from a sensor, waiting up to timeout_ms for the first one
+ * (< 0 waits forever, 0 never blocks). Returns the number popped or a negative StatusCode
+ * Note: each sensor's samples must be popped from a single consumer thread
+ */
+int irled_dev_pop_samples(IrledSensor *sensor, IrledTimedSample *out, uint16_t max_n,
+                          int timeout_ms);
+
+/**
+ * Get the latest heart rate estimate of a sensor, confidence_pct may be NULL
+ * Returns STATUS_CODE_FAILED until enough beats have been seen
+ */
+StatusCode irled_dev_get_bpm(IrledSensor *sensor, int *bpm, int *confidence_pct);
+
+/**
+ * Get the latest SpO2 estimate of a sensor in percent
+ * Returns STATUS_CODE_FAILED until a valid estimate is available
+ */
+StatusCode irled_dev_get_spo2(IrledSensor *sensor, float *spo2_pct);
+
+/**
+ * Get the fifo read statistics of a sensor, optionally resetting the counters
+ */
+StatusCode irled_dev_get_fifo_stats(IrledSensor *sensor, IrledFifoStats *stats, int reset);
+
+/**
+ * Get whether a finger is on a sensor, a sensor without presence_counts always reports contact
+ */
+StatusCode irled_dev_get_presence(IrledSensor *sensor, bool *present);
+
+/**
+ * Pop the oldest presence change of a sensor, waiting up to timeout_ms for one (< 0 waits
+ * forever, 0 never blocks). Returns STATUS_CODE_TIMEOUT if none arrived
+ * Note: changes nobody pops are dropped once IRLED_PRESENCE_EVENTS are queued
+ */
+StatusCode irled_dev_pop_presence_event(IrledSensor *sensor, IrledPresenceEvent *event,
+                                        int timeout_ms);
+
+/**
+ * Get the sensor the legacy functions below use, on I2C_BUS_2 with INT_PIN_1
+ */
+IrledSensor *irled_get_default();
+
 /**
  * Initialize irled sensor
  */
 StatusCode irled_init();
 
+/**
+ * Change the sample rate, pulse width, ADC range and averaging, stopping and restarting the
+ * reader around the change when it is running. The fifo is cleared and the hr estimate restarts
+ */
+StatusCode irled_set_config(const IrledConfig *config);
+
+/**
+ * Get the acquisition settings in use
+ */
+StatusCode irled_get_config(IrledConfig *config);
+
 /**
  * Deinitialize irled sensor - MUST CALL on program termination
  */
@@ -122,3 +359,37 @@ StatusCode irled_stop_reading();
  * Pop a sample from the irled ring buffer
  */
 StatusCode irled_pop_sample(Max30102Sample *sample);
+
+/**
+ * Pop up to max_n samples from the irled ring buffer in one call, waiting up to timeout_ms for
+ * the first one (< 0 waits forever, 0 never blocks). Returns the number popped or a negative StatusCode
+ * Note: the pop functions must all be called from the same consumer thread
+ */
+int irled_pop_samples(Max30102Sample *out, uint16_t max_n, int timeout_ms);
+
+/**
+ * Get the latest heart rate estimate from the hr thread, confidence_pct may be NULL
+ * Returns STATUS_CODE_FAILED until enough beats have been seen
+ */
+StatusCode irled_get_bpm(int *bpm, int *confidence_pct);
+
+/**
+ * Get the latest SpO2 estimate in percent from the ratio of ratios of the red and ir channels
+ * Returns STATUS_CODE_FAILED until a valid estimate is available
+ */
+StatusCode irled_get_spo2(float *spo2_pct);
+
+/**
+ * Get the fifo read statistics, optionally resetting the counters
+ */
+StatusCode irled_get_fifo_stats(IrledFifoStats *stats, int reset);
+
+/**
+ * Get whether a finger is on the sensor
+ */
+StatusCode irled_get_presence(bool *present);
+
+/**
+ * Pop the oldest presence change, waiting up to timeout_ms for one
+ */
+StatusCode irled_pop_presence_event(IrledPresenceEvent *event, int timeout_ms);
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "global_enums.h"
+
+#define PPG_IBI_HISTORY        8
+#define PPG_BAND_LOW_HZ        0.5f
+#define PPG_BAND_HIGH_HZ       4.0f
+#define PPG_MIN_BPM            30
+#define PPG_MAX_BPM            200
+
+// raw 18 bit counts below this mean nothing is on the sensor
+#define PPG_MIN_DC_COUNTS      10000
+
+// coefficients are Q24, filter state and samples are plain counts
+#define PPG_COEFF_SHIFT        24
+#define PPG_DC_SHIFT           7 /*EMA time constant of 128 samples*/
+
+#define PPG_DECIM_MAX_FACTOR     16
+#define PPG_DECIM_TAPS_PER_PHASE 8
+#define PPG_DECIM_MAX_TAPS       (PPG_DECIM_MAX_FACTOR * PPG_DECIM_TAPS_PER_PHASE)
+#define PPG_DECIM_PASSBAND       0.8f /*cutoff as a fraction of the output nyquist*/
+
+typedef struct {
+  int32_t b0, b1, b2, a1, a2;
+  int32_t x1, x2, y1, y2;
+} PpgBiquad;
+
+typedef struct {
+  int32_t dc_q8;
+  PpgBiquad bp;
+  int32_t beat_max;
+  int32_t beat_min;
+} PpgChannel;
+
+typedef struct {
+  uint32_t fs_hz;
+  PpgChannel ir;
+  PpgChannel red;
+
+  // peak detector, runs on the inverted ir band-pass output
+  int32_t prev;
+  bool rising;
+  int32_t threshold;
+  int32_t peak_avg;
+  uint32_t since_peak;
+  uint32_t refractory;
+  uint32_t max_ibi;
+
+  uint32_t ibi[PPG_IBI_HISTORY];
+  uint8_t ibi_head;
+  uint8_t ibi_count;
+
+  int32_t spo2_x10;
+  int32_t bpm;
+  int32_t confidence_pct;
+} PpgDsp;
+
+/* Windowed sinc low-pass decimating an ir/red pair by factor. Only the kept outputs are
+   computed, factor * PPG_DECIM_TAPS_PER_PHASE multiplies per channel each, so the cost per input
+   sample stays at PPG_DECIM_TAPS_PER_PHASE whatever the factor. The history is kept twice over
+   so every output is one straight dot product */
+typedef struct {
+  uint8_t factor;
+  uint8_t phase;  // input samples since the last output
+  uint16_t taps;
+  uint16_t head;
+  bool primed;
+  int32_t coeff[PPG_DECIM_MAX_TAPS];
+  uint32_t ir[2 * PPG_DECIM_MAX_TAPS];
+  uint32_t red[2 * PPG_DECIM_MAX_TAPS];
+} PpgDecimator;
+
+/**
+ * Initialize the dsp state for a given per-channel sample rate (after on-chip averaging)
+ */
+StatusCode ppg_dsp_init(PpgDsp *dsp, uint32_t fs_hz);
+
+/**
+ * Reset filter state and beat history, keeps the configured sample rate
+ */
+void ppg_dsp_reset(PpgDsp *dsp);
+
+/**
+ * Run a block of ir/red samples through the pipeline, updates bpm, confidence and spo2
+ */
+void ppg_dsp_process(PpgDsp *dsp, const uint32_t *ir, const uint32_t *red,
+                     uint32_t stride, uint32_t n);
+
+/**
+ * Design the decimation filter for 1 to PPG_DECIM_MAX_FACTOR, 1 passes samples straight through
+ */
+StatusCode ppg_decim_init(PpgDecimator *dec, uint8_t factor);
+
+/**
+ * Clear the history, the next input sample is taken as the level the filter settles from
+ */
+void ppg_decim_reset(PpgDecimator *dec);
+
+/**
+ * Decimate n ir/red samples, returns the number of outputs written. The outputs may overwrite
+ * the inputs, each output lands no later in the block than the inputs it is made from
+ */
+uint32_t ppg_decim_process(PpgDecimator *dec, const uint32_t *ir, const uint32_t *red,
+                           uint32_t in_stride, uint32_t n, uint32_t *out_ir, uint32_t *out_red,
+                           uint32_t out_stride);
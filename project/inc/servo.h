@@ -1,11 +1,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "global_enums.h"
 #include "pwm_controller.h"
 
 #define SERVO_PWM_FREQ_HZ      50
+#define SERVO_MAX_CHANNELS     32
 
 typedef enum {
   SERVO_CHANNEL_0    = 0,
@@ -37,13 +39,80 @@ typedef enum {
 #define SERVO_THREAD_PERIOD_S  1 / SERVO_THREAD_FREQ_HZ
 #define SERVO_MAX_SPEED_DEG_S  360
 #define SERV_MAX_STEP          SERVO_MAX_SPEED_DEG_S / SERVO_THREAD_FREQ_HZ
+#define SERVO_MAX_ACCEL_DEG_S2 7200
+#define SERVO_SMOOTH_ACCEL_DEG_S2 1800 /*acceleration servo_move_smooth ramps with*/
+#define SERVO_CMD_QUEUE_LEN    256 /*commands waiting for the motion thread, power of two*/
+#define SERVO_ANIM_BLEND_S     0.25f /*crossfade servo_play_animation starts a clip with*/
+
+#define SERVO_ANIM_MAGIC       0x4E415653 /*"SVAN" in file order*/
+#define SERVO_ANIM_VERSION     1
+#define SERVO_ANIM_FLAG_LOOP   0x1
+
+// commit once the longest pulse is over, so a new count never cuts a pulse short
+#define SERVO_FRAME_PHASE_US   (MAXIMUM_PULSE_WIDTH_MS * 1000 + 500)
+
+typedef enum {
+  SERVO_UPDATE_TICK = 0,     // every interpolation step goes to the chip
+  SERVO_UPDATE_FRAME,        // changed pulses go to the chip once per pwm period - the default
+  SERVO_UPDATE_FRAME_LOCKED, // as FRAME, at phase_us into the chip's own period
+} ServoUpdateMode;
+
+typedef enum {
+  SERVO_PROFILE_TRAPEZOID = 0, // constant acceleration ramps
+  SERVO_PROFILE_SCURVE,        // raised cosine velocity ramps, acceleration starts and ends at zero
+} ServoProfileType;
+
+/* A move from start_angle over distance degrees, evaluated from the time since start_ns:
+   ramp up for t_ramp, cruise at v_peak for t_cruise, ramp down for t_ramp */
+typedef struct {
+  ServoProfileType type;
+  uint64_t start_ns;
+  float start_angle;
+  float distance;
+  float v_peak;
+  float t_ramp;
+  float t_cruise;
+} ServoProfile;
+
+/* Where a servo is wired: a channel of one of the pwm controllers */
+typedef struct {
+  PwmController *pwm;
+  PCAChannel channel;
+} ServoMapEntry;
+
+/* Keyframe animation file, little endian, written by scripts/servo_animation.py:
+   the header, num_tracks servo channel bytes padded to 4, then num_keyframes keyframes of
+   uint32 time_us followed by num_tracks int16 angles in hundredths of a degree, padded to 4.
+   Keyframe times never go down, the angle between two keyframes is interpolated linearly */
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t num_tracks;
+  uint32_t num_keyframes;
+  uint32_t flags;
+} ServoAnimHeader;
+
+typedef struct {
+  float time_scale; // 2.0 plays twice as fast as recorded
+  float blend_s;    // crossfade from whatever the servos are doing, 0 cuts straight in
+  bool loop;        // start over after the last keyframe instead of holding it
+} ServoAnimParams;
+
+/* One axis of a servo_move_group */
+typedef struct {
+  ServoChannel channel;
+  float angle;
+} ServoGroupTarget;
 
 typedef struct {
   ServoChannel channel;
   bool isRunning;
   float current_angle;
   float target_angle;
-  float step;
+  ServoProfile profile;
+  bool dirty;               // current_angle moved since the last commit
+  bool committed;
+  uint16_t committed_ticks; // off count the chip holds
 } Servo;
 
 /**
@@ -51,11 +120,23 @@ typedef struct {
  */
 StatusCode servo_init();
 
+/**
+ * Initialize the servo module with servo i wired to map[i], up to SERVO_MAX_CHANNELS across
+ * several initialized pwm controllers
+ */
+StatusCode servo_init_map(const ServoMapEntry *map, size_t n);
+
 /**
  * Deinitialize servo module - closes all threads
  */
 StatusCode servo_deinit();
 
+/**
+ * Choose how the motion thread writes to the pwm controllers, phase_us only applies to
+ * SERVO_UPDATE_FRAME_LOCKED
+ */
+StatusCode servo_set_update_mode(ServoUpdateMode mode, uint32_t phase_us);
+
 /**
  * Get current angle of given servo - value is locally stored and not taken from the actual servo
  */
@@ -68,7 +149,40 @@ StatusCode servo_set_angle(ServoChannel channel, float angle);
 
 /**
  * Move a servo to an angle at a given angular velocity
- * Note: angular_velocity is measured in turns per second
+ * Note: angular_velocity is measured in degrees per second, ramped at SERVO_SMOOTH_ACCEL_DEG_S2
  */
 StatusCode servo_move_smooth(ServoChannel channel, float angle,
                              float angular_velocity);
+
+/**
+ * Move a servo to an angle along a trapezoid or S-curve profile, limited to max_velocity
+ * degrees per second and max_accel degrees per second squared. A move replaces the one in progress
+ */
+StatusCode servo_move_profile(ServoChannel channel, float angle, ServoProfileType type,
+                              float max_velocity, float max_accel);
+
+/**
+ * Move several servos along one profile type so that all of them start in the same frame and
+ * arrive together. The axis with the longest move runs at max_velocity and max_accel, the
+ * others are scaled down to match its timing. Each channel may appear once
+ */
+StatusCode servo_move_group(const ServoGroupTarget *targets, size_t n, ServoProfileType type,
+                            float max_velocity, float max_accel);
+
+/**
+ * Play a keyframe animation file, looping when the file says so, crossfading from the current
+ * motion over SERVO_ANIM_BLEND_S. The file is mapped and played from the mapping by the motion
+ * thread, a new clip replaces the one playing
+ */
+StatusCode servo_play_animation(const char *path);
+
+/**
+ * servo_play_animation with the time scale, crossfade and looping given by params
+ */
+StatusCode servo_play_animation_params(const char *path, const ServoAnimParams *params);
+
+/**
+ * Stop the animation playing, servos hold where it left them. Moving or setting a servo only
+ * takes that one servo out of the animation
+ */
+StatusCode servo_stop_animation();
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cm4_i2c.h"
+#include "global_enums.h"
+
+/* Register map models of the robot's i2c devices for the sim backend. They
+   are attached to I2C_BUS_2 at their real addresses when the sim library is
+   loaded, so pwm_controller, currentsense and irled run unmodified. A second
+   PCA9685 sits at SIM_PCA2_I2C_ADDR for two board servo setups, and a second
+   MAX30102 on I2C_BUS_1 with its INT on INT_PIN_2 for two site PPG. */
+
+#define SIM_PCA_OSC_HZ          MHZ(25)
+#define SIM_PCA_NUM_CHANNELS    16
+#define SIM_PCA_NUM_DEVICES     2
+#define SIM_PCA2_I2C_ADDR       0x40 /*power-on address of an unstrapped board*/
+
+#define SIM_INA_R_SHUNT_OHMS    0.01f
+
+#define SIM_MX_PART_ID          0x15
+#define SIM_MX_REV_ID           0x03
+#define SIM_MX_DEFAULT_BPM      72.0f
+#define SIM_MX_DEFAULT_SPO2_PCT 97.0f
+#define SIM_MX_NUM_DEVICES      2
+
+/**
+ * Attach the PCA9685, INA219 and MAX30102 models, also resets them to their power-on state
+ */
+StatusCode sim_devices_attach_defaults(void);
+
+/**
+ * Get the on/off counts the PCA9685 model holds for a channel, full on/off bits included
+ */
+StatusCode sim_pca9685_get_channel(uint8_t channel, uint16_t *on, uint16_t *off);
+
+/**
+ * sim_pca9685_get_channel for the PCA9685 model at addr
+ */
+StatusCode sim_pca9685_get_dev_channel(uint8_t addr, uint8_t channel, uint16_t *on, uint16_t *off);
+
+/**
+ * Get the PWM frequency the PCA9685 model's prescaler is set to
+ */
+StatusCode sim_pca9685_get_freq_hz(float *freq_hz);
+
+/**
+ * Set the load the INA219 model measures across its shunt and on its bus
+ */
+StatusCode sim_ina219_set_load(float current_a, float bus_v);
+
+/**
+ * Set the synthetic PPG the MAX30102 model samples, with no finger only ambient light is seen
+ */
+StatusCode sim_max30102_set_ppg(float bpm, float spo2_pct, bool finger_present);
+
+/**
+ * Delay the pulse the MAX30102 model on a bus sees, as a sensor further from the heart would
+ */
+StatusCode sim_max30102_set_pulse_delay(I2cBus i2c_bus, float delay_s);
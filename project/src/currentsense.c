@@ -1,23 +1,73 @@
 #include "currentsense.h"
 
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "cm4_i2c.h"
+#include "cm4_i2c_regcache.h"
+#include "cm4_i2c_sched.h"
+#include "cm4_time.h"
+#include "spsc_ring.h"
 
-static StatusCode ina_read_reg(uint8_t reg, int16_t *val);
+#define INA_NUM_REGS (INA_CALIBRATION + 1)
+#define INA_REG_BYTES 2
+
+#define CS_NUM_QUANTITIES 3 // current, bus voltage, power
+#define CS_POLL_GUARD_DIV 8 // polls aim this fraction of a conversion early, then retry
+#define CS_AS_PER_MAH     3.6 // amp seconds in a mAh, and watt seconds in a mWh
+
+_Static_assert((uint64_t)CURRENT_LSB_UA * 32768 >= (uint64_t)MAX_CURRENT_AMPS * 1000000,
+               "CURRENT_LSB_UA cannot reach MAX_CURRENT_AMPS");
+
+// configuration and calibration only change when written, the rest are measurements
+static I2cRegCache s_ina_cache;
+
+typedef struct {
+  uint32_t n;
+  float min[CS_NUM_QUANTITIES];
+  float max[CS_NUM_QUANTITIES];
+  double sum[CS_NUM_QUANTITIES];
+  double sum_sq[CS_NUM_QUANTITIES];
+} CsBucket;
 
-#define INA_WRITE_REG(reg, val)                                                \
-        i2c_write(I2C_BUS_2, INA_I2C_ADDRESS,                                        \
-                  (uint8_t[]) {reg, (val >> 8) & 0xFF, val & 0xFF}, 3);
+/* A rolling window is a ring of buckets, the oldest is cleared as the newest starts */
+typedef struct {
+  uint32_t window_ms;
+  uint64_t bucket_ns;
+  uint64_t bucket_start_ns; // start of the newest bucket, 0 before the first sample
+  uint32_t head;
+  CsBucket buckets[CURRENTSENSE_WINDOW_BUCKETS];
+} CsWindow;
+
+static pthread_t s_sample_thread;
+static atomic_bool s_sampling = false;
+static uint64_t s_conv_ns;
+
+// the sampling thread is the only producer
+static CurrentSenseSample s_sample_buffer[CURRENTSENSE_BUFFER_SIZE];
+static SpscRing s_sample_ring;
+
+static CsWindow s_windows[CURRENTSENSE_MAX_WINDOWS];
+static uint32_t s_num_windows = 0;
+static CurrentSenseStats s_stats;
+static CurrentSenseEnergy s_energy;
+static CurrentSenseSample s_latest; // timestamp 0 until the sampling thread records one
+static pthread_mutex_t s_stats_mutex = PTHREAD_MUTEX_INITIALIZER; // stats, windows, energy and latest
+
+static StatusCode ina_read_reg(uint8_t reg, int16_t *val);
 
 #define INA_READ_REG(reg, val) ina_read_reg(reg, val);
 
 static StatusCode ina_read_reg(uint8_t reg, int16_t *val)
 {
   uint8_t read_buf[2] = {0, 0};
-  StatusCode ret =
-    i2c_write_then_read(I2C_BUS_2, INA_I2C_ADDRESS, &reg, 1, read_buf, 2);
+  StatusCode ret = i2c_regcache_read(&s_ina_cache, reg, read_buf, 1);
   if (ret != STATUS_CODE_OK) {
     printf("Could not read from register: %d, exit code %d\n", reg, ret);
     return ret;
@@ -27,17 +77,35 @@ static StatusCode ina_read_reg(uint8_t reg, int16_t *val)
   return STATUS_CODE_OK;
 }
 
+static StatusCode ina_write_reg(uint8_t reg, uint16_t val)
+{
+  uint8_t buf[INA_REG_BYTES] = {(val >> 8) & 0xFF, val & 0xFF};
+
+  return i2c_regcache_write(&s_ina_cache, reg, buf, 1);
+}
+
 StatusCode currentsense_init()
 {
-  StatusCode ret = INA_WRITE_REG(INA_CALIBRATION, CAL_VALUE);
+  TRY(i2c_sched_set_addr_prio(I2C_BUS_2, INA_I2C_ADDRESS, I2C_PRIO_TELEMETRY));
+
+  // the ina219 has no auto increment, the cache sends each register on its own
+  if (s_ina_cache.num_regs == 0) {
+    TRY(i2c_regcache_init(&s_ina_cache, I2C_BUS_2, INA_I2C_ADDRESS, INA_NUM_REGS,
+                          INA_REG_BYTES));
+    TRY(i2c_regcache_set_kind(&s_ina_cache, INA_CONFIGURATION, 1, I2C_REG_CACHED));
+    TRY(i2c_regcache_set_kind(&s_ina_cache, INA_CALIBRATION, 1, I2C_REG_CACHED));
+  }
+
+  TRY(ina_write_reg(INA_CALIBRATION, CAL_VALUE));
+  TRY(ina_write_reg(INA_CONFIGURATION, (CONFIG_BRNG | CONFIG_PG | CONFIG_BADC
+                                        | CONFIG_SADC | CONFIG_MODE)));
 
+  StatusCode ret = i2c_regcache_flush(&s_ina_cache);
   if (ret != STATUS_CODE_OK) {
     printf("write to i2c failed\n");
     return ret;
   }
 
-  INA_WRITE_REG(INA_CONFIGURATION, (CONFIG_BRNG | CONFIG_PG | CONFIG_BADC
-                                    | CONFIG_SADC | CONFIG_MODE));
   return STATUS_CODE_OK;
 }
 
@@ -52,4 +120,425 @@ StatusCode currentsense_read(float *current_val)
 
   *current_val = (float)current_reg * CURRENT_LSB;
   return STATUS_CODE_OK;
-}
\ No newline at end of file
+}
+
+StatusCode currentsense_read_power(float *bus_v, float *power_w)
+{
+  int16_t reg;
+
+  // reading the power register acknowledges the conversion, the sampling thread would lose it
+  if (atomic_load(&s_sampling)) {
+    pthread_mutex_lock(&s_stats_mutex);
+    CurrentSenseSample latest = s_latest;
+    pthread_mutex_unlock(&s_stats_mutex);
+
+    if (latest.timestamp_ns == 0) {
+      return STATUS_CODE_FAILED;
+    }
+    if (bus_v) {
+      *bus_v = latest.bus_v;
+    }
+    if (power_w) {
+      *power_w = fabsf(latest.power_w);
+    }
+    return STATUS_CODE_OK;
+  }
+
+  if (bus_v) {
+    TRY(ina_read_reg(INA_BUS_VOLTAGE, &reg));
+    *bus_v = (float)((uint16_t)reg >> BUS_VOLTAGE_SHIFT) * BUS_LSB_V;
+  }
+
+  if (power_w) {
+    TRY(ina_read_reg(INA_POWER, &reg));
+    *power_w = (float)(uint16_t)reg * POWER_LSB;
+  }
+
+  return STATUS_CODE_OK;
+}
+
+// ================================
+// Rolling windows
+// ================================
+static void cs_bucket_clear(CsBucket *bucket)
+{
+  bucket->n = 0;
+  for (int q = 0; q < CS_NUM_QUANTITIES; q++) {
+    bucket->min[q] = INFINITY;
+    bucket->max[q] = -INFINITY;
+    bucket->sum[q] = 0.0;
+    bucket->sum_sq[q] = 0.0;
+  }
+}
+
+static void cs_window_init(CsWindow *window, uint32_t window_ms)
+{
+  window->window_ms = window_ms;
+  window->bucket_ns = (uint64_t)window_ms * 1000000ULL / CURRENTSENSE_WINDOW_BUCKETS;
+  window->bucket_start_ns = 0;
+  window->head = 0;
+  for (int i = 0; i < CURRENTSENSE_WINDOW_BUCKETS; i++) {
+    cs_bucket_clear(&window->buckets[i]);
+  }
+}
+
+static void cs_window_add(CsWindow *window, uint64_t t, const float *vals)
+{
+  if ((window->bucket_start_ns == 0)
+      || (t - window->bucket_start_ns >= (uint64_t)window->window_ms * 1000000ULL)) {
+    // first sample, or a gap longer than the window: start over
+    cs_window_init(window, window->window_ms);
+    window->bucket_start_ns = t;
+  }
+
+  while (t - window->bucket_start_ns >= window->bucket_ns) {
+    window->head = (window->head + 1) % CURRENTSENSE_WINDOW_BUCKETS;
+    cs_bucket_clear(&window->buckets[window->head]);
+    window->bucket_start_ns += window->bucket_ns;
+  }
+
+  CsBucket *bucket = &window->buckets[window->head];
+  bucket->n++;
+  for (int q = 0; q < CS_NUM_QUANTITIES; q++) {
+    bucket->min[q] = fminf(bucket->min[q], vals[q]);
+    bucket->max[q] = fmaxf(bucket->max[q], vals[q]);
+    bucket->sum[q] += vals[q];
+    bucket->sum_sq[q] += (double)vals[q] * vals[q];
+  }
+}
+
+static void cs_window_get(const CsWindow *window, CurrentSenseWindowStats *out)
+{
+  CsBucket total;
+  cs_bucket_clear(&total);
+
+  for (int i = 0; i < CURRENTSENSE_WINDOW_BUCKETS; i++) {
+    const CsBucket *bucket = &window->buckets[i];
+    total.n += bucket->n;
+    for (int q = 0; q < CS_NUM_QUANTITIES; q++) {
+      total.min[q] = fminf(total.min[q], bucket->min[q]);
+      total.max[q] = fmaxf(total.max[q], bucket->max[q]);
+      total.sum[q] += bucket->sum[q];
+      total.sum_sq[q] += bucket->sum_sq[q];
+    }
+  }
+
+  CurrentSenseStat *stats[CS_NUM_QUANTITIES] = {&out->current_a, &out->bus_v, &out->power_w};
+
+  memset(out, 0, sizeof(*out));
+  out->window_ms = window->window_ms;
+  out->samples = total.n;
+  if (total.n == 0) {
+    return;
+  }
+
+  for (int q = 0; q < CS_NUM_QUANTITIES; q++) {
+    stats[q]->min = total.min[q];
+    stats[q]->max = total.max[q];
+    stats[q]->mean = (float)(total.sum[q] / total.n);
+    stats[q]->rms = (float)sqrt(total.sum_sq[q] / total.n);
+  }
+}
+
+// ================================
+// Sampling thread
+// ================================
+static void cs_sleep_until(uint64_t t)
+{
+  struct timespec ts = {.tv_sec = (time_t)(t / 1000000000ULL), .tv_nsec = (long)(t % 1000000000ULL)};
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+/* Conversion time of one ADC setting, 9 to 12 bits or 12 bit samples averaged 2^n times */
+static uint64_t cs_adc_conv_ns(uint8_t adc)
+{
+  static const uint32_t resolution_ns[4] = {84000, 148000, 276000, 532000};
+
+  if (!(adc & 0x8)) {
+    return resolution_ns[adc & 0x3];
+  }
+
+  return (uint64_t)resolution_ns[3] << (adc & 0x7);
+}
+
+/* Time between conversions in continuous mode, the bus and shunt ADCs take turns */
+static uint64_t cs_conv_ns(uint16_t config)
+{
+  uint8_t mode = config & CONFIG_MODE;
+  uint64_t conv_ns = 0;
+
+  if (mode & 0x1) {
+    conv_ns += cs_adc_conv_ns((config & CONFIG_SADC) >> 3);
+  }
+  if (mode & 0x2) {
+    conv_ns += cs_adc_conv_ns((config & CONFIG_BADC) >> 7);
+  }
+
+  return conv_ns;
+}
+
+/* Polls land a fraction of a conversion early and the odd one that finds the conversion still
+   running retries after that fraction, so reads stay locked just behind the ADC without
+   drifting late and skipping conversions */
+static void *cs_sample_thread_func(void *arg)
+{
+  (void)arg;
+  uint64_t conv_ns = s_conv_ns;
+  uint64_t guard_ns = conv_ns / CS_POLL_GUARD_DIV;
+  uint64_t last_ready_ns = 0;
+  uint64_t next_ns = time_now_ns();
+  CurrentSenseSample prev = {0};
+
+  uint8_t regs[3] = {INA_BUS_VOLTAGE, INA_SHUNT_VOLTAGE, INA_POWER};
+  uint8_t vals[3][INA_REG_BYTES];
+
+  // reading the power register acknowledges the conversion, so it goes last
+  I2cMsg msgs[] = {
+    I2C_MSG_WRITE(INA_I2C_ADDRESS, &regs[0], 1),
+    I2C_MSG_READ(INA_I2C_ADDRESS, vals[0], INA_REG_BYTES),
+    I2C_MSG_WRITE(INA_I2C_ADDRESS, &regs[1], 1),
+    I2C_MSG_READ(INA_I2C_ADDRESS, vals[1], INA_REG_BYTES),
+    I2C_MSG_WRITE(INA_I2C_ADDRESS, &regs[2], 1),
+    I2C_MSG_READ(INA_I2C_ADDRESS, vals[2], INA_REG_BYTES),
+  };
+
+  while (atomic_load(&s_sampling)) {
+    cs_sleep_until(next_ns);
+
+    uint64_t now = time_now_ns();
+    StatusCode ret = i2c_transfer_batch(I2C_BUS_2, msgs, I2C_NUM_MSGS(msgs));
+
+    if (ret != STATUS_CODE_OK) {
+      pthread_mutex_lock(&s_stats_mutex);
+      s_stats.polls++;
+      s_stats.read_errors++;
+      pthread_mutex_unlock(&s_stats_mutex);
+      next_ns = now + conv_ns;
+      continue;
+    }
+
+    uint16_t bus_reg = (uint16_t)(vals[0][0] << 8 | vals[0][1]);
+    int16_t shunt_reg = (int16_t)(vals[1][0] << 8 | vals[1][1]);
+    uint16_t power_reg = (uint16_t)(vals[2][0] << 8 | vals[2][1]);
+
+    if (!(bus_reg & BUS_VOLTAGE_CNVR)) {
+      pthread_mutex_lock(&s_stats_mutex);
+      s_stats.polls++;
+      s_stats.not_ready++;
+      pthread_mutex_unlock(&s_stats_mutex);
+      next_ns = now + guard_ns;
+      continue;
+    }
+
+    // taken from the shunt voltage rather than the current register, so the samples do not
+    // depend on the calibration
+    CurrentSenseSample sample = {
+      .timestamp_ns = now,
+      .shunt_v = (float)shunt_reg * SHUNT_LSB_V,
+      .bus_v = (float)(bus_reg >> BUS_VOLTAGE_SHIFT) * BUS_LSB_V,
+      .overflow = (bus_reg & BUS_VOLTAGE_OVF) != 0,
+    };
+    sample.current_a = sample.shunt_v / (float)R_SHUNT;
+
+    // the power register holds a magnitude, it flows the way the current does
+    sample.power_w = (float)power_reg * POWER_LSB;
+    if (sample.current_a < 0.0f) {
+      sample.power_w = -sample.power_w;
+    }
+
+    spsc_ring_push(&s_sample_ring, &sample, 1);
+
+    uint64_t missed = 0;
+    float rate_hz = 0.0f;
+    if (last_ready_ns != 0) {
+      uint64_t elapsed = now - last_ready_ns;
+      uint64_t conversions = (elapsed + conv_ns / 2) / conv_ns;
+      missed = (conversions > 1) ? conversions - 1 : 0;
+      rate_hz = 1e9f / (float)elapsed;
+    }
+    last_ready_ns = now;
+    next_ns = now + conv_ns - guard_ns;
+
+    float quantities[CS_NUM_QUANTITIES] = {sample.current_a, sample.bus_v, sample.power_w};
+
+    pthread_mutex_lock(&s_stats_mutex);
+    s_stats.polls++;
+    s_stats.samples++;
+    s_stats.missed += missed;
+    s_stats.overflows += sample.overflow;
+    if (rate_hz > 0.0f) {
+      s_stats.rate_hz += (rate_hz - s_stats.rate_hz) * 0.01f;
+    }
+    for (uint32_t i = 0; i < s_num_windows; i++) {
+      cs_window_add(&s_windows[i], now, quantities);
+    }
+
+    // a trapezoid from the previous conversion, across any that were missed in between
+    if (prev.timestamp_ns != 0) {
+      double dt_s = (double)(now - prev.timestamp_ns) * 1e-9;
+      s_energy.energy_mwh += 0.5 * (prev.power_w + sample.power_w) * dt_s / CS_AS_PER_MAH;
+      s_energy.charge_mah += 0.5 * (prev.current_a + sample.current_a) * dt_s / CS_AS_PER_MAH;
+    }
+    if (s_energy.start_ns == 0) {
+      s_energy.start_ns = now;
+    }
+    s_energy.end_ns = now;
+    s_energy.samples++;
+    s_latest = sample;
+    pthread_mutex_unlock(&s_stats_mutex);
+
+    prev = sample;
+  }
+
+  return NULL;
+}
+
+StatusCode currentsense_start_sampling()
+{
+  if (atomic_load(&s_sampling)) {
+    return STATUS_CODE_ALREADY_INITIALIZED;
+  }
+
+  if (s_ina_cache.num_regs == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  uint8_t config_buf[INA_REG_BYTES];
+  TRY(i2c_regcache_read(&s_ina_cache, INA_CONFIGURATION, config_buf, 1));
+  uint16_t config = (uint16_t)(config_buf[0] << 8 | config_buf[1]);
+
+  // only the continuous modes keep converting
+  uint64_t conv_ns = cs_conv_ns(config);
+  if (!(config & 0x4) || (conv_ns == 0)) {
+    printf("currentsense: configuration %04X does not convert continuously\n", config);
+    return STATUS_CODE_FAILED;
+  }
+
+  TRY(spsc_ring_init(&s_sample_ring, s_sample_buffer, sizeof(CurrentSenseSample),
+                     CURRENTSENSE_BUFFER_SIZE));
+
+  pthread_mutex_lock(&s_stats_mutex);
+  if (s_num_windows == 0) {
+    static const uint32_t default_windows_ms[] = {100, 1000, 10000};
+    s_num_windows = 3;
+    for (uint32_t i = 0; i < s_num_windows; i++) {
+      cs_window_init(&s_windows[i], default_windows_ms[i]);
+    }
+  }
+  else {
+    for (uint32_t i = 0; i < s_num_windows; i++) {
+      cs_window_init(&s_windows[i], s_windows[i].window_ms);
+    }
+  }
+  memset(&s_stats, 0, sizeof(s_stats));
+  memset(&s_latest, 0, sizeof(s_latest));
+  s_stats.conversion_us = (uint32_t)(conv_ns / 1000);
+  s_stats.rate_hz = 1e9f / (float)conv_ns;
+  pthread_mutex_unlock(&s_stats_mutex);
+
+  s_conv_ns = conv_ns;
+  atomic_store(&s_sampling, true);
+  int threadRet = pthread_create(&s_sample_thread, NULL, cs_sample_thread_func, NULL);
+  if (threadRet != 0) {
+    atomic_store(&s_sampling, false);
+    return STATUS_CODE_THREAD_FAILURE;
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode currentsense_stop_sampling()
+{
+  if (!atomic_load(&s_sampling)) {
+    return STATUS_CODE_OK;
+  }
+
+  atomic_store(&s_sampling, false);
+  pthread_join(s_sample_thread, NULL);
+  spsc_ring_wake(&s_sample_ring);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode currentsense_set_windows(const uint32_t *window_ms, uint32_t n)
+{
+  if (!window_ms || (n == 0) || (n > CURRENTSENSE_MAX_WINDOWS)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  for (uint32_t i = 0; i < n; i++) {
+    if (window_ms[i] < CURRENTSENSE_MIN_WINDOW_MS) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+  }
+
+  pthread_mutex_lock(&s_stats_mutex);
+  for (uint32_t i = 0; i < n; i++) {
+    cs_window_init(&s_windows[i], window_ms[i]);
+  }
+  s_num_windows = n;
+  pthread_mutex_unlock(&s_stats_mutex);
+
+  return STATUS_CODE_OK;
+}
+
+int currentsense_pop_samples(CurrentSenseSample *out, uint16_t max_n, int timeout_ms)
+{
+  if (!out) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (s_sample_ring.capacity == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  return (int)spsc_ring_pop_wait(&s_sample_ring, out, max_n, timeout_ms);
+}
+
+StatusCode currentsense_get_stats(CurrentSenseStats *stats, int reset)
+{
+  if (!stats) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&s_stats_mutex);
+  *stats = s_stats;
+  stats->num_windows = s_num_windows;
+  for (uint32_t i = 0; i < s_num_windows; i++) {
+    cs_window_get(&s_windows[i], &stats->windows[i]);
+  }
+
+  if (reset) {
+    // the conversion time and rate are state rather than counters
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stats.conversion_us = stats->conversion_us;
+    s_stats.rate_hz = stats->rate_hz;
+  }
+  pthread_mutex_unlock(&s_stats_mutex);
+
+  if (s_sample_ring.capacity != 0) {
+    stats->pop_dropped = spsc_ring_get_dropped(&s_sample_ring, reset);
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode currentsense_get_energy(CurrentSenseEnergy *energy, int reset)
+{
+  if (!energy) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&s_stats_mutex);
+  *energy = s_energy;
+  if (reset) {
+    // the next interval picks up from the latest sample, whose trapezoid is not counted yet
+    memset(&s_energy, 0, sizeof(s_energy));
+    s_energy.start_ns = energy->end_ns;
+  }
+  pthread_mutex_unlock(&s_stats_mutex);
+
+  return STATUS_CODE_OK;
+}
@@ -1,49 +1,60 @@
 #include "irled.h"
 
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "cm4_gpio.h"
 #include "cm4_i2c.h"
+#include "cm4_i2c_sched.h"
+#include "cm4_time.h"
+#include "ppg_dsp.h"
+#include "spsc_ring.h"
 
-static StatusCode irled_read_reg(uint8_t reg, uint8_t *val);
+static StatusCode irled_read_reg(IrledSensor *sensor, uint8_t reg, uint8_t *val);
 
-#define IRLED_WRITE_REG(reg, val)                                              \
-        i2c_write(I2C_BUS_2, MX_I2C_ADDR, (uint8_t[]) {reg, val}, 2);
+#define IRLED_WRITE_REG(sensor, reg, val)                                      \
+        i2c_write((sensor)->bus, MX_I2C_ADDR, (uint8_t[]) {reg, val}, 2);
 
-#define IRLED_READ_REG(reg, val) irled_read_reg(reg, val);
+#define IRLED_READ_REG(sensor, reg, val) irled_read_reg(sensor, reg, val);
 
-static pthread_t int_edge_thread;
-static atomic_bool is_thread_running = false;
-static struct timespec ts = {
-  .tv_sec = 0, .tv_nsec = IRLED_THREAD_PERIOD_S * 1000 * 1000 * 1000
-};
+#define IRLED_MSG_WRITE_REG(reg, val)                                          \
+        I2C_MSG_WRITE(MX_I2C_ADDR, ((uint8_t[]) {reg, val}), 2)
 
-static void *int_edge_thread_func(void *arg);
-static StatusCode max30102_read_fifo_to_buffer();
+#define IRLED_MSG_READ_REGS(reg, buf, len)                                     \
+        I2C_MSG_WRITE(MX_I2C_ADDR, ((uint8_t[]) {reg}), 1),                        \
+        I2C_MSG_READ(MX_I2C_ADDR, buf, len)
 
-static Max30102Sample s_buffer[MAX30102_BUFFER_SIZE];
-static volatile uint16_t s_head = 0;
-static volatile uint16_t s_tail = 0;
-static pthread_mutex_t s_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+// the legacy API's sensor
+static IrledSensor s_default;
 
-static pthread_cond_t s_buffer_cv = PTHREAD_COND_INITIALIZER;
+// sensors being read, all serviced by one event thread
+static pthread_t s_event_thread;
+static atomic_bool s_event_running = false;
+// read by the bus scheduler thread's kicks without the lock
+static atomic_int s_event_efd = -1;
+static IrledSensor *s_event_sensors[IRLED_MAX_SENSORS];
+static uint32_t s_event_count = 0;
+static pthread_mutex_t s_event_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static pthread_t hr_thread;
-static atomic_bool is_hr_thread_running = false;
+static void irled_fifo_submit_chunk(IrledSensor *sensor);
+static bool irled_presence_update(IrledSensor *sensor, uint32_t ir_dc, uint64_t now);
+static void irled_presence_switch(IrledSensor *sensor);
+static StatusCode irled_encode_config(const IrledConfig *config, uint8_t *spo2_config,
+                                      uint8_t *fifo_config);
 
-static atomic_int s_bpm = 0;
-static atomic_int s_confidence_pct = 0;
-
-static uint16_t irled_pop_multiple(Max30102Sample *out, uint16_t max_n);
-
-static StatusCode irled_read_reg(uint8_t reg, uint8_t *val)
+static StatusCode irled_read_reg(IrledSensor *sensor, uint8_t reg, uint8_t *val)
 {
   uint8_t read_buf;
   StatusCode ret =
-    i2c_write_then_read(I2C_BUS_2, MX_I2C_ADDR, &reg, 1, &read_buf, 1);
+    i2c_write_then_read(sensor->bus, MX_I2C_ADDR, &reg, 1, &read_buf, 1);
   if (ret != STATUS_CODE_OK) {
     printf("Could not read from register: %d\n", reg);
     return ret;
@@ -53,278 +64,1194 @@ static StatusCode irled_read_reg(uint8_t reg, uint8_t *val)
   return STATUS_CODE_OK;
 }
 
-static void *int_edge_thread_func(void *arg)
+/* Make the event thread look at its sensors again */
+static void irled_event_kick()
 {
-  (void)arg;
-  int event;
-  while (atomic_load(&is_thread_running)) {
-    gpio_get_edge_event(INT_PIN_1, &event);
-    if (event == 1) {
-// printf("Interrupt triggered\n");
-      gpio_clear_edge(INT_PIN_1);
-      uint8_t status = 0;
-      IRLED_READ_REG(MX_IS1, &status);
-
-      if (status & IS1_A_FULL) {
-        StatusCode ret = max30102_read_fifo_to_buffer();
-        if (ret != STATUS_CODE_OK) {
-          struct timespec backoff = {.tv_sec = 0, .tv_nsec = 200 * 1000 * 1000};
-          nanosleep(&backoff, NULL);
-        }
-      }
-      else {
-        printf("Warning: interrupt fired with invalid status: %d\n", status);
-      }
+  uint64_t one = 1;
+  if (write(atomic_load(&s_event_efd), &one, sizeof(one)) != (ssize_t)sizeof(one)) {
+    printf("failed to signal irled event thread\n");
+  }
+}
+
+// ================================
+// Fifo scheduler
+// ================================
+/* Fill rate and A_FULL threshold from the configuration registers, the reader starts out
+   trusting them and then follows what WR_PTR shows */
+static void irled_sched_config(IrledFifoSched *sched, uint8_t spo2_config, uint8_t fifo_config)
+{
+  static const uint16_t rates_hz[8] = {50, 100, 200, 400, 800, 1000, 1600, 3200};
+
+  uint8_t avg_shift = fifo_config >> FIFO_CONFIG_SAMPLE_AVERAGE_SHIFT;
+  if (avg_shift > 5) {
+    avg_shift = 5;
+  }
+
+  sched->rate_hz = (float)rates_hz[(spo2_config >> SPO2_CONFIG_SAMPLE_RT_SHIFT) & 0x7]
+                   / (float)(1U << avg_shift);
+  sched->measured_hz = sched->rate_hz;
+  sched->a_full = MX_FIFO_DEPTH - (fifo_config & FIFO_CONFIG_A_FULL_MASK);
+
+  uint32_t margin = (uint32_t)ceilf(sched->rate_hz * IRLED_FIFO_WAKE_MARGIN_US * 1e-6f);
+  if (margin < IRLED_FIFO_WAKE_MARGIN) {
+    margin = IRLED_FIFO_WAKE_MARGIN;
+  }
+  sched->target = (sched->a_full > 2 * margin) ? sched->a_full - margin : sched->a_full / 2;
+  sched->last_ptr_ns = 0;
+  sched->last_sample_ns = 0;
+
+  // at high rates splitting the drain costs more bus time than the latency it saves others
+  sched->chunk = (sched->rate_hz > IRLED_FIFO_BURST_RATE_HZ) ? MX_FIFO_DEPTH
+                                                             : IRLED_FIFO_DRAIN_CHUNK;
+}
+
+/* The chip keeps sampling while reading is stopped, last_ptr_ns is kept so whatever that
+   overflowed is still counted */
+static void irled_sched_reset(IrledFifoSched *sched, uint64_t now)
+{
+  sched->measured_hz = sched->rate_hz;
+  sched->next_wake_ns = now;
+}
+
+/* Follow the chip's real rate, its oscillator is only good to a few percent */
+static void irled_sched_observe(IrledFifoSched *sched, uint8_t wr, uint64_t now, bool overflowed)
+{
+  if ((sched->last_ptr_ns != 0) && !overflowed && (now > sched->last_ptr_ns)) {
+    uint8_t advance = (wr - sched->last_wr) & 0x1F;
+    float measured = (float)advance / ((float)(now - sched->last_ptr_ns) * 1e-9f);
+    sched->measured_hz += (measured - sched->measured_hz) * IRLED_FIFO_RATE_GAIN;
+
+    // a wild reading must never stretch the wake interval past the fifo's depth
+    if (sched->measured_hz < 0.5f * sched->rate_hz) {
+      sched->measured_hz = 0.5f * sched->rate_hz;
+    }
+    else if (sched->measured_hz > 2.0f * sched->rate_hz) {
+      sched->measured_hz = 2.0f * sched->rate_hz;
     }
-    nanosleep(&ts, NULL);
   }
-  printf("exiting thread\n");
-  return NULL;
+
+  sched->last_wr = wr;
+  sched->last_ptr_ns = now;
 }
 
-static StatusCode max30102_read_fifo_to_buffer()
+/* Wake once the fifo should hold target samples, unread are already in it at now */
+static void irled_sched_next(IrledFifoSched *sched, uint64_t now, uint8_t unread)
 {
+  uint8_t to_go = (unread < sched->target) ? sched->target - unread : 1;
 
-  uint8_t wr = 0;
-  uint8_t rd = 0;
+  sched->next_wake_ns = now + (uint64_t)((float)to_go * 1e9f / sched->measured_hz);
+}
 
-  StatusCode ret = STATUS_CODE_OK;
+/* Timestamp of the newest of count samples read at the pointer read. The chip's clock is not
+   readable, so the newest sample is taken to be half a period old when the pointers were read
+   and the clock only moves part of the way to each such observation, which averages out the
+   bus latency. Dead reckoning from the last batch keeps the spacing exact across batches */
+static uint64_t irled_sched_stamp(IrledFifoSched *sched, uint64_t ptr_ns, uint8_t count,
+                                  bool overflowed)
+{
+  float period_ns = 1e9f / sched->measured_hz;
+  uint64_t observed = ptr_ns - (uint64_t)(0.5f * period_ns);
 
-  ret = IRLED_READ_REG(MX_FIFO_WR_PTR, &wr);
-  if (ret != STATUS_CODE_OK) {
-    printf("fifo wr ptr read failed with exit code: %u\n", ret);
-    return ret;
+  if ((sched->last_sample_ns == 0) || overflowed) {
+    sched->last_sample_ns = observed;
+    return observed;
   }
-  ret = IRLED_READ_REG(MX_FIFO_RD_PTR, &rd);
-  if (ret != STATUS_CODE_OK) {
-    printf("fifo wr ptr read failed with exit code: %u\n", ret);
-    return ret;
+
+  uint64_t predicted = sched->last_sample_ns + (uint64_t)((float)count * period_ns);
+  int64_t error = (int64_t)(observed - predicted);
+
+  sched->last_sample_ns = predicted + (uint64_t)(int64_t)((float)error * IRLED_CLOCK_GAIN);
+  return sched->last_sample_ns;
+}
+
+// ================================
+// Fifo read
+// ================================
+/* A fifo read runs as a chain of requests on the sensor's bus: the status block, then the
+   drain in chunks. Each step is submitted from the previous one's callback on the bus
+   scheduler thread, so the event thread never waits on the bus */
+static void irled_fifo_finish(IrledSensor *sensor, StatusCode status)
+{
+  if (status != STATUS_CODE_OK) {
+    sensor->sched.next_wake_ns = time_now_ns() + IRLED_RETRY_BACKOFF_MS * 1000000ULL;
+  }
+
+  // nothing touches the sensor or the event fd after busy is cleared, stop_reading may be
+  // waiting to return and close the fd. The event thread reads busy under the same mutex, so
+  // it either sees the sensor idle or gets this kick after it looked
+  pthread_mutex_lock(&sensor->mutex);
+  irled_event_kick();
+  atomic_store(&sensor->busy, false);
+  pthread_cond_broadcast(&sensor->idle);
+  pthread_mutex_unlock(&sensor->mutex);
+}
+
+/* Convert and deliver a drained batch, true when it calls for a presence mode switch. An idle
+   sensor's samples only feed the presence check */
+static bool irled_fifo_publish(IrledSensor *sensor)
+{
+  IrledFifoSched *sched = &sensor->sched;
+  uint8_t count = sensor->count;
+  uint64_t ir_sum = 0;
+  IrledTimedSample samples[MX_FIFO_DEPTH];
+  Max30102Sample hr_samples[MX_FIFO_DEPTH];
+
+  uint64_t newest_ns = irled_sched_stamp(sched, sensor->ptr_ns, count, sensor->ovf != 0);
+  float period_ns = 1e9f / sched->measured_hz;
+
+  for (uint8_t i = 0; i < count; i++) {
+    const uint8_t *p = &sensor->buf[i * MX_FIFO_SAMPLE_BYTES];
+
+    // in SpO2 mode each sample is LED1 (red) followed by LED2 (ir)
+    hr_samples[i].red = ((uint32_t)(p[0] & 0x03) << 16 | (uint32_t)(p[1] << 8)
+                         | (uint32_t)(p[2]));
+
+    hr_samples[i].ir = ((uint32_t)(p[3] & 0x03) << 16 | (uint32_t)(p[4] << 8)
+                        | (uint32_t)(p[5]));
+
+    samples[i].sample = hr_samples[i];
+    samples[i].timestamp_ns = newest_ns - (uint64_t)((float)(count - 1 - i) * period_ns);
+    ir_sum += hr_samples[i].ir;
+  }
+
+  if (atomic_load(&sensor->present)) {
+    spsc_ring_push(&sensor->sample_ring, samples, count);
+    spsc_ring_push(&sensor->hr_ring, hr_samples, count);
+  }
+
+  pthread_mutex_lock(&sensor->mutex);
+  sensor->stats.drains++;
+  sensor->stats.samples += count;
+  sensor->stats.overflows += (sensor->ovf != 0);
+  sensor->stats.lost_samples += sensor->lost;
+  sensor->stats.expected_rate_hz = sched->rate_hz;
+  sensor->stats.measured_rate_hz = sched->measured_hz;
+  sensor->stats.wake_interval_us = (uint32_t)((float)sched->target * 1e6f / sched->measured_hz);
+  pthread_mutex_unlock(&sensor->mutex);
+
+  return irled_presence_update(sensor, (uint32_t)(ir_sum / count), newest_ns);
+}
+
+static void irled_fifo_chunk_done(I2cRequest *req, void *arg)
+{
+  IrledSensor *sensor = arg;
+
+  if (req->status != STATUS_CODE_OK) {
+    printf("i2c read from fifo data register failed\n");
+    irled_fifo_finish(sensor, STATUS_CODE_FAILED);
+    return;
+  }
+
+  sensor->drained += sensor->chunk_len;
+  if (sensor->drained < sensor->count) {
+    irled_fifo_submit_chunk(sensor);
+    return;
+  }
+
+  // samples that landed during the drain were not in count, they start the next batch
+  irled_sched_next(&sensor->sched, sensor->ptr_ns, 0);
+  if (irled_fifo_publish(sensor)) {
+    irled_presence_switch(sensor);
+    return;
+  }
+  irled_fifo_finish(sensor, STATUS_CODE_OK);
+}
+
+/* FIFO_DATA does not advance the register pointer, so each read drains samples back to back.
+   A full fifo is ~17ms of bus time at 100kHz, at low rates split it so a queued servo frame
+   never waits behind more than one chunk */
+static void irled_fifo_submit_chunk(IrledSensor *sensor)
+{
+  uint8_t chunk = sensor->count - sensor->drained;
+  if (chunk > sensor->sched.chunk) {
+    chunk = sensor->sched.chunk;
+  }
+  sensor->chunk_len = chunk;
+
+  sensor->reg = MX_FIFO_DATA;
+  sensor->msgs[0] = I2C_MSG_WRITE(MX_I2C_ADDR, &sensor->reg, 1);
+  sensor->msgs[1] = I2C_MSG_READ(MX_I2C_ADDR, &sensor->buf[sensor->drained * MX_FIFO_SAMPLE_BYTES],
+                                 (uint32_t)chunk * MX_FIFO_SAMPLE_BYTES);
+  sensor->req = (I2cRequest) {
+    .msgs = sensor->msgs,
+    .n = 2,
+    .prio = I2C_PRIO_BULK,
+    .cb = irled_fifo_chunk_done,
+    .cb_arg = sensor,
+  };
+
+  if (i2c_sched_submit(sensor->bus, &sensor->req) != STATUS_CODE_OK) {
+    irled_fifo_finish(sensor, STATUS_CODE_FAILED);
   }
+}
+
+static void irled_fifo_status_done(I2cRequest *req, void *arg)
+{
+  IrledSensor *sensor = arg;
+  IrledFifoSched *sched = &sensor->sched;
+
+  if (req->status != STATUS_CODE_OK) {
+    printf("fifo ptr read failed with exit code: %d\n", req->status);
+    irled_fifo_finish(sensor, req->status);
+    return;
+  }
+
+  uint64_t now = req->done_ns;
+  uint8_t is1 = sensor->status[MX_IS1];
+  uint8_t wr = sensor->status[MX_FIFO_WR_PTR] & 0x1F;
+  uint8_t ovf = sensor->status[MX_OVF_COUNTER] & 0x1F;
+  uint8_t rd = sensor->status[MX_FIFO_RD_PTR] & 0x1F;
 
   uint8_t count = (wr - rd) & 0x1F;
+  uint64_t lost = 0;
 
-  if (count > 16) {
-    count = 16;
+  // equal pointers with a non zero overflow count means the fifo is full
+  if ((count == 0) && (ovf != 0)) {
+    count = MX_FIFO_DEPTH;
   }
 
-  for (uint8_t i = 0; i < count; i++) {
-    Max30102Sample sample;
-
-    uint8_t buf[6];
-    StatusCode ret = i2c_write_then_read(I2C_BUS_2, MX_I2C_ADDR,
-                                         (uint8_t[]) {MX_FIFO_DATA}, 1, buf, 6);
-    if (ret != STATUS_CODE_OK) {
-      printf("i2c read from fifo data register failed\n");
-      return STATUS_CODE_FAILED;
+  if (ovf != 0) {
+    // the counter saturates, past that the time since the last read says how much went
+    lost = ovf;
+    if ((ovf == 0x1F) && (sched->last_ptr_ns != 0)) {
+      uint64_t due = (uint64_t)((float)(now - sched->last_ptr_ns) * 1e-9f * sched->measured_hz);
+      if (due > MX_FIFO_DEPTH + lost) {
+        lost = due - MX_FIFO_DEPTH;
+      }
     }
+    printf("Warning: irled fifo on bus %d overflowed, %llu samples lost\n", sensor->bus,
+           (unsigned long long)lost);
+  }
+
+  irled_sched_observe(sched, wr, now, ovf != 0);
+
+  // a timer wake that comes early only costs the status read, the drain waits for a full batch
+  bool drain_all = sensor->from_edge || (is1 & IS1_A_FULL);
+  if ((count == 0) || (!drain_all && (ovf == 0) && (count < sched->target / 2))) {
+    irled_sched_next(sched, now, count);
+    irled_fifo_finish(sensor, STATUS_CODE_OK);
+    return;
+  }
 
-    sample.ir = ((uint32_t)(buf[0] & 0x03) << 16 | (uint32_t)(buf[1] << 8)
-                 | (uint32_t)(buf[2]));
+  sensor->count = count;
+  sensor->drained = 0;
+  sensor->ovf = ovf;
+  sensor->lost = lost;
+  sensor->ptr_ns = now;
+  irled_fifo_submit_chunk(sensor);
+}
 
-    sample.red = ((uint32_t)(buf[3] & 0x03) << 16 | (uint32_t)(buf[4] << 8)
-                  | (uint32_t)(buf[5]));
+/* Start a fifo read, called by the event thread with busy set. The status block runs from IS1
+   to RD_PTR: reading IS1 acknowledges A_FULL, so a missed edge never leaves INT stuck low,
+   and WR_PTR, OVF_COUNTER and RD_PTR come with it in the same read */
+static void irled_fifo_start(IrledSensor *sensor, bool from_edge)
+{
+  pthread_mutex_lock(&sensor->mutex);
+  sensor->stats.wakeups++;
+  sensor->stats.edge_wakeups += from_edge;
+  pthread_mutex_unlock(&sensor->mutex);
+
+  sensor->from_edge = from_edge;
+  sensor->reg = MX_IS1;
+  sensor->msgs[0] = I2C_MSG_WRITE(MX_I2C_ADDR, &sensor->reg, 1);
+  sensor->msgs[1] = I2C_MSG_READ(MX_I2C_ADDR, sensor->status, IRLED_STATUS_READ_LEN);
+  sensor->req = (I2cRequest) {
+    .msgs = sensor->msgs,
+    .n = 2,
+    .prio = I2C_PRIO_BULK,
+    .cb = irled_fifo_status_done,
+    .cb_arg = sensor,
+  };
+
+  StatusCode ret = i2c_sched_submit(sensor->bus, &sensor->req);
+  if (ret != STATUS_CODE_OK) {
+    printf("fifo read submit on bus %d failed with exit code: %d\n", sensor->bus, ret);
+    irled_fifo_finish(sensor, ret);
+  }
+}
 
-    pthread_mutex_lock(&s_buffer_mutex);
-    s_buffer[s_head] = sample;
-    s_head = (s_head + 1) % MAX30102_BUFFER_SIZE;
-    if (s_head == s_tail) {
-      s_tail = (s_tail + 1) % MAX30102_BUFFER_SIZE;
+// ================================
+// Presence
+// ================================
+/* The settings the chip runs with a finger on, or idling without one */
+static IrledConfig irled_mode_config(const IrledConfig *config, bool present)
+{
+  IrledConfig mode = *config;
+
+  if (!present) {
+    mode.sample_rate_hz = IRLED_IDLE_SAMPLE_RATE_HZ;
+    mode.chip_average = IRLED_IDLE_CHIP_AVERAGE;
+    mode.red_led_pa = 0;
+    if (mode.ir_led_pa > IRLED_IDLE_IR_LED_PA) {
+      mode.ir_led_pa = IRLED_IDLE_IR_LED_PA;
     }
   }
 
-  pthread_mutex_lock(&s_buffer_mutex);
-  pthread_cond_signal(&s_buffer_cv);
-  pthread_mutex_unlock(&s_buffer_mutex);
+  return mode;
+}
 
-  return STATUS_CODE_OK;
+/* Follow finger contact from the IR DC level of a batch, true when the chip has to change
+   mode. Contact has to be gone for IRLED_PRESENCE_ABSENT_MS before the sensor idles, so a
+   finger shifting on the sensor keeps its hr estimate, while one batch above the level
+   brings it back */
+static bool irled_presence_update(IrledSensor *sensor, uint32_t ir_dc, uint64_t now)
+{
+  const IrledConfig *config = &sensor->config;
+
+  if (config->presence_counts == 0) {
+    return false;
+  }
+
+  bool present = atomic_load(&sensor->present);
+  IrledConfig mode = irled_mode_config(config, present);
+
+  // the photocurrent follows the LED current, scale back to the level presence_counts is for
+  uint64_t level = 0;
+  if (mode.ir_led_pa != 0) {
+    level = (uint64_t)ir_dc * config->ir_led_pa / mode.ir_led_pa;
+  }
+
+  if (level >= config->presence_counts) {
+    sensor->absent_since_ns = 0;
+    return !present;
+  }
+
+  if (!present) {
+    return false;
+  }
+
+  if (sensor->absent_since_ns == 0) {
+    sensor->absent_since_ns = now;
+    return false;
+  }
+
+  return (now - sensor->absent_since_ns) >= IRLED_PRESENCE_ABSENT_MS * 1000000ULL;
 }
 
-static uint16_t irled_buffer_count_unsafe(void)
+/* Record a presence change, once the chip runs the matching mode */
+static void irled_presence_set(IrledSensor *sensor, bool present, uint64_t now)
 {
-  if (s_head >= s_tail) {
-    return (uint16_t)(s_head - s_tail);
+  sensor->absent_since_ns = 0;
+  if (atomic_exchange(&sensor->present, present) == present) {
+    return;
+  }
+
+  if (present) {
+    atomic_store(&sensor->dsp_reset, true);
   }
-  return (uint16_t)(MAX30102_BUFFER_SIZE - (s_tail - s_head));
+  else {
+    atomic_store(&sensor->bpm, 0);
+    atomic_store(&sensor->confidence_pct, 0);
+    atomic_store(&sensor->spo2_x10, 0);
+  }
+
+  printf("irled on bus %d: %s\n", sensor->bus, present ? "contact, full rate" : "no contact, idling");
+
+  IrledPresenceEvent event = {.timestamp_ns = now, .present = present};
+  spsc_ring_push(&sensor->presence_ring, &event, 1);
 }
 
-static void *hr_calc_thread_func(void *arg)
+static void irled_presence_switch_done(I2cRequest *req, void *arg)
+{
+  IrledSensor *sensor = arg;
+
+  if (req->status != STATUS_CODE_OK) {
+    // the next batch finds the same level and tries again
+    printf("irled mode switch on bus %d failed with exit code: %d\n", sensor->bus, req->status);
+    irled_fifo_finish(sensor, req->status);
+    return;
+  }
+
+  // the fifo was cleared with the switch, the sample clock starts over
+  irled_sched_config(&sensor->sched, sensor->mode_regs[3], sensor->mode_regs[1]);
+  irled_sched_next(&sensor->sched, req->done_ns, 0);
+  irled_presence_set(sensor, !atomic_load(&sensor->present), req->done_ns);
+  irled_fifo_finish(sensor, STATUS_CODE_OK);
+}
+
+/* Move the chip to the other presence mode, chained after the drain that saw the change */
+static void irled_presence_switch(IrledSensor *sensor)
+{
+  IrledConfig mode = irled_mode_config(&sensor->config, !atomic_load(&sensor->present));
+  uint8_t spo2_config;
+  uint8_t fifo_config;
+
+  if (irled_encode_config(&mode, &spo2_config, &fifo_config) != STATUS_CODE_OK) {
+    irled_fifo_finish(sensor, STATUS_CODE_FAILED);
+    return;
+  }
+
+  uint8_t *regs = sensor->mode_regs;
+  regs[0] = MX_FIFO_CONFIG;
+  regs[1] = fifo_config;
+  regs[2] = MX_SPO2_CONFIG;
+  regs[3] = spo2_config;
+  // LED1_PA and LED2_PA are adjacent
+  regs[4] = MX_LED1_PULSE_AMP;
+  regs[5] = mode.red_led_pa;
+  regs[6] = mode.ir_led_pa;
+  // samples taken in the old mode are dropped with the pointers
+  regs[7] = MX_FIFO_WR_PTR;
+  regs[8] = 0x00;
+  regs[9] = 0x00;
+  regs[10] = 0x00;
+
+  sensor->msgs[0] = I2C_MSG_WRITE(MX_I2C_ADDR, &regs[0], 2);
+  sensor->msgs[1] = I2C_MSG_WRITE(MX_I2C_ADDR, &regs[2], 2);
+  sensor->msgs[2] = I2C_MSG_WRITE(MX_I2C_ADDR, &regs[4], 3);
+  sensor->msgs[3] = I2C_MSG_WRITE(MX_I2C_ADDR, &regs[7], 4);
+  sensor->req = (I2cRequest) {
+    .msgs = sensor->msgs,
+    .n = 4,
+    .prio = I2C_PRIO_BULK,
+    .cb = irled_presence_switch_done,
+    .cb_arg = sensor,
+  };
+
+  if (i2c_sched_submit(sensor->bus, &sensor->req) != STATUS_CODE_OK) {
+    irled_fifo_finish(sensor, STATUS_CODE_FAILED);
+  }
+}
+
+// ================================
+// Event thread
+// ================================
+/* Sleeps until the earliest scheduled wake of any idle sensor, an INT edge or a kick. Each
+   sensor wakes on its schedule just before A_FULL, so a full batch is drained with one status
+   read and the INT edge only fires when a chip runs faster than its schedule expects */
+static void *irled_event_thread_func(void *arg)
 {
   (void)arg;
-  Max30102Sample block[256];
 
-  #define IBI_BUF 8
-  uint32_t ibi_samples[IBI_BUF] = {0};
-  uint8_t ibi_head = 0;
-  uint8_t ibi_count = 0;
+  while (atomic_load(&s_event_running)) {
+    IrledSensor *sensors[IRLED_MAX_SENSORS];
+    struct pollfd pfds[1 + IRLED_MAX_SENSORS];
+    int edge_idx[IRLED_MAX_SENSORS];
+    nfds_t nfds = 1;
+    uint64_t wake_ns = UINT64_MAX;
+
+    pfds[0] = (struct pollfd) {.fd = atomic_load(&s_event_efd), .events = POLLIN};
+
+    pthread_mutex_lock(&s_event_mutex);
+    uint32_t n = s_event_count;
+    memcpy(sensors, s_event_sensors, n * sizeof(sensors[0]));
+
+    for (uint32_t i = 0; i < n; i++) {
+      edge_idx[i] = -1;
+      if (sensors[i]->edge_fd >= 0) {
+        edge_idx[i] = (int)nfds;
+        pfds[nfds++] = (struct pollfd) {.fd = sensors[i]->edge_fd, .events = POLLIN};
+      }
+
+      // a busy sensor's next wake is set when its read completes, which kicks us
+      pthread_mutex_lock(&sensors[i]->mutex);
+      if (!atomic_load(&sensors[i]->busy) && (sensors[i]->sched.next_wake_ns < wake_ns)) {
+        wake_ns = sensors[i]->sched.next_wake_ns;
+      }
+      pthread_mutex_unlock(&sensors[i]->mutex);
+    }
+    pthread_mutex_unlock(&s_event_mutex);
+
+    uint64_t now = time_now_ns();
+    int timeout_ms = -1;
 
-  atomic_store(&is_hr_thread_running, true);
+    if (wake_ns != UINT64_MAX) {
+      timeout_ms = (wake_ns > now) ? (int)((wake_ns - now + 999999) / 1000000) : 0;
+    }
+
+    int ready = poll(pfds, nfds, timeout_ms);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("poll failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      uint64_t kicks;
+      if (read(pfds[0].fd, &kicks, sizeof(kicks)) != (ssize_t)sizeof(kicks)) {
+        printf("failed to read irled event fd\n");
+      }
+    }
+
+    now = time_now_ns();
+
+    // held while starting reads, so a sensor that stop_reading has removed is never started
+    pthread_mutex_lock(&s_event_mutex);
+    for (uint32_t i = 0; i < n; i++) {
+      IrledSensor *sensor = sensors[i];
+      if (!atomic_load(&sensor->reading)) {
+        continue;
+      }
+
+      bool edge = false;
+      if ((edge_idx[i] >= 0) && (pfds[edge_idx[i]].revents & (POLLHUP | POLLERR | POLLNVAL))) {
+        // the line request is gone, polling it again would return at once forever
+        printf("edge events lost on pin %d, running on the schedule alone\n", sensor->int_pin);
+        sensor->edge_fd = -1;
+      }
+      else if ((edge_idx[i] >= 0) && (pfds[edge_idx[i]].revents & POLLIN)) {
+        edge = (gpio_wait_edge(sensor->int_pin, 0, NULL) == STATUS_CODE_OK);
+      }
 
-  while (atomic_load(&is_thread_running)) {
-    uint16_t n = irled_pop_multiple(block, (uint16_t)(sizeof(block) / sizeof(block[0])));
+      if (atomic_load(&sensor->busy) || (!edge && (now < sensor->sched.next_wake_ns))) {
+        continue;
+      }
+
+      atomic_store(&sensor->busy, true);
+      irled_fifo_start(sensor, edge);
+    }
+    pthread_mutex_unlock(&s_event_mutex);
+  }
+
+  printf("exiting thread\n");
+  return NULL;
+}
+
+/* Add a sensor to the event thread, starting the thread with the first one */
+static StatusCode irled_event_add(IrledSensor *sensor)
+{
+  StatusCode ret = STATUS_CODE_OK;
+
+  pthread_mutex_lock(&s_event_mutex);
+
+  if (s_event_count == IRLED_MAX_SENSORS) {
+    ret = STATUS_CODE_FAILED;
+  }
+  else if (s_event_count == 0) {
+    atomic_store(&s_event_efd, eventfd(0, EFD_CLOEXEC));
+    if (atomic_load(&s_event_efd) < 0) {
+      ret = STATUS_CODE_FAILED;
+    }
+    else {
+      atomic_store(&s_event_running, true);
+      if (pthread_create(&s_event_thread, NULL, irled_event_thread_func, NULL) != 0) {
+        atomic_store(&s_event_running, false);
+        close(atomic_exchange(&s_event_efd, -1));
+        ret = STATUS_CODE_THREAD_FAILURE;
+      }
+    }
+  }
+
+  if (ret == STATUS_CODE_OK) {
+    s_event_sensors[s_event_count++] = sensor;
+    irled_event_kick();
+  }
+
+  pthread_mutex_unlock(&s_event_mutex);
+  return ret;
+}
+
+/* Remove a sensor from the event thread, stopping the thread with the last one. Once this
+   returns the event thread starts no more reads on the sensor */
+static void irled_event_remove(IrledSensor *sensor)
+{
+  bool last = false;
+
+  pthread_mutex_lock(&s_event_mutex);
+  atomic_store(&sensor->reading, false);
+
+  for (uint32_t i = 0; i < s_event_count; i++) {
+    if (s_event_sensors[i] == sensor) {
+      s_event_sensors[i] = s_event_sensors[--s_event_count];
+      break;
+    }
+  }
+
+  last = (s_event_count == 0);
+  if (last) {
+    atomic_store(&s_event_running, false);
+  }
+  pthread_mutex_unlock(&s_event_mutex);
+
+  // a read in flight kicks the fd before it clears busy, so once the sensor is idle its
+  // callbacks are done with the fd and it can be closed
+  pthread_mutex_lock(&sensor->mutex);
+  while (atomic_load(&sensor->busy)) {
+    pthread_cond_wait(&sensor->idle, &sensor->mutex);
+  }
+  pthread_mutex_unlock(&sensor->mutex);
+
+  if (last) {
+    irled_event_kick();
+    pthread_join(s_event_thread, NULL);
+    close(atomic_exchange(&s_event_efd, -1));
+  }
+}
+
+static void *hr_calc_thread_func(void *arg)
+{
+  IrledSensor *sensor = arg;
+  Max30102Sample block[256];
+
+  while (atomic_load(&sensor->reading)) {
+    uint32_t n = spsc_ring_pop_wait(&sensor->hr_ring, block,
+                                    (uint32_t)(sizeof(block) / sizeof(block[0])), -1);
     if (n == 0) {
       continue;
     }
-    // TODO: add processing
+
+    // contact came back, whatever the pipeline held is from before the gap
+    if (atomic_exchange(&sensor->dsp_reset, false)) {
+      ppg_dsp_reset(&sensor->dsp);
+      ppg_decim_reset(&sensor->decim);
+    }
+
+    // decimated in place, the hr pipeline runs at the fifo rate over host_decimation
+    uint32_t stride = sizeof(Max30102Sample) / sizeof(uint32_t);
+    n = ppg_decim_process(&sensor->decim, &block[0].ir, &block[0].red, stride, n,
+                          &block[0].ir, &block[0].red, stride);
+
+    ppg_dsp_process(&sensor->dsp, &block[0].ir, &block[0].red, stride, n);
+
+    // a block from before contact was lost must not bring the estimate back
+    if (!atomic_load(&sensor->present)) {
+      continue;
+    }
+
+    atomic_store(&sensor->bpm, sensor->dsp.bpm);
+    atomic_store(&sensor->confidence_pct, sensor->dsp.confidence_pct);
+    atomic_store(&sensor->spo2_x10, sensor->dsp.spo2_x10);
   }
 
-  atomic_store(&is_hr_thread_running, false);
   return NULL;
 }
 
-StatusCode irled_init()
+// ================================
+// Configuration
+// ================================
+static int irled_find(const uint16_t *table, int n, uint16_t value)
+{
+  for (int i = 0; i < n; i++) {
+    if (table[i] == value) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Register values for a configuration, rejecting combinations the chip cannot run */
+static StatusCode irled_encode_config(const IrledConfig *config, uint8_t *spo2_config,
+                                      uint8_t *fifo_config)
+{
+  static const uint16_t rates_hz[] = {50, 100, 200, 400, 800, 1000, 1600, 3200};
+  static const uint16_t pulse_widths_us[] = {69, 118, 215, 411};
+  static const uint16_t max_rates_hz[] = {1600, 1000, 800, 400}; // SpO2 mode, per pulse width
+  static const uint16_t ranges_na[] = {2048, 4096, 8192, 16384};
+  static const uint16_t averages[] = {1, 2, 4, 8, 16, 32};
+
+  int rate = irled_find(rates_hz, 8, config->sample_rate_hz);
+  int pw = irled_find(pulse_widths_us, 4, config->pulse_width_us);
+  int range = irled_find(ranges_na, 4, config->adc_range_na);
+  int avg = irled_find(averages, 6, config->chip_average);
+
+  if ((rate < 0) || (pw < 0) || (range < 0) || (avg < 0) || (config->host_decimation == 0)
+      || (config->host_decimation > PPG_DECIM_MAX_FACTOR)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (config->sample_rate_hz > max_rates_hz[pw]) {
+    printf("irled: %u sps is too fast for a %u us pulse in SpO2 mode\n", config->sample_rate_hz,
+           config->pulse_width_us);
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  *spo2_config = (uint8_t)((range << 5) | (rate << SPO2_CONFIG_SAMPLE_RT_SHIFT) | pw);
+  *fifo_config = (uint8_t)((avg << FIFO_CONFIG_SAMPLE_AVERAGE_SHIFT) | FIFO_CONFIG_ROLLOVER_EN
+                           | FIFO_CONFIG_A_FULL_10_SAMPLES);
+  return STATUS_CODE_OK;
+}
+
+/* Set up the decimator and the hr pipeline for the rate a configuration delivers */
+static StatusCode irled_config_dsp(IrledSensor *sensor, const IrledConfig *config)
+{
+  uint32_t fifo_rate_hz = config->sample_rate_hz / config->chip_average;
+  PpgDsp dsp;
+
+  // checked before anything changes, too low a rate for the band-pass is refused
+  TRY(ppg_dsp_init(&dsp, fifo_rate_hz / config->host_decimation));
+  TRY(ppg_decim_init(&sensor->decim, config->host_decimation));
+  sensor->dsp = dsp;
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode irled_dev_init(IrledSensor *sensor, I2cBus i2c_bus, int int_pin)
 {
   StatusCode ret = STATUS_CODE_OK;
 
-  ret = i2c_get_initialized(I2C_BUS_2);
+  if (!sensor) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (sensor->initialized) {
+    return STATUS_CODE_ALREADY_INITIALIZED;
+  }
+
+  ret = i2c_get_initialized(i2c_bus);
   if (ret != STATUS_CODE_OK) {
-    printf("i2c bus: %u is not initialized\n", ret);
+    printf("i2c bus: %u is not initialized\n", i2c_bus);
     return ret;
   }
 
-  IRLED_WRITE_REG(MX_MODE_CONFIG, MODE_CONFIG_RESET);
+  memset(sensor, 0, sizeof(*sensor));
+  sensor->bus = i2c_bus;
+  sensor->int_pin = int_pin;
+  sensor->edge_fd = -1;
+  sensor->config = IRLED_CONFIG_DEFAULT;
+
+  // fifo drains are the bulkiest traffic on the bus and can wait the longest
+  TRY(i2c_sched_set_addr_prio(i2c_bus, MX_I2C_ADDR, I2C_PRIO_BULK));
+
+  TRY(spsc_ring_init(&sensor->sample_ring, sensor->sample_buffer, sizeof(IrledTimedSample),
+                     MAX30102_BUFFER_SIZE));
+  TRY(spsc_ring_init(&sensor->hr_ring, sensor->hr_buffer, sizeof(Max30102Sample),
+                     MAX30102_BUFFER_SIZE));
+  TRY(spsc_ring_init(&sensor->presence_ring, sensor->presence_buffer,
+                     sizeof(IrledPresenceEvent), IRLED_PRESENCE_EVENTS));
+  atomic_store(&sensor->present, true);
+
+  uint8_t spo2_config;
+  uint8_t fifo_config;
+  TRY(irled_encode_config(&sensor->config, &spo2_config, &fifo_config));
+  TRY(irled_config_dsp(sensor, &sensor->config));
+
+  IRLED_WRITE_REG(sensor, MX_MODE_CONFIG, MODE_CONFIG_RESET);
 
   uint8_t mode_cfg = 0;
   const int max_retries = 50;
 
   for (int i = 0; i < max_retries; i++) {
-    IRLED_READ_REG(MX_MODE_CONFIG, &mode_cfg);
+    IRLED_READ_REG(sensor, MX_MODE_CONFIG, &mode_cfg);
     if ((mode_cfg & MODE_CONFIG_RESET) == 0) {
       break;
     }
-    nanosleep(&ts, NULL);
+
+    struct timespec poll_delay = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+    nanosleep(&poll_delay, NULL);
   }
 
   uint8_t partId;
-  ret = IRLED_READ_REG(MX_PART_ID, &partId);
+  ret = IRLED_READ_REG(sensor, MX_PART_ID, &partId);
   if (ret != STATUS_CODE_OK) {
     printf("IRLED_READ_REG() failed with exit code: %u\n", ret);
     return STATUS_CODE_FAILED;
   }
   else {
-    printf("irled init, part id: %02X, expected 0x15\n", partId);
+    printf("irled init on bus %d, part id: %02X, expected 0x15\n", i2c_bus, partId);
   }
 
-  uint8_t int_status;
-  ret = IRLED_READ_REG(MX_IS1, &int_status);
+  // IS1 and IS2 are adjacent, reading both clears any pending interrupt
+  uint8_t int_status[2] = {0, 0};
+  I2cMsg status_msgs[] = {
+    IRLED_MSG_READ_REGS(MX_IS1, int_status, 2),
+  };
+
+  ret = i2c_transfer_batch(i2c_bus, status_msgs, I2C_NUM_MSGS(status_msgs));
   if (ret != STATUS_CODE_OK) {
-    printf("IRLED_READ_REG() failed with exit code: %u\n", ret);
+    printf("i2c_transfer_batch() failed with exit code: %d\n", ret);
     return STATUS_CODE_FAILED;
   }
   else {
-    printf("Cleared interrupt status 1 with value: %d\n", int_status);
+    printf("Cleared interrupt status 1 with value: %d\n", int_status[0]);
+    printf("Cleared interrupt status 2 with value: %d\n", int_status[1]);
   }
-  ret = IRLED_READ_REG(MX_IS2, &int_status);
+
+  I2cMsg config_msgs[] = {
+    IRLED_MSG_WRITE_REG(MX_FIFO_CONFIG, fifo_config),
+    // WR_PTR, OVF_COUNTER and RD_PTR are adjacent, clear all three at once
+    I2C_MSG_WRITE(MX_I2C_ADDR, ((uint8_t[]) {MX_FIFO_WR_PTR, 0x00, 0x00, 0x00}), 4),
+    IRLED_MSG_WRITE_REG(MX_SPO2_CONFIG, spo2_config),
+    // LED1_PA and LED2_PA are adjacent
+    I2C_MSG_WRITE(MX_I2C_ADDR,
+                  ((uint8_t[]) {MX_LED1_PULSE_AMP, sensor->config.red_led_pa,
+                                sensor->config.ir_led_pa}), 3),
+    IRLED_MSG_WRITE_REG(MX_IE1, IE1_A_FULL_EN),
+    IRLED_MSG_WRITE_REG(MX_MODE_CONFIG, MODE_CONFIG_SPO2_MODE),
+  };
+
+  ret = i2c_transfer_batch(i2c_bus, config_msgs, I2C_NUM_MSGS(config_msgs));
   if (ret != STATUS_CODE_OK) {
-    printf("IRLED_READ_REG() failed with exit code: %u\n", ret);
+    printf("i2c_transfer_batch() failed with exit code: %d\n", ret);
     return STATUS_CODE_FAILED;
   }
-  else {
-    printf("Cleared interrupt status 2 with value: %d\n", int_status);
+
+  irled_sched_config(&sensor->sched, spo2_config, fifo_config);
+
+  TRY(gpio_set_mode(int_pin, GPIO_MODE_INPUT));
+  TRY(gpio_set_edge(int_pin, GPIO_EDGE_FALLING));
+
+  pthread_mutex_init(&sensor->mutex, NULL);
+  pthread_cond_init(&sensor->idle, NULL);
+  sensor->initialized = true;
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode irled_dev_set_config(IrledSensor *sensor, const IrledConfig *config)
+{
+  if (!sensor || !config) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (!sensor->initialized) {
+    return STATUS_CODE_NOT_INITIALIZED;
   }
 
-  IRLED_WRITE_REG(MX_FIFO_CONFIG, FIFO_CONFIG_SAMPLE_AVERAGE_4
-                  | FIFO_CONFIG_ROLLOVER_EN
-                  | FIFO_CONFIG_A_FULL_10_SAMPLES);
+  uint8_t spo2_config;
+  uint8_t fifo_config;
+  TRY(irled_encode_config(config, &spo2_config, &fifo_config));
 
-  IRLED_WRITE_REG(MX_FIFO_WR_PTR, 0x00);
-  IRLED_WRITE_REG(MX_OVF_COUNTER, 0x00);
-  IRLED_WRITE_REG(MX_FIFO_RD_PTR, 0x00);
+  bool was_reading = atomic_load(&sensor->reading);
+  if (was_reading) {
+    irled_dev_stop_reading(sensor);
+  }
 
-  IRLED_WRITE_REG(MX_SPO2_CONFIG, SPO2_CONFIG_ADC_RGE_4096
-                  | SPO2_CONFIG_SAMPLE_RT_400
-                  | SPO2_CONFIG_LED_PW_18);
+  StatusCode ret = irled_config_dsp(sensor, config);
+  if (ret != STATUS_CODE_OK) {
+    printf("irled: %u sps over %u and %u is too slow for the hr pipeline\n",
+           config->sample_rate_hz, config->chip_average, config->host_decimation);
+  }
+  else {
+    // an idle sensor comes back at full rate, the next batch decides whether it stays there
+    I2cMsg msgs[] = {
+      IRLED_MSG_WRITE_REG(MX_FIFO_CONFIG, fifo_config),
+      IRLED_MSG_WRITE_REG(MX_SPO2_CONFIG, spo2_config),
+      I2C_MSG_WRITE(MX_I2C_ADDR,
+                    ((uint8_t[]) {MX_LED1_PULSE_AMP, config->red_led_pa, config->ir_led_pa}), 3),
+      // samples taken at the old settings are dropped with the pointers
+      I2C_MSG_WRITE(MX_I2C_ADDR, ((uint8_t[]) {MX_FIFO_WR_PTR, 0x00, 0x00, 0x00}), 4),
+    };
+
+    ret = i2c_transfer_batch(sensor->bus, msgs, I2C_NUM_MSGS(msgs));
+    if (ret == STATUS_CODE_OK) {
+      sensor->config = *config;
+      irled_sched_config(&sensor->sched, spo2_config, fifo_config);
+      irled_presence_set(sensor, true, time_now_ns());
+    }
+    else {
+      printf("i2c_transfer_batch() failed with exit code: %d\n", ret);
+      irled_config_dsp(sensor, &sensor->config);
+    }
+  }
 
-  IRLED_WRITE_REG(MX_LED1_PULSE_AMP, 0x3C);
-  IRLED_WRITE_REG(MX_LED2_PULSE_AMP, 0x3C);
+  if (was_reading) {
+    StatusCode start_ret = irled_dev_start_reading(sensor);
+    if (ret == STATUS_CODE_OK) {
+      ret = start_ret;
+    }
+  }
 
-  IRLED_WRITE_REG(MX_IE1, IE1_A_FULL_EN);
-  IRLED_WRITE_REG(MX_MODE_CONFIG, MODE_CONFIG_SPO2_MODE);
+  return ret;
+}
 
-  TRY(gpio_set_mode(INT_PIN_1, GPIO_MODE_INPUT));
-  TRY(gpio_set_edge(INT_PIN_1, GPIO_EDGE_FALLING));
+StatusCode irled_dev_get_config(IrledSensor *sensor, IrledConfig *config)
+{
+  if (!sensor || !config) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
 
+  *config = sensor->config;
   return STATUS_CODE_OK;
 }
 
-StatusCode irled_deinit()
+StatusCode irled_dev_deinit(IrledSensor *sensor)
 {
-  if (atomic_load(&is_thread_running)) {
-    atomic_store(&is_thread_running, false);
-    pthread_join(int_edge_thread, NULL);
+  if (!sensor) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (!sensor->initialized) {
+    return STATUS_CODE_OK;
   }
 
+  irled_dev_stop_reading(sensor);
+  gpio_release_edge(sensor->int_pin);
+
   printf("Deinitializing\n");
 
-  IRLED_WRITE_REG(MX_MODE_CONFIG, MODE_CONFIG_RESET);
-  IRLED_WRITE_REG(MX_IE1, 0x00);
+  I2cMsg msgs[] = {
+    IRLED_MSG_WRITE_REG(MX_MODE_CONFIG, MODE_CONFIG_RESET),
+    IRLED_MSG_WRITE_REG(MX_IE1, 0x00),
+  };
 
-  return STATUS_CODE_OK;
+  StatusCode ret = i2c_transfer_batch(sensor->bus, msgs, I2C_NUM_MSGS(msgs));
+
+  pthread_cond_destroy(&sensor->idle);
+  pthread_mutex_destroy(&sensor->mutex);
+  sensor->initialized = false;
+
+  return ret;
 }
 
-StatusCode irled_start_reading()
+StatusCode irled_dev_start_reading(IrledSensor *sensor)
 {
-  atomic_store(&is_thread_running, true);
-  int threadRet = pthread_create(&int_edge_thread, NULL, int_edge_thread_func, NULL);
-  if (threadRet != 0) {
-    atomic_store(&is_thread_running, false);
-    return STATUS_CODE_THREAD_FAILURE;
+  if (!sensor) {
+    return STATUS_CODE_INVALID_ARGS;
   }
 
-  threadRet = pthread_create(&hr_thread, NULL, hr_calc_thread_func, NULL);
+  if (!sensor->initialized) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  if (atomic_load(&sensor->reading)) {
+    return STATUS_CODE_ALREADY_INITIALIZED;
+  }
+
+  if (gpio_get_edge_fd(sensor->int_pin, &sensor->edge_fd) != STATUS_CODE_OK) {
+    printf("edge events unavailable on pin %d, running on the schedule alone\n",
+           sensor->int_pin);
+    sensor->edge_fd = -1;
+  }
+
+  ppg_dsp_reset(&sensor->dsp);
+  ppg_decim_reset(&sensor->decim);
+  atomic_store(&sensor->bpm, 0);
+  atomic_store(&sensor->confidence_pct, 0);
+  atomic_store(&sensor->spo2_x10, 0);
+
+  // the first wake is due straight away, which also services a line already stuck low
+  irled_sched_reset(&sensor->sched, time_now_ns());
+
+  atomic_store(&sensor->reading, true);
+  int threadRet = pthread_create(&sensor->hr_thread, NULL, hr_calc_thread_func, sensor);
   if (threadRet != 0) {
-    atomic_store(&is_thread_running, false);
+    atomic_store(&sensor->reading, false);
     return STATUS_CODE_THREAD_FAILURE;
   }
 
+  StatusCode ret = irled_event_add(sensor);
+  if (ret != STATUS_CODE_OK) {
+    atomic_store(&sensor->reading, false);
+    spsc_ring_wake(&sensor->hr_ring);
+    pthread_join(sensor->hr_thread, NULL);
+    return ret;
+  }
 
   return STATUS_CODE_OK;
 }
 
-StatusCode irled_stop_reading(void)
+StatusCode irled_dev_stop_reading(IrledSensor *sensor)
 {
-  if (!atomic_load(&is_thread_running)) {
+  if (!sensor) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (!atomic_load(&sensor->reading)) {
     return STATUS_CODE_OK;
   }
 
   printf("stopping thread\n");
-  atomic_store(&is_thread_running, false);
-  pthread_join(int_edge_thread, NULL);
+  irled_event_remove(sensor);
+
+  spsc_ring_wake(&sensor->hr_ring);
+  pthread_join(sensor->hr_thread, NULL);
   printf("thread stopped\n");
   return STATUS_CODE_OK;
 }
 
-StatusCode irled_pop_sample(Max30102Sample *sample)
+int irled_dev_pop_samples(IrledSensor *sensor, IrledTimedSample *out, uint16_t max_n,
+                          int timeout_ms)
 {
-  pthread_mutex_lock(&s_buffer_mutex);
+  if (!sensor || !out) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
 
-  if (s_head != s_tail) {
-    *sample = s_buffer[s_tail];
-    s_tail = (s_tail + 1) % MAX30102_BUFFER_SIZE;
+  return (int)spsc_ring_pop_wait(&sensor->sample_ring, out, max_n, timeout_ms);
+}
+
+StatusCode irled_dev_get_bpm(IrledSensor *sensor, int *bpm, int *confidence_pct)
+{
+  if (!sensor || !bpm) {
+    return STATUS_CODE_INVALID_ARGS;
   }
-  else {
-    pthread_mutex_unlock(&s_buffer_mutex);
+
+  *bpm = atomic_load(&sensor->bpm);
+  if (confidence_pct) {
+    *confidence_pct = atomic_load(&sensor->confidence_pct);
+  }
+
+  if (*bpm == 0) {
+    return STATUS_CODE_FAILED;
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode irled_dev_get_spo2(IrledSensor *sensor, float *spo2_pct)
+{
+  if (!sensor || !spo2_pct) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  int spo2_x10 = atomic_load(&sensor->spo2_x10);
+  *spo2_pct = (float)spo2_x10 / 10.0f;
+
+  if (spo2_x10 == 0) {
     return STATUS_CODE_FAILED;
   }
 
-  pthread_mutex_unlock(&s_buffer_mutex);
   return STATUS_CODE_OK;
 }
 
-static uint16_t irled_pop_multiple(Max30102Sample *out, uint16_t max_n)
+StatusCode irled_dev_get_fifo_stats(IrledSensor *sensor, IrledFifoStats *stats, int reset)
 {
-  pthread_mutex_lock(&s_buffer_mutex);
+  if (!sensor || !stats) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
 
-  while (atomic_load(&is_thread_running) && irled_buffer_count_unsafe() == 0) {
-    pthread_cond_wait(&s_buffer_cv, &s_buffer_mutex);
+  if (!sensor->initialized) {
+    return STATUS_CODE_NOT_INITIALIZED;
   }
 
-  uint16_t n = 0;
-  while (n < max_n && s_head != s_tail) {
-    out[n] = s_buffer[s_tail];
-    s_tail = (s_tail + 1) % MAX30102_BUFFER_SIZE;
-    n++;
+  pthread_mutex_lock(&sensor->mutex);
+  *stats = sensor->stats;
+  if (reset) {
+    // the rates are state rather than counters
+    memset(&sensor->stats, 0, sizeof(sensor->stats));
+    sensor->stats.expected_rate_hz = stats->expected_rate_hz;
+    sensor->stats.measured_rate_hz = stats->measured_rate_hz;
+    sensor->stats.wake_interval_us = stats->wake_interval_us;
   }
+  pthread_mutex_unlock(&sensor->mutex);
+
+  stats->pop_dropped = spsc_ring_get_dropped(&sensor->sample_ring, reset);
+  stats->dsp_dropped = spsc_ring_get_dropped(&sensor->hr_ring, reset);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode irled_dev_get_presence(IrledSensor *sensor, bool *present)
+{
+  if (!sensor || !present) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  *present = atomic_load(&sensor->present);
+  return STATUS_CODE_OK;
+}
+
+StatusCode irled_dev_pop_presence_event(IrledSensor *sensor, IrledPresenceEvent *event,
+                                        int timeout_ms)
+{
+  if (!sensor || !event) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  if (spsc_ring_pop_wait(&sensor->presence_ring, event, 1, timeout_ms) == 0) {
+    return STATUS_CODE_TIMEOUT;
+  }
+
+  return STATUS_CODE_OK;
+}
+
+// ================================
+// Default sensor
+// ================================
+IrledSensor *irled_get_default()
+{
+  return &s_default;
+}
+
+StatusCode irled_init()
+{
+  return irled_dev_init(&s_default, I2C_BUS_2, INT_PIN_1);
+}
+
+StatusCode irled_set_config(const IrledConfig *config)
+{
+  return irled_dev_set_config(&s_default, config);
+}
+
+StatusCode irled_get_config(IrledConfig *config)
+{
+  return irled_dev_get_config(&s_default, config);
+}
+
+StatusCode irled_deinit()
+{
+  return irled_dev_deinit(&s_default);
+}
 
-  pthread_mutex_unlock(&s_buffer_mutex);
-  return n;
-}
\ No newline at end of file
+StatusCode irled_start_reading()
+{
+  return irled_dev_start_reading(&s_default);
+}
+
+StatusCode irled_stop_reading(void)
+{
+  return irled_dev_stop_reading(&s_default);
+}
+
+StatusCode irled_pop_sample(Max30102Sample *sample)
+{
+  if (!sample) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  IrledTimedSample timed;
+  if (spsc_ring_pop(&s_default.sample_ring, &timed, 1) == 0) {
+    return STATUS_CODE_FAILED;
+  }
+
+  *sample = timed.sample;
+  return STATUS_CODE_OK;
+}
+
+int irled_pop_samples(Max30102Sample *out, uint16_t max_n, int timeout_ms)
+{
+  if (!out) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  // the ring holds timestamped samples, strip them a block at a time
+  IrledTimedSample timed[64];
+  int total = 0;
+
+  while (total < max_n) {
+    uint16_t want = max_n - total;
+    if (want > 64) {
+      want = 64;
+    }
+
+    uint32_t n = spsc_ring_pop_wait(&s_default.sample_ring, timed, want,
+                                    (total == 0) ? timeout_ms : 0);
+    for (uint32_t i = 0; i < n; i++) {
+      out[total + i] = timed[i].sample;
+    }
+    total += (int)n;
+
+    if (n < want) {
+      break;
+    }
+  }
+
+  return total;
+}
+
+StatusCode irled_get_bpm(int *bpm, int *confidence_pct)
+{
+  return irled_dev_get_bpm(&s_default, bpm, confidence_pct);
+}
+
+StatusCode irled_get_spo2(float *spo2_pct)
+{
+  return irled_dev_get_spo2(&s_default, spo2_pct);
+}
+
+StatusCode irled_get_fifo_stats(IrledFifoStats *stats, int reset)
+{
+  return irled_dev_get_fifo_stats(&s_default, stats, reset);
+}
+
+StatusCode irled_get_presence(bool *present)
+{
+  return irled_dev_get_presence(&s_default, present);
+}
+
+StatusCode irled_pop_presence_event(IrledPresenceEvent *event, int timeout_ms)
+{
+  return irled_dev_pop_presence_event(&s_default, event, timeout_ms);
+}
@@ -0,0 +1,335 @@
+#include "ppg_dsp.h"
+
+#include <math.h>
+#include <string.h>
+
+#define PPG_Q(x) ((int32_t)lrintf((x) * (float)(1 << PPG_COEFF_SHIFT)))
+
+static void ppg_biquad_init_bandpass(PpgBiquad *bq, uint32_t fs_hz);
+static void ppg_channel_reset(PpgChannel *ch);
+static inline int32_t ppg_channel_step(PpgChannel *ch, uint32_t x);
+static void ppg_on_beat(PpgDsp *dsp, int32_t peak);
+static void ppg_update_bpm(PpgDsp *dsp);
+
+static void ppg_biquad_init_bandpass(PpgBiquad *bq, uint32_t fs_hz)
+{
+  // RBJ band-pass with 0 dB peak gain, centred geometrically between the edges
+  float f0 = sqrtf(PPG_BAND_LOW_HZ * PPG_BAND_HIGH_HZ);
+  float bw_oct = log2f(PPG_BAND_HIGH_HZ / PPG_BAND_LOW_HZ);
+  float w0 = 2.0f * (float)M_PI * f0 / (float)fs_hz;
+  float alpha = sinf(w0) * sinhf(logf(2.0f) / 2.0f * bw_oct * w0 / sinf(w0));
+  float a0 = 1.0f + alpha;
+
+  bq->b0 = PPG_Q(alpha / a0);
+  bq->b1 = 0;
+  bq->b2 = PPG_Q(-alpha / a0);
+  bq->a1 = PPG_Q(-2.0f * cosf(w0) / a0);
+  bq->a2 = PPG_Q((1.0f - alpha) / a0);
+}
+
+static void ppg_channel_reset(PpgChannel *ch)
+{
+  ch->dc_q8 = 0;
+  ch->bp.x1 = ch->bp.x2 = ch->bp.y1 = ch->bp.y2 = 0;
+  ch->beat_max = INT32_MIN;
+  ch->beat_min = INT32_MAX;
+}
+
+/* DC removal followed by the band-pass, returns the AC component in 1/16 counts */
+static inline int32_t ppg_channel_step(PpgChannel *ch, uint32_t x)
+{
+  if (ch->dc_q8 == 0) {
+    ch->dc_q8 = (int32_t)(x << 8);
+  }
+  ch->dc_q8 += ((int32_t)(x << 8) - ch->dc_q8) >> PPG_DC_SHIFT;
+
+  int32_t ac = (int32_t)(x << 4) - (ch->dc_q8 >> 4);
+
+  PpgBiquad *bq = &ch->bp;
+  int64_t acc = (int64_t)bq->b0 * ac + (int64_t)bq->b1 * bq->x1
+                + (int64_t)bq->b2 * bq->x2 - (int64_t)bq->a1 * bq->y1
+                - (int64_t)bq->a2 * bq->y2;
+  int32_t y = (int32_t)(acc >> PPG_COEFF_SHIFT);
+
+  bq->x2 = bq->x1;
+  bq->x1 = ac;
+  bq->y2 = bq->y1;
+  bq->y1 = y;
+
+  if (y > ch->beat_max) {
+    ch->beat_max = y;
+  }
+  if (y < ch->beat_min) {
+    ch->beat_min = y;
+  }
+
+  return y;
+}
+
+static void ppg_update_bpm(PpgDsp *dsp)
+{
+  if (dsp->ibi_count < 2) {
+    return;
+  }
+
+  uint32_t sorted[PPG_IBI_HISTORY];
+  uint8_t n = dsp->ibi_count;
+  memcpy(sorted, dsp->ibi, sizeof(sorted));
+
+  for (uint8_t i = 1; i < n; i++) {
+    uint32_t v = sorted[i];
+    int8_t j = (int8_t)i - 1;
+    while ((j >= 0) && (sorted[j] > v)) {
+      sorted[j + 1] = sorted[j];
+      j--;
+    }
+    sorted[j + 1] = v;
+  }
+
+  uint32_t median = sorted[n / 2];
+  uint32_t dev = 0;
+  uint32_t sum = 0;
+  uint32_t used = 0;
+  for (uint8_t i = 0; i < n; i++) {
+    uint32_t d = (sorted[i] > median) ? (sorted[i] - median) : (median - sorted[i]);
+    dev += d;
+    // average the intervals near the median for sub-sample resolution
+    if (4 * d <= median) {
+      sum += sorted[i];
+      used++;
+    }
+  }
+
+  // mean absolute deviation relative to the median, scaled by how full the history is
+  int32_t conf = 100 - (int32_t)((200U * dev) / (n * median));
+  if (conf < 0) {
+    conf = 0;
+  }
+  conf = conf * n / PPG_IBI_HISTORY;
+
+  dsp->bpm = (int32_t)((60U * dsp->fs_hz * used + sum / 2) / sum);
+  dsp->confidence_pct = conf;
+}
+
+static void ppg_on_beat(PpgDsp *dsp, int32_t peak)
+{
+  // the peak was the previous sample, since_peak already counts the current one
+  if (dsp->since_peak <= dsp->max_ibi) {
+    dsp->ibi[dsp->ibi_head] = dsp->since_peak - 1;
+    dsp->ibi_head = (dsp->ibi_head + 1) % PPG_IBI_HISTORY;
+    if (dsp->ibi_count < PPG_IBI_HISTORY) {
+      dsp->ibi_count++;
+    }
+    ppg_update_bpm(dsp);
+  }
+
+  dsp->peak_avg += (peak - dsp->peak_avg) >> 2;
+  dsp->threshold = dsp->peak_avg >> 1;
+  dsp->since_peak = 1;
+
+  // ratio of ratios over the beat that just finished
+  int64_t ac_ir = dsp->ir.beat_max - dsp->ir.beat_min;
+  int64_t ac_red = dsp->red.beat_max - dsp->red.beat_min;
+  int64_t dc_ir = dsp->ir.dc_q8 >> 8;
+  int64_t dc_red = dsp->red.dc_q8 >> 8;
+
+  if ((ac_ir > 0) && (ac_red > 0) && (dc_red > 0)) {
+    int64_t r_q10 = ((ac_red * dc_ir) << 10) / (ac_ir * dc_red);
+    int32_t spo2_x10 = (int32_t)(1100 - ((250 * r_q10) >> 10));
+
+    if ((spo2_x10 >= 700) && (spo2_x10 <= 1000)) {
+      if (dsp->spo2_x10 == 0) {
+        dsp->spo2_x10 = spo2_x10;
+      }
+      dsp->spo2_x10 += (spo2_x10 - dsp->spo2_x10) / 4;
+    }
+  }
+
+  dsp->ir.beat_max = dsp->red.beat_max = INT32_MIN;
+  dsp->ir.beat_min = dsp->red.beat_min = INT32_MAX;
+}
+
+StatusCode ppg_dsp_init(PpgDsp *dsp, uint32_t fs_hz)
+{
+  if (!dsp || (fs_hz < 2 * (uint32_t)PPG_BAND_HIGH_HZ + 1)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  memset(dsp, 0, sizeof(*dsp));
+  dsp->fs_hz = fs_hz;
+  dsp->refractory = (60U * fs_hz) / PPG_MAX_BPM;
+  dsp->max_ibi = (60U * fs_hz) / PPG_MIN_BPM;
+
+  ppg_biquad_init_bandpass(&dsp->ir.bp, fs_hz);
+  ppg_biquad_init_bandpass(&dsp->red.bp, fs_hz);
+
+  ppg_dsp_reset(dsp);
+  return STATUS_CODE_OK;
+}
+
+void ppg_dsp_reset(PpgDsp *dsp)
+{
+  ppg_channel_reset(&dsp->ir);
+  ppg_channel_reset(&dsp->red);
+
+  dsp->prev = 0;
+  dsp->rising = false;
+  dsp->threshold = 0;
+  dsp->peak_avg = 0;
+  dsp->since_peak = dsp->max_ibi + 1;
+  dsp->ibi_head = 0;
+  dsp->ibi_count = 0;
+  dsp->bpm = 0;
+  dsp->confidence_pct = 0;
+  dsp->spo2_x10 = 0;
+}
+
+void ppg_dsp_process(PpgDsp *dsp, const uint32_t *ir, const uint32_t *red,
+                     uint32_t stride, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t x_ir = ir[i * stride];
+    uint32_t x_red = red[i * stride];
+
+    if (x_ir < PPG_MIN_DC_COUNTS) {
+      if (dsp->ir.dc_q8 != 0) {
+        ppg_dsp_reset(dsp);
+      }
+      continue;
+    }
+
+    // systole reduces the reflected light, so beats are peaks of the inverted signal
+    int32_t s = -ppg_channel_step(&dsp->ir, x_ir);
+    ppg_channel_step(&dsp->red, x_red);
+
+    if (dsp->since_peak <= dsp->max_ibi) {
+      dsp->since_peak++;
+    }
+    else {
+      // lost the rhythm, start the history over and drop the estimate it gave
+      dsp->ibi_count = 0;
+      dsp->peak_avg = 0;
+      dsp->bpm = 0;
+      dsp->confidence_pct = 0;
+    }
+
+    dsp->threshold -= dsp->threshold >> 7;
+
+    if (s > dsp->prev) {
+      dsp->rising = true;
+    }
+    else if (dsp->rising && (s < dsp->prev)) {
+      dsp->rising = false;
+      if ((dsp->prev > dsp->threshold) && (dsp->prev > 0)
+          && (dsp->since_peak > dsp->refractory)) {
+        ppg_on_beat(dsp, dsp->prev);
+      }
+    }
+
+    dsp->prev = s;
+  }
+}
+
+// ================================
+// Decimation
+// ================================
+StatusCode ppg_decim_init(PpgDecimator *dec, uint8_t factor)
+{
+  if (!dec || (factor == 0) || (factor > PPG_DECIM_MAX_FACTOR)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  memset(dec, 0, sizeof(*dec));
+  dec->factor = factor;
+  dec->taps = (uint16_t)factor * PPG_DECIM_TAPS_PER_PHASE;
+
+  // Hamming windowed sinc, cutoff in cycles per input sample
+  float fc = PPG_DECIM_PASSBAND * 0.5f / (float)factor;
+  float mid = (float)(dec->taps - 1) / 2.0f;
+  float h[PPG_DECIM_MAX_TAPS];
+  float sum = 0.0f;
+
+  for (uint16_t i = 0; i < dec->taps; i++) {
+    float t = (float)i - mid;
+    float sinc = (t == 0.0f) ? 1.0f : sinf(2.0f * (float)M_PI * fc * t) / (2.0f * (float)M_PI * fc * t);
+    float window = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * (float)i / (float)(dec->taps - 1));
+    h[i] = 2.0f * fc * sinc * window;
+    sum += h[i];
+  }
+
+  // unity gain at DC, the ppg dsp's finger detection works on absolute counts
+  int32_t q_sum = 0;
+  for (uint16_t i = 0; i < dec->taps; i++) {
+    dec->coeff[i] = PPG_Q(h[i] / sum);
+    q_sum += dec->coeff[i];
+  }
+  dec->coeff[dec->taps / 2] += (1 << PPG_COEFF_SHIFT) - q_sum;
+
+  ppg_decim_reset(dec);
+  return STATUS_CODE_OK;
+}
+
+void ppg_decim_reset(PpgDecimator *dec)
+{
+  dec->phase = 0;
+  dec->head = 0;
+  dec->primed = false;
+}
+
+static inline uint32_t ppg_decim_dot(const int32_t *coeff, const uint32_t *hist, uint16_t taps)
+{
+  int64_t acc = 0;
+
+  for (uint16_t i = 0; i < taps; i++) {
+    acc += (int64_t)coeff[i] * hist[i];
+  }
+
+  acc >>= PPG_COEFF_SHIFT;
+  return (acc > 0) ? (uint32_t)acc : 0;
+}
+
+uint32_t ppg_decim_process(PpgDecimator *dec, const uint32_t *ir, const uint32_t *red,
+                           uint32_t in_stride, uint32_t n, uint32_t *out_ir, uint32_t *out_red,
+                           uint32_t out_stride)
+{
+  uint32_t out = 0;
+
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t x_ir = ir[i * in_stride];
+    uint32_t x_red = red[i * in_stride];
+
+    if (dec->factor == 1) {
+      out_ir[out * out_stride] = x_ir;
+      out_red[out * out_stride] = x_red;
+      out++;
+      continue;
+    }
+
+    // start from the first level seen rather than ramping up from zero
+    if (!dec->primed) {
+      for (uint16_t k = 0; k < 2 * dec->taps; k++) {
+        dec->ir[k] = x_ir;
+        dec->red[k] = x_red;
+      }
+      dec->primed = true;
+    }
+
+    // oldest first from head, written twice so head..head + taps is always contiguous
+    dec->ir[dec->head] = dec->ir[dec->head + dec->taps] = x_ir;
+    dec->red[dec->head] = dec->red[dec->head + dec->taps] = x_red;
+    if (++dec->head == dec->taps) {
+      dec->head = 0;
+    }
+
+    if (++dec->phase < dec->factor) {
+      continue;
+    }
+    dec->phase = 0;
+
+    out_ir[out * out_stride] = ppg_decim_dot(dec->coeff, &dec->ir[dec->head], dec->taps);
+    out_red[out * out_stride] = ppg_decim_dot(dec->coeff, &dec->red[dec->head], dec->taps);
+    out++;
+  }
+
+  return out;
+}
@@ -1,84 +1,755 @@
 #include "servo.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "cm4_time.h"
+#include "mpsc_ring.h"
+
+#define SERVO_TICK_NS (1000ULL * 1000 * 1000 / SERVO_THREAD_FREQ_HZ)
+
+typedef enum {
+  SERVO_CMD_MOVE = 0, // profiled move, group_left links the axes of a group move
+  SERVO_CMD_HOLD,     // stop any move and hold the angle servo_set_angle asked for
+  SERVO_CMD_MODE,     // new update mode and phase
+  SERVO_CMD_ANIM,     // start a mapped clip, or stop the one playing when clip is NULL
+} ServoCmdType;
+
+/* A mapped animation file, played in place. Allocated by the caller of servo_play_animation,
+   owned by the motion thread once queued */
+typedef struct {
+  void *map;
+  size_t map_len;
+  const ServoAnimHeader *hdr;
+  const uint8_t *tracks;    // servo channel of each track
+  const uint8_t *keyframes;
+  size_t stride;            // bytes per keyframe
+  uint32_t duration_us;     // time of the last keyframe
+  float time_scale;
+  bool loop;
+  uint64_t start_ns;
+  uint32_t cursor;          // keyframe at or before the last time played
+} ServoClip;
+
+typedef struct {
+  uint8_t type;
+  uint8_t channel;
+  uint8_t profile;
+  uint8_t group_left; // commands after this one that belong to the same group
+  uint8_t mode;       // ServoUpdateMode of a SERVO_CMD_MODE
+  float angle;
+  float max_velocity;
+  float max_accel;
+  uint32_t phase_us;
+  float blend_s;
+  ServoClip *clip;
+} ServoCmd;
 
 static uint8_t initialized = 0;
-static Servo servo[NUM_SERVO_CHANNELS];
-static volatile bool servo_thread_running = false;
+static ServoMapEntry s_servo_map[SERVO_MAX_CHANNELS];
+static uint8_t s_num_servos = 0;
+
+// owned by the motion thread, callers only reach it through the command queue
+static Servo servo[SERVO_MAX_CHANNELS];
+static ServoUpdateMode s_update_mode = SERVO_UPDATE_FRAME;
+static uint32_t s_frame_phase_us = SERVO_FRAME_PHASE_US;
+static ServoCmd s_cmd_buf[SERVO_CMD_QUEUE_LEN]; // popped, the tail may be a group still arriving
+static uint32_t s_num_cmds = 0;
+static ServoClip *s_clip = NULL;
+static ServoClip *s_prev_clip = NULL;                // still played while s_clip fades in
+static uint64_t s_blend_ns = 0;
+static float s_blend_from[SERVO_MAX_CHANNELS];       // angles when s_clip started
+static uint32_t s_anim_owned = 0;                    // servos s_clip drives
+
+static MpscRing s_cmd_ring;
+static uint8_t s_cmd_storage[MPSC_RING_STORAGE_BYTES(sizeof(ServoCmd), SERVO_CMD_QUEUE_LEN)]
+  __attribute__((aligned(8)));
+
+// angles as of the last frame, for servo_get
+static _Atomic float s_servo_angle[SERVO_MAX_CHANNELS];
+
+// one motion thread for the life of the module, it sleeps in the queue while nothing moves
 static pthread_t servo_thread;
+static atomic_bool servo_thread_running = false;
 
-static struct timespec ts = {
-  .tv_sec = 0, .tv_nsec = SERVO_THREAD_PERIOD_S * 1000 * 1000 * 1000
-};
+static float servo_angle_to_duty(float angle)
+{
+  return ((angle / D_ANGLE) + AVERAGE_PULSE_WIDTH_MS) * SERVO_PWM_FREQ_HZ / 1000;
+}
 
-static void servo_update_all();
-static void servo_update(Servo *servo);
-static void *servo_thread_func(void *args);
+/* The off count the chip ends up with, as pwm_controller rounds it */
+static uint16_t servo_angle_to_ticks(float angle)
+{
+  return (uint16_t)(servo_angle_to_duty(angle) * PWM_RESOLUTION);
+}
 
-static void servo_update_all()
+// ================================
+// Profiles
+// ================================
+static void servo_profile_plan(ServoProfile *p, ServoProfileType type, float from, float to,
+                               float v_max, float a_max, uint64_t now)
 {
-  bool none_running = true;
-  for (uint8_t i = 0; i < NUM_SERVO_CHANNELS; i++) {
-    if (servo[i].isRunning == true) {
-      none_running = false;
-      servo_update(&servo[i]);
+  float d = fabsf(to - from);
+
+  p->type = type;
+  p->start_ns = now;
+  p->start_angle = from;
+  p->distance = to - from;
+
+  // both ramps cover v * t_ramp / 2, so a move too short to reach v_max peaks lower
+  if (type == SERVO_PROFILE_SCURVE) {
+    p->v_peak = fminf(v_max, sqrtf(2.0f * a_max * d / (float)M_PI));
+    p->t_ramp = (float)M_PI * p->v_peak / (2.0f * a_max);
+  }
+  else {
+    p->v_peak = fminf(v_max, sqrtf(a_max * d));
+    p->t_ramp = p->v_peak / a_max;
+  }
+
+  p->t_cruise = (p->v_peak > 0.0f) ? (d - p->v_peak * p->t_ramp) / p->v_peak : 0.0f;
+  if (p->t_cruise < 0.0f) {
+    p->t_cruise = 0.0f;
+  }
+}
+
+/* Distance covered tau seconds into a ramp up */
+static float servo_profile_ramp(const ServoProfile *p, float tau)
+{
+  if (p->t_ramp <= 0.0f) {
+    return 0.0f;
+  }
+
+  if (p->type == SERVO_PROFILE_SCURVE) {
+    float w = (float)M_PI / p->t_ramp;
+    return 0.5f * p->v_peak * (tau - sinf(w * tau) / w);
+  }
+
+  return 0.5f * p->v_peak * tau * tau / p->t_ramp;
+}
+
+/* Angle at time now, straight from the profile so no error builds up between ticks */
+static float servo_profile_eval(const ServoProfile *p, uint64_t now, bool *done)
+{
+  float t = (now > p->start_ns) ? (float)(now - p->start_ns) * 1e-9f : 0.0f;
+  float total = 2.0f * p->t_ramp + p->t_cruise;
+  float d = fabsf(p->distance);
+  float s;
+
+  *done = (t >= total);
+
+  if (*done) {
+    s = d;
+  }
+  else if (t < p->t_ramp) {
+    s = servo_profile_ramp(p, t);
+  }
+  else if (t < p->t_ramp + p->t_cruise) {
+    s = 0.5f * p->v_peak * p->t_ramp + p->v_peak * (t - p->t_ramp);
+  }
+  else {
+    s = d - servo_profile_ramp(p, total - t);
+  }
+
+  return p->start_angle + ((p->distance < 0.0f) ? -s : s);
+}
+
+// ================================
+// Motion thread
+// ================================
+/* Bring every running servo's angle up to now, false once all have arrived */
+static bool servo_eval_all(uint64_t now)
+{
+  bool any_running = false;
+
+  for (uint8_t i = 0; i < s_num_servos; i++) {
+    if (!servo[i].isRunning) {
+      continue;
+    }
+
+    bool done;
+    servo[i].current_angle = servo_profile_eval(&servo[i].profile, now, &done);
+    servo[i].dirty = true;
+
+    if (done) {
+      servo[i].current_angle = servo[i].target_angle;
+      servo[i].isRunning = false;
+    }
+    any_running |= servo[i].isRunning;
+    atomic_store_explicit(&s_servo_angle[i], servo[i].current_angle, memory_order_relaxed);
+  }
+
+  return any_running;
+}
+
+/* Servos whose angle has moved the chip's off count since the last commit */
+static size_t servo_collect_changed(PwmFanoutUpdate *updates, uint8_t *changed, uint16_t *ticks)
+{
+  size_t n = 0;
+
+  for (uint8_t i = 0; i < s_num_servos; i++) {
+    if (!servo[i].dirty) {
+      continue;
+    }
+
+    // at 1kHz most steps do not move the pulse by a whole count
+    uint16_t t = servo_angle_to_ticks(servo[i].current_angle);
+    if (servo[i].committed && (servo[i].committed_ticks == t)) {
+      servo[i].dirty = false;
+      continue;
+    }
+
+    updates[n] = (PwmFanoutUpdate) {
+      .pwm = s_servo_map[i].pwm,
+      .channel = s_servo_map[i].channel,
+      .delay_percentage = 0.0f,
+      .duty_cycle = servo_angle_to_duty(servo[i].current_angle),
+    };
+    changed[n] = i;
+    ticks[n++] = t;
+  }
+
+  return n;
+}
+
+static bool servo_commit_pending()
+{
+  for (uint8_t i = 0; i < s_num_servos; i++) {
+    if (servo[i].dirty) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Commit point after prev on a fixed grid, so late wake ups never shift later frames.
+   FRAME_LOCKED puts the grid at the phase offset into the first mapped chip's period */
+static uint64_t servo_next_commit_ns(uint64_t prev, uint64_t now)
+{
+  uint64_t period_ns = SERVO_TICK_NS;
+  uint64_t origin_ns = prev;
+
+  if (s_update_mode != SERVO_UPDATE_TICK) {
+    uint64_t chip_period_ns;
+    uint64_t chip_origin_ns;
+
+    if ((pwm_controller_dev_get_timing(s_servo_map[0].pwm, &chip_period_ns, &chip_origin_ns)
+         == STATUS_CODE_OK) && (chip_period_ns > 0)) {
+      period_ns = chip_period_ns;
+      if (s_update_mode == SERVO_UPDATE_FRAME_LOCKED) {
+        origin_ns = chip_origin_ns + (uint64_t)s_frame_phase_us * 1000;
+      }
     }
   }
 
-  if (none_running) {
-    servo_thread_running = false;
+  if (origin_ns > now) {
+    return origin_ns;
   }
+
+  return origin_ns + ((now - origin_ns) / period_ns + 1) * period_ns;
+}
+
+// ================================
+// Animation
+// ================================
+static uint32_t servo_clip_time_us(const ServoClip *c, uint32_t kf)
+{
+  return *(const uint32_t *)(c->keyframes + (size_t)kf * c->stride);
 }
 
-static void servo_update(Servo *servo)
+static float servo_clip_angle(const ServoClip *c, uint32_t kf, uint16_t track)
 {
+  const int16_t *angles = (const int16_t *)(c->keyframes + (size_t)kf * c->stride + 4);
+  return (float)angles[track] * 0.01f;
+}
 
-  float diff = servo->target_angle - servo->current_angle;
+static void servo_clip_unmap(ServoClip *c)
+{
+  if (c) {
+    munmap(c->map, c->map_len);
+    free(c);
+  }
+}
 
-  if ((diff < 0.1f) && (diff > -0.1f)) {
-    servo->current_angle = servo->target_angle;
-    servo->isRunning = false;
+/* Map an animation file and check all of it, which also faults the whole file in here rather
+   than page by page in the motion thread */
+static StatusCode servo_clip_load(const char *path, ServoClip **out)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open animation");
+    return STATUS_CODE_FAILED;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(ServoAnimHeader))) {
+    printf("animation %s too short\n", path);
+    close(fd);
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  size_t len = (size_t)st.st_size;
+  void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return STATUS_CODE_MEM_ACCESS_FAILURE;
+  }
+
+  ServoClip *c = calloc(1, sizeof(*c));
+  if (!c) {
+    munmap(map, len);
+    return STATUS_CODE_OUT_OF_MEMORY;
+  }
+
+  c->map = map;
+  c->map_len = len;
+  c->hdr = (const ServoAnimHeader *)map;
+  c->tracks = (const uint8_t *)map + sizeof(ServoAnimHeader);
+
+  const ServoAnimHeader *h = c->hdr;
+  size_t tracks_len = ((size_t)h->num_tracks + 3) & ~(size_t)3;
+  c->keyframes = c->tracks + tracks_len;
+  c->stride = (4 + 2 * (size_t)h->num_tracks + 3) & ~(size_t)3;
+
+  // in 64 bits, a huge keyframe count must not wrap a 32 bit size_t past the check
+  uint64_t need = (uint64_t)sizeof(ServoAnimHeader) + tracks_len
+                  + (uint64_t)h->num_keyframes * c->stride;
+
+  if ((h->magic != SERVO_ANIM_MAGIC) || (h->version != SERVO_ANIM_VERSION)
+      || (h->num_tracks == 0) || (h->num_tracks > SERVO_MAX_CHANNELS) || (h->num_keyframes == 0)
+      || ((uint64_t)len < need)) {
+    printf("animation %s is not a valid version %d keyframe file\n", path, SERVO_ANIM_VERSION);
+    servo_clip_unmap(c);
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  for (uint16_t k = 0; k < h->num_tracks; k++) {
+    if (c->tracks[k] >= s_num_servos) {
+      printf("animation %s drives servo %d, only %d mapped\n", path, c->tracks[k], s_num_servos);
+      servo_clip_unmap(c);
+      return STATUS_CODE_INVALID_ARGS;
+    }
+  }
+
+  for (uint32_t kf = 0; kf < h->num_keyframes; kf++) {
+    if ((kf > 0) && (servo_clip_time_us(c, kf) < servo_clip_time_us(c, kf - 1))) {
+      printf("animation %s keyframe %u goes back in time\n", path, kf);
+      servo_clip_unmap(c);
+      return STATUS_CODE_INVALID_ARGS;
+    }
+
+    for (uint16_t k = 0; k < h->num_tracks; k++) {
+      float angle = servo_clip_angle(c, kf, k);
+      if ((angle < MIN_ANGLE_DEGREES) || (angle > MAX_ANGLE_DEGREES)) {
+        printf("animation %s keyframe %u angle %f out of range\n", path, kf, angle);
+        servo_clip_unmap(c);
+        return STATUS_CODE_INVALID_ARGS;
+      }
+    }
+  }
+
+  c->duration_us = servo_clip_time_us(c, h->num_keyframes - 1);
+  madvise(map, len, MADV_WILLNEED);
+
+  *out = c;
+  return STATUS_CODE_OK;
+}
+
+/* Find the keyframe pair around now, false once a clip that does not loop is past its end */
+static bool servo_clip_locate(ServoClip *c, uint64_t now, uint32_t *kf, float *frac)
+{
+  uint32_t n = c->hdr->num_keyframes;
+  double t = (double)(now - c->start_ns) * 1e-3 * c->time_scale;
+  bool playing = true;
+
+  if (c->loop && (c->duration_us > 0)) {
+    t = fmod(t, (double)c->duration_us);
+  }
+  else if (t >= (double)c->duration_us) {
+    t = (double)c->duration_us;
+    playing = c->loop;
+  }
+
+  // playback only moves forward, so the search resumes from the last keyframe until a loop wraps
+  if (servo_clip_time_us(c, c->cursor) > t) {
+    c->cursor = 0;
+  }
+  while ((c->cursor + 1 < n) && (servo_clip_time_us(c, c->cursor + 1) <= t)) {
+    c->cursor++;
+  }
+
+  *kf = c->cursor;
+  *frac = 0.0f;
+  if (c->cursor + 1 < n) {
+    double t0 = servo_clip_time_us(c, c->cursor);
+    double t1 = servo_clip_time_us(c, c->cursor + 1);
+    if (t >= t0) {
+      *frac = (float)((t - t0) / (t1 - t0));
+    }
+  }
+
+  return playing;
+}
+
+static float servo_clip_lerp(const ServoClip *c, uint32_t kf, float frac, uint16_t track)
+{
+  float a = servo_clip_angle(c, kf, track);
+
+  if (frac <= 0.0f) {
+    return a;
+  }
+
+  return a + (servo_clip_angle(c, kf + 1, track) - a) * frac;
+}
+
+static void servo_anim_start(ServoClip *clip, float blend_s, uint64_t now)
+{
+  // a clip arriving mid crossfade cuts the oldest one, the new fade starts from where it got to
+  servo_clip_unmap(s_prev_clip);
+  s_prev_clip = NULL;
+
+  if (clip && s_clip && (blend_s > 0.0f)) {
+    s_prev_clip = s_clip;
   }
   else {
-    servo_set_angle(servo->channel, servo->current_angle + servo->step);
+    servo_clip_unmap(s_clip);
+  }
+
+  s_clip = clip;
+  s_anim_owned = 0;
+  if (!clip) {
+    return;
+  }
+
+  clip->start_ns = now;
+  s_blend_ns = (uint64_t)(blend_s * 1e9f);
+
+  for (uint16_t k = 0; k < clip->hdr->num_tracks; k++) {
+    uint8_t ch = clip->tracks[k];
+    s_blend_from[ch] = servo[ch].current_angle;
+    servo[ch].isRunning = false;
+    s_anim_owned |= 1U << ch;
+  }
+}
+
+/* Put the animation's angles for time now on the servos it drives, false when none plays */
+static bool servo_anim_eval(uint64_t now)
+{
+  if (!s_clip) {
+    return false;
+  }
+
+  uint32_t kf, prev_kf = 0;
+  float frac, prev_frac = 0.0f;
+  bool playing = servo_clip_locate(s_clip, now, &kf, &frac);
+  float w = 1.0f;
+
+  if ((s_blend_ns > 0) && (now - s_clip->start_ns < s_blend_ns)) {
+    w = (float)(now - s_clip->start_ns) / (float)s_blend_ns;
+  }
+  if (s_prev_clip) {
+    servo_clip_locate(s_prev_clip, now, &prev_kf, &prev_frac);
+  }
+
+  for (uint16_t k = 0; k < s_clip->hdr->num_tracks; k++) {
+    uint8_t ch = s_clip->tracks[k];
+    if (!(s_anim_owned & (1U << ch))) {
+      continue;
+    }
+
+    float angle = servo_clip_lerp(s_clip, kf, frac, k);
+
+    if (w < 1.0f) {
+      float from = s_blend_from[ch];
+      for (uint16_t j = 0; s_prev_clip && (j < s_prev_clip->hdr->num_tracks); j++) {
+        if (s_prev_clip->tracks[j] == ch) {
+          from = servo_clip_lerp(s_prev_clip, prev_kf, prev_frac, j);
+          break;
+        }
+      }
+      angle = from + (angle - from) * w;
+    }
+
+    servo[ch].current_angle = angle;
+    servo[ch].target_angle = angle;
+    servo[ch].dirty = true;
+    atomic_store_explicit(&s_servo_angle[ch], angle, memory_order_relaxed);
+  }
+
+  if (w >= 1.0f) {
+    servo_clip_unmap(s_prev_clip);
+    s_prev_clip = NULL;
+  }
+
+  if (!playing || (s_anim_owned == 0)) {
+    // the servos hold the last keyframe
+    servo_anim_start(NULL, 0.0f, now);
+  }
+
+  return s_clip != NULL;
+}
+
+// ================================
+// Commands
+// ================================
+/* Start moves for a group of axes so all of them arrive together. The axis with the furthest
+   to go runs at the limits, the others get velocity and acceleration scaled by their share of
+   that distance, which gives every axis the same ramp and cruise times */
+static void servo_apply_group(const ServoCmd *cmds, uint32_t n, uint64_t now)
+{
+  float d_max = 0.0f;
+
+  for (uint32_t i = 0; i < n; i++) {
+    Servo *s = &servo[cmds[i].channel];
+    float d = fabsf(cmds[i].angle - s->current_angle);
+    d_max = fmaxf(d_max, d);
+  }
+
+  for (uint32_t i = 0; i < n; i++) {
+    Servo *s = &servo[cmds[i].channel];
+    float d = fabsf(cmds[i].angle - s->current_angle);
+
+    s_anim_owned &= ~(1U << cmds[i].channel);
+    s->target_angle = cmds[i].angle;
+    if ((d == 0.0f) || (d_max == 0.0f)) {
+      s->isRunning = false;
+      continue;
+    }
+
+    float share = d / d_max;
+    servo_profile_plan(&s->profile, (ServoProfileType)cmds[i].profile, s->current_angle,
+                       cmds[i].angle, cmds[i].max_velocity * share, cmds[i].max_accel * share,
+                       now);
+    s->isRunning = true;
+  }
+}
+
+static void servo_apply_cmd(const ServoCmd *cmd, uint64_t now)
+{
+  Servo *s = &servo[cmd->channel];
+
+  switch (cmd->type) {
+    case SERVO_CMD_HOLD:
+      // written at the next commit, in frame locked mode inside the commit phase
+      s_anim_owned &= ~(1U << cmd->channel);
+      s->isRunning = false;
+      s->current_angle = cmd->angle;
+      s->target_angle = cmd->angle;
+      s->dirty = true;
+      s->committed = false;
+      atomic_store_explicit(&s_servo_angle[cmd->channel], cmd->angle, memory_order_relaxed);
+      break;
+    case SERVO_CMD_MODE:
+      s_update_mode = (ServoUpdateMode)cmd->mode;
+      s_frame_phase_us = cmd->phase_us;
+      break;
+    case SERVO_CMD_ANIM:
+      servo_anim_start(cmd->clip, cmd->blend_s, now);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Apply every complete group popped so far at time now. Producers publish a group as one
+   run, but the thread may pop while the last slots are still being filled, so a partial
+   group waits in s_cmd_buf for the next frame */
+static void servo_apply_cmds(uint64_t now)
+{
+  uint32_t i = 0;
+
+  // moves start from where the servos are now
+  servo_eval_all(now);
+
+  while (i < s_num_cmds) {
+    uint32_t len = (uint32_t)s_cmd_buf[i].group_left + 1;
+    if (i + len > s_num_cmds) {
+      break;
+    }
+
+    if (s_cmd_buf[i].type == SERVO_CMD_MOVE) {
+      servo_apply_group(&s_cmd_buf[i], len, now);
+    }
+    else {
+      servo_apply_cmd(&s_cmd_buf[i], now);
+    }
+    i += len;
+  }
+
+  s_num_cmds -= i;
+  memmove(s_cmd_buf, &s_cmd_buf[i], s_num_cmds * sizeof(s_cmd_buf[0]));
+}
+
+static StatusCode servo_push(const ServoCmd *cmds, uint32_t n)
+{
+  if (mpsc_ring_push(&s_cmd_ring, cmds, n) != n) {
+    printf("servo command queue full, %u commands dropped\n", n);
+    return STATUS_CODE_FAILED;
   }
+
+  return STATUS_CODE_OK;
 }
 
+// ================================
+// Motion thread
+// ================================
 static void *servo_thread_func(void *args)
 {
   (void)args;
 
-  while (servo_thread_running) {
-    servo_update_all();
-    nanosleep(&ts, NULL);
+  PwmFanoutUpdate updates[SERVO_MAX_CHANNELS];
+  uint8_t changed[SERVO_MAX_CHANNELS];
+  uint16_t ticks[SERVO_MAX_CHANNELS];
+  bool active = false;
+  uint64_t deadline = 0;
+
+  while (atomic_load(&servo_thread_running)) {
+    // with nothing to move sleep until a command arrives, otherwise take what is queued
+    s_num_cmds += mpsc_ring_pop_wait(&s_cmd_ring, &s_cmd_buf[s_num_cmds],
+                                     SERVO_CMD_QUEUE_LEN - s_num_cmds, active ? 0 : -1);
+    if (!active) {
+      // the first frame after idling goes out straight away
+      deadline = time_now_ns();
+    }
+
+    servo_apply_cmds(deadline);
+    bool any_running = servo_eval_all(deadline);
+    bool animating = servo_anim_eval(deadline);
+    size_t n = servo_collect_changed(updates, changed, ticks);
+
+    // a failed commit stays dirty and is retried next frame
+    if ((n > 0) && (pwm_controller_set_fanout(updates, n) == STATUS_CODE_OK)) {
+      for (size_t i = 0; i < n; i++) {
+        servo[changed[i]].committed_ticks = ticks[i];
+        servo[changed[i]].committed = true;
+        servo[changed[i]].dirty = false;
+      }
+    }
+
+    active = any_running || animating || servo_commit_pending() || (s_num_cmds > 0);
+    if (!active) {
+      continue;
+    }
+
+    // absolute wake ups, processing time does not stretch the period
+    deadline = servo_next_commit_ns(deadline, time_now_ns());
+    struct timespec until = {
+      .tv_sec = (time_t)(deadline / 1000000000ULL),
+      .tv_nsec = (long)(deadline % 1000000000ULL),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+    }
   }
 
   return NULL;
 }
 
+// ================================
+// Public
+// ================================
 StatusCode servo_init()
 {
+  ServoMapEntry map[NUM_SERVO_CHANNELS];
 
+  for (uint8_t i = 0; i < NUM_SERVO_CHANNELS; i++) {
+    map[i].pwm = pwm_controller_get_default();
+    map[i].channel = SERVO_CHANNEL_TO_PWM_CHANNEL(i);
+  }
+
+  return servo_init_map(map, NUM_SERVO_CHANNELS);
+}
+
+StatusCode servo_init_map(const ServoMapEntry *map, size_t n)
+{
   if (initialized == 1) {
     return STATUS_CODE_ALREADY_INITIALIZED;
   }
 
-  StatusCode ret = pwm_controller_get_initialized();
+  if (!map || (n == 0) || (n > SERVO_MAX_CHANNELS)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
 
-  if (ret != STATUS_CODE_OK) {
-    printf("pwm controller not initialized\n");
-    return ret;
+  // checked up front, the fan-out would reject a bad map on every frame and no servo would move
+  PwmController *devs[PWM_FANOUT_MAX_DEVS];
+  size_t num_devs = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    if (!map[i].pwm || !PCA_CHANNEL_VALID(map[i].channel)) {
+      printf("servo %zu has no valid pwm channel\n", i);
+      return STATUS_CODE_INVALID_ARGS;
+    }
+
+    for (size_t j = 0; j < i; j++) {
+      if ((map[j].pwm == map[i].pwm) && (map[j].channel == map[i].channel)) {
+        printf("servos %zu and %zu share pwm channel %d\n", j, i, map[i].channel);
+        return STATUS_CODE_INVALID_ARGS;
+      }
+    }
+
+    size_t d = 0;
+    while ((d < num_devs) && (devs[d] != map[i].pwm)) {
+      d++;
+    }
+    if (d == num_devs) {
+      if (num_devs == PWM_FANOUT_MAX_DEVS) {
+        printf("servo map spans more than %d pwm controllers\n", PWM_FANOUT_MAX_DEVS);
+        return STATUS_CODE_INVALID_ARGS;
+      }
+      devs[num_devs++] = map[i].pwm;
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    StatusCode ret = pwm_controller_dev_get_initialized(map[i].pwm);
+    if (ret != STATUS_CODE_OK) {
+      printf("pwm controller not initialized\n");
+      return ret;
+    }
+
+    // servos need a 50Hz frame, a board shared with LEDs may be running faster
+    if (map[i].pwm->pwm_freq != SERVO_PWM_FREQ_HZ) {
+      ret = pwm_controller_dev_init(map[i].pwm, map[i].pwm->bus, map[i].pwm->addr,
+                                    SERVO_PWM_FREQ_HZ);
+      if (ret != STATUS_CODE_OK) {
+        return ret;
+      }
+    }
   }
 
-  ret = pwm_controller_init(SERVO_PWM_FREQ_HZ);
-  if ((ret != STATUS_CODE_ALREADY_INITIALIZED) && (ret != STATUS_CODE_OK)) {
-    return ret;
+  TRY(mpsc_ring_init(&s_cmd_ring, s_cmd_storage, sizeof(ServoCmd), SERVO_CMD_QUEUE_LEN));
+  s_num_cmds = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    s_servo_map[i] = map[i];
+    servo[i].channel = (ServoChannel)i;
+    servo[i].isRunning = false;
+    servo[i].dirty = false;
+    servo[i].committed = false;
+    atomic_store(&s_servo_angle[i], servo[i].current_angle);
+  }
+  s_num_servos = (uint8_t)n;
+
+  atomic_store(&servo_thread_running, true);
+  if (pthread_create(&servo_thread, NULL, servo_thread_func, NULL) != 0) {
+    atomic_store(&servo_thread_running, false);
+    return STATUS_CODE_THREAD_FAILURE;
   }
 
   initialized = 1;
-  return ret;
+  return STATUS_CODE_OK;
 }
 
 StatusCode servo_deinit()
@@ -87,16 +758,41 @@ StatusCode servo_deinit()
     return STATUS_CODE_OK;
   }
 
-  if (servo_thread_running) {
-    servo_thread_running = false;
-    pthread_join(servo_thread, NULL);
+  atomic_store(&servo_thread_running, false);
+  mpsc_ring_wake(&s_cmd_ring);
+  pthread_join(servo_thread, NULL);
+
+  // clips still queued or playing belong to the thread, release them now it is gone
+  s_num_cmds += mpsc_ring_pop(&s_cmd_ring, &s_cmd_buf[s_num_cmds], SERVO_CMD_QUEUE_LEN - s_num_cmds);
+  for (uint32_t i = 0; i < s_num_cmds; i++) {
+    if (s_cmd_buf[i].type == SERVO_CMD_ANIM) {
+      servo_clip_unmap(s_cmd_buf[i].clip);
+    }
   }
+  s_num_cmds = 0;
+  servo_anim_start(NULL, 0.0f, 0);
 
   initialized = 0;
 
   return STATUS_CODE_OK;
 }
 
+StatusCode servo_set_update_mode(ServoUpdateMode mode, uint32_t phase_us)
+{
+  if (initialized == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  if ((mode < SERVO_UPDATE_TICK) || (mode > SERVO_UPDATE_FRAME_LOCKED)
+      || (phase_us >= 1000000 / SERVO_PWM_FREQ_HZ)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  ServoCmd cmd = {.type = SERVO_CMD_MODE, .mode = (uint8_t)mode, .phase_us = phase_us};
+
+  return servo_push(&cmd, 1);
+}
+
 StatusCode servo_set_angle(ServoChannel channel, float angle)
 {
   printf("servo %d setting angle %f\n", channel, angle);
@@ -104,72 +800,162 @@ StatusCode servo_set_angle(ServoChannel channel, float angle)
     return STATUS_CODE_NOT_INITIALIZED;
   }
 
-  if ((angle < MIN_ANGLE_DEGREES) || (angle > MAX_ANGLE_DEGREES)
-      || (channel >= NUM_SERVO_CHANNELS)) {
+  if ((angle < MIN_ANGLE_DEGREES) || (angle > MAX_ANGLE_DEGREES) || (channel < 0)
+      || (channel >= s_num_servos)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  int pcaChannel = SERVO_CHANNEL_TO_PWM_CHANNEL(channel);
-  if (pcaChannel == INVALID_PCA_CHANNEL) {
+  // the motion thread stops any move on this servo and writes the angle at its next commit
+  ServoCmd cmd = {.type = SERVO_CMD_HOLD, .channel = (uint8_t)channel, .angle = angle};
+  TRY(servo_push(&cmd, 1));
+
+  printf("servo %d set angle %f pca channel %d\n", channel, angle, s_servo_map[channel].channel);
+  return STATUS_CODE_OK;
+}
+
+StatusCode servo_get(ServoChannel channel, float *angle)
+{
+  if ((channel < 0) || (channel >= s_num_servos) || !angle) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  float duty_cycle = ((angle / D_ANGLE) + AVERAGE_PULSE_WIDTH_MS) * SERVO_PWM_FREQ_HZ / 1000;
+  *angle = atomic_load_explicit(&s_servo_angle[channel], memory_order_relaxed);
+  return STATUS_CODE_OK;
+}
 
-  StatusCode ret = pwm_controller_set_channel(pcaChannel, 0.0f, duty_cycle);
+static bool servo_move_valid(ServoChannel channel, float angle, ServoProfileType type,
+                             float max_velocity, float max_accel)
+{
+  return (channel >= 0) && (channel < s_num_servos) && (angle >= MIN_ANGLE_DEGREES)
+         && (angle <= MAX_ANGLE_DEGREES) && (max_velocity > 0) && (max_accel > 0)
+         && ((type == SERVO_PROFILE_TRAPEZOID) || (type == SERVO_PROFILE_SCURVE));
+}
 
-  if (ret == STATUS_CODE_OK) {
-    servo[channel].current_angle = angle;
+static ServoCmd servo_move_cmd(ServoChannel channel, float angle, ServoProfileType type,
+                               float max_velocity, float max_accel)
+{
+  return (ServoCmd) {
+    .type = SERVO_CMD_MOVE,
+    .channel = (uint8_t)channel,
+    .profile = (uint8_t)type,
+    .angle = angle,
+    .max_velocity = fminf(max_velocity, SERVO_MAX_SPEED_DEG_S),
+    .max_accel = fminf(max_accel, SERVO_MAX_ACCEL_DEG_S2),
+  };
+}
+
+StatusCode servo_move_profile(ServoChannel channel, float angle, ServoProfileType type,
+                              float max_velocity, float max_accel)
+{
+  if (initialized == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
   }
-  else {
-    return STATUS_CODE_FAILED;
+
+  if (!servo_move_valid(channel, angle, type, max_velocity, max_accel)) {
+    return STATUS_CODE_INVALID_ARGS;
   }
 
-  printf("servo %d set angle %f duty cycle %f pca channel %d\n", channel, angle, duty_cycle, pcaChannel);
-  return ret;
+  ServoCmd cmd = servo_move_cmd(channel, angle, type, max_velocity, max_accel);
+
+  return servo_push(&cmd, 1);
 }
 
-StatusCode servo_get(ServoChannel channel, float *angle)
+StatusCode servo_move_group(const ServoGroupTarget *targets, size_t n, ServoProfileType type,
+                            float max_velocity, float max_accel)
 {
-  if (channel >= NUM_SERVO_CHANNELS) {
+  if (initialized == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  if (!targets || (n == 0) || (n > SERVO_MAX_CHANNELS)) {
     return STATUS_CODE_INVALID_ARGS;
   }
 
-  *angle = servo[channel].current_angle;
-  return STATUS_CODE_OK;
+  ServoCmd cmds[SERVO_MAX_CHANNELS];
+  uint32_t seen = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    if (!servo_move_valid(targets[i].channel, targets[i].angle, type, max_velocity, max_accel)
+        || (seen & (1U << targets[i].channel))) {
+      return STATUS_CODE_INVALID_ARGS;
+    }
+    seen |= 1U << targets[i].channel;
+
+    cmds[i] = servo_move_cmd(targets[i].channel, targets[i].angle, type, max_velocity, max_accel);
+    cmds[i].group_left = (uint8_t)(n - 1 - i);
+  }
+
+  // one run in the queue, the motion thread starts every axis in the same frame
+  return servo_push(cmds, (uint32_t)n);
 }
 
 StatusCode servo_move_smooth(ServoChannel channel, float angle,
                              float angular_velocity)
 {
+  return servo_move_profile(channel, angle, SERVO_PROFILE_TRAPEZOID, angular_velocity,
+                            SERVO_SMOOTH_ACCEL_DEG_S2);
+}
 
-  if ((angular_velocity <= 0) || (channel < 0) || (channel >= NUM_SERVO_CHANNELS)) {
-    return STATUS_CODE_INVALID_ARGS;
+static StatusCode servo_anim_queue(ServoClip *clip, const ServoAnimParams *params)
+{
+  clip->time_scale = params->time_scale;
+  clip->loop = params->loop;
+
+  ServoCmd cmd = {.type = SERVO_CMD_ANIM, .blend_s = params->blend_s, .clip = clip};
+
+  StatusCode ret = servo_push(&cmd, 1);
+  if (ret != STATUS_CODE_OK) {
+    servo_clip_unmap(clip);
   }
 
-  if (angle == servo[channel].current_angle) {
-    printf("Already at target");
-    return STATUS_CODE_OK;
+  return ret;
+}
+
+StatusCode servo_play_animation(const char *path)
+{
+  if (initialized == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
   }
 
-  servo[channel].channel = channel;
-  servo[channel].isRunning = true;
-  servo[channel].target_angle = angle;
-  servo[channel].step = angular_velocity / SERVO_THREAD_FREQ_HZ;
+  if (!path) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  ServoClip *clip;
+  TRY(servo_clip_load(path, &clip));
 
-  if (servo[channel].target_angle < servo[channel].current_angle) {
-    servo[channel].step *= -1;
+  ServoAnimParams params = {
+    .time_scale = 1.0f,
+    .blend_s = SERVO_ANIM_BLEND_S,
+    .loop = (clip->hdr->flags & SERVO_ANIM_FLAG_LOOP) != 0,
+  };
+
+  return servo_anim_queue(clip, &params);
+}
+
+StatusCode servo_play_animation_params(const char *path, const ServoAnimParams *params)
+{
+  if (initialized == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
   }
 
-  if (!servo_thread_running) {
-    servo_thread_running = true;
-    int ret = pthread_create(&servo_thread, NULL, servo_thread_func, NULL);
-    if (ret != 0) {
-      servo[channel].isRunning = false;
-      servo_thread_running = false;
-      return STATUS_CODE_THREAD_FAILURE;
-    }
+  if (!path || !params || !(params->time_scale > 0.0f) || !(params->blend_s >= 0.0f)) {
+    return STATUS_CODE_INVALID_ARGS;
   }
 
-  return STATUS_CODE_OK;
-}
\ No newline at end of file
+  ServoClip *clip;
+  TRY(servo_clip_load(path, &clip));
+
+  return servo_anim_queue(clip, params);
+}
+
+StatusCode servo_stop_animation()
+{
+  if (initialized == 0) {
+    return STATUS_CODE_NOT_INITIALIZED;
+  }
+
+  ServoCmd cmd = {.type = SERVO_CMD_ANIM, .clip = NULL};
+
+  return servo_push(&cmd, 1);
+}
@@ -0,0 +1,819 @@
+#include "sim_devices.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cm4_gpio_sim.h"
+#include "cm4_i2c_sim.h"
+#include "cm4_time.h"
+#include "currentsense.h"
+#include "irled.h"
+#include "pwm_controller.h"
+
+// ================================
+// PCA9685
+// ================================
+#define PCA_LED_LAST_REG    0x45 /*LED15_OFF_H*/
+#define PCA_PRE_SCALE_MIN   3
+#define PCA_POR_PRE_SCALE   0x1E
+
+typedef struct {
+  uint8_t regs[256];
+  uint8_t ptr;
+  pthread_mutex_t mutex;
+} SimPca9685;
+
+// ================================
+// INA219
+// ================================
+#define INA_POR_CONFIG      0x399F
+#define INA_NUM_REGS        6
+#define INA_SHUNT_LSB_V     10e-6f
+#define INA_BUS_LSB_V       4e-3f
+#define INA_BUS_CNVR        (1U << 1)
+#define INA_BUS_OVF         (1U << 0)
+
+typedef struct {
+  uint16_t config;
+  uint16_t cal;
+  uint8_t ptr;
+  float current_a;
+  float bus_v;
+  uint64_t config_ns;
+  uint64_t conversions_seen;
+  pthread_mutex_t mutex;
+} SimIna219;
+
+// ================================
+// MAX30102
+// ================================
+#define MX_ADC_MAX          0x3FFFF
+#define MX_IS1_PWR_RDY      (1U << 0)
+#define MX_IS2_TEMP_RDY     (1U << 1)
+#define MX_MODE_SHDN        (1U << 7)
+#define MX_DIE_TEMP_EN      (1U << 0)
+#define MX_AMBIENT_COUNTS   400.0f
+#define MX_IR_DC_COUNTS     120000.0f /*at the 0x3C pulse amplitude and 4096 nA range*/
+#define MX_RED_DC_COUNTS    90000.0f
+#define MX_IR_PERFUSION     0.01f
+#define MX_NOISE_COUNTS     24
+
+typedef struct {
+  uint8_t regs[256];
+  uint8_t ptr;
+  uint32_t fifo[MX_FIFO_DEPTH][2]; // LED1 (red) then LED2 (ir), as clocked out
+  uint8_t fifo_count;
+  uint8_t byte_offset;
+  uint64_t next_sample_ns;
+  uint64_t sample_index;
+  int int_level;
+  int int_pin;
+  float bpm;
+  float spo2_pct;
+  bool finger_present;
+  float pulse_delay_s;
+  uint32_t noise_seed;
+  int thread_started;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} SimMax30102;
+
+static SimPca9685 s_pca[SIM_PCA_NUM_DEVICES] = {
+  {.mutex = PTHREAD_MUTEX_INITIALIZER},
+  {.mutex = PTHREAD_MUTEX_INITIALIZER},
+};
+static const uint8_t s_pca_addrs[SIM_PCA_NUM_DEVICES] = {PCA_I2C_ADDR, SIM_PCA2_I2C_ADDR};
+static SimIna219 s_ina = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+static SimMax30102 s_mx[SIM_MX_NUM_DEVICES] = {
+  {
+    .mutex = PTHREAD_MUTEX_INITIALIZER, .int_pin = INT_PIN_1, .bpm = SIM_MX_DEFAULT_BPM,
+    .spo2_pct = SIM_MX_DEFAULT_SPO2_PCT, .finger_present = true,
+  },
+  {
+    .mutex = PTHREAD_MUTEX_INITIALIZER, .int_pin = INT_PIN_2, .bpm = SIM_MX_DEFAULT_BPM,
+    .spo2_pct = SIM_MX_DEFAULT_SPO2_PCT, .finger_present = true,
+  },
+};
+static const I2cBus s_mx_buses[SIM_MX_NUM_DEVICES] = {I2C_BUS_2, I2C_BUS_1};
+static pthread_once_t s_mx_once = PTHREAD_ONCE_INIT;
+
+// ================================
+// PCA9685 model
+// ================================
+static void pca_reset(SimPca9685 *pca)
+{
+  memset(pca->regs, 0, sizeof(pca->regs));
+  pca->regs[PCA_MODE1] = MODE1_SLEEP | MODE1_ALLCALL;
+  pca->regs[PCA_MODE2] = MODE2_OUTDRV;
+  pca->regs[PCA_SUBADR1] = 0xE2;
+  pca->regs[PCA_SUBADR2] = 0xE4;
+  pca->regs[PCA_SUBADR3] = 0xE8;
+  pca->regs[PCA_ALLCALLADR] = 0xE0;
+  pca->regs[PCA_PRE_SCALE] = PCA_POR_PRE_SCALE;
+
+  for (int ch = 0; ch < SIM_PCA_NUM_CHANNELS; ch++) {
+    pca->regs[PCA_LED0_ON_L + 4 * ch + 3] = LEDX_FULL_OFF;
+  }
+
+  pca->ptr = 0;
+}
+
+static bool pca_any_output_active(const SimPca9685 *pca)
+{
+  for (int ch = 0; ch < SIM_PCA_NUM_CHANNELS; ch++) {
+    if (!(pca->regs[PCA_LED0_ON_L + 4 * ch + 3] & LEDX_FULL_OFF)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void pca_write_reg(SimPca9685 *pca, uint8_t reg, uint8_t val)
+{
+  if (reg == PCA_MODE1) {
+    uint8_t old = pca->regs[PCA_MODE1];
+    uint8_t restart = old & MODE1_RESTART;
+
+    // writing 1 to RESTART clears it, going to sleep with outputs running sets it
+    if (val & MODE1_RESTART) {
+      restart = 0;
+    }
+    if ((val & MODE1_SLEEP) && !(old & MODE1_SLEEP) && pca_any_output_active(pca)) {
+      restart = MODE1_RESTART;
+    }
+
+    pca->regs[PCA_MODE1] = (val & ~MODE1_RESTART) | restart;
+  }
+  else if (reg == PCA_PRE_SCALE) {
+    // the prescaler can only be written while the oscillator is off
+    if (pca->regs[PCA_MODE1] & MODE1_SLEEP) {
+      pca->regs[PCA_PRE_SCALE] = (val < PCA_PRE_SCALE_MIN) ? PCA_PRE_SCALE_MIN : val;
+    }
+  }
+  else if ((reg >= PCA_ALL_LED_ON_L) && (reg <= PCA_ALL_LED_OFF_H)) {
+    // broadcast to every channel, the ALL_LED registers themselves read back 0
+    for (int ch = 0; ch < SIM_PCA_NUM_CHANNELS; ch++) {
+      pca->regs[PCA_LED0_ON_L + 4 * ch + (reg - PCA_ALL_LED_ON_L)] = val;
+    }
+  }
+  else if ((reg > PCA_LED_LAST_REG) && (reg < PCA_ALL_LED_ON_L)) {
+    // reserved
+  }
+  else {
+    pca->regs[reg] = val;
+  }
+}
+
+static void pca_advance(SimPca9685 *pca)
+{
+  if (pca->regs[PCA_MODE1] & MODE1_AI) {
+    // auto increment past LED15_OFF_H wraps to MODE1
+    pca->ptr = (pca->ptr == PCA_LED_LAST_REG) ? PCA_MODE1 : (uint8_t)(pca->ptr + 1);
+  }
+}
+
+static StatusCode pca_dev_write(void *ctx, const uint8_t *buf, uint16_t len)
+{
+  SimPca9685 *pca = ctx;
+
+  pthread_mutex_lock(&pca->mutex);
+  pca->ptr = buf[0];
+  for (uint16_t i = 1; i < len; i++) {
+    pca_write_reg(pca, pca->ptr, buf[i]);
+    pca_advance(pca);
+  }
+  pthread_mutex_unlock(&pca->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+static StatusCode pca_dev_read(void *ctx, uint8_t *buf, uint16_t len)
+{
+  SimPca9685 *pca = ctx;
+
+  pthread_mutex_lock(&pca->mutex);
+  for (uint16_t i = 0; i < len; i++) {
+    uint8_t reg = pca->ptr;
+    bool write_only = (reg >= PCA_ALL_LED_ON_L) && (reg <= PCA_ALL_LED_OFF_H);
+    buf[i] = write_only ? 0 : pca->regs[reg];
+    pca_advance(pca);
+  }
+  pthread_mutex_unlock(&pca->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+// ================================
+// INA219 model
+// ================================
+static uint64_t ina_adc_conv_ns(uint8_t adc)
+{
+  static const uint32_t resolution_ns[4] = {84000, 148000, 276000, 532000};
+
+  if (!(adc & 0x8)) {
+    return resolution_ns[adc & 0x3];
+  }
+
+  // 12 bit samples averaged 2^n times
+  return (uint64_t)resolution_ns[3] << (adc & 0x7);
+}
+
+static uint64_t ina_conv_ns(uint16_t config)
+{
+  uint8_t mode = config & CONFIG_MODE;
+  uint64_t conv_ns = 0;
+
+  if ((mode == 0) || (mode == 4)) {
+    return 0;
+  }
+  if (mode & 0x1) {
+    conv_ns += ina_adc_conv_ns((config >> 3) & 0xF);
+  }
+  if (mode & 0x2) {
+    conv_ns += ina_adc_conv_ns((config >> 7) & 0xF);
+  }
+
+  return conv_ns;
+}
+
+static uint64_t ina_conversions(const SimIna219 *ina, uint64_t now)
+{
+  uint64_t conv_ns = ina_conv_ns(ina->config);
+  if (conv_ns == 0) {
+    return 0;
+  }
+
+  uint64_t n = (now - ina->config_ns) / conv_ns;
+
+  // triggered modes convert once per config write
+  if (!(ina->config & 0x4) && (n > 1)) {
+    n = 1;
+  }
+
+  return n;
+}
+
+static void ina_reset(SimIna219 *ina)
+{
+  ina->config = INA_POR_CONFIG;
+  ina->cal = 0;
+  ina->ptr = 0;
+  ina->config_ns = time_now_ns();
+  ina->conversions_seen = 0;
+}
+
+static uint16_t ina_read_reg(SimIna219 *ina, uint8_t reg)
+{
+  uint64_t conversions = ina_conversions(ina, time_now_ns());
+
+  if (reg == INA_CONFIGURATION) {
+    return ina->config;
+  }
+  if (reg == INA_CALIBRATION) {
+    return ina->cal;
+  }
+  if ((reg >= INA_NUM_REGS) || (conversions == 0)) {
+    return 0;
+  }
+
+  // PGA /1, /2, /4, /8 is +-40 mV to +-320 mV of 10 uV counts
+  int32_t shunt_max = 4000 << ((ina->config >> 11) & 0x3);
+  int32_t shunt = (int32_t)lrintf(ina->current_a * SIM_INA_R_SHUNT_OHMS / INA_SHUNT_LSB_V);
+  bool ovf = false;
+  if (shunt > shunt_max) {
+    shunt = shunt_max;
+    ovf = true;
+  }
+  else if (shunt < -shunt_max) {
+    shunt = -shunt_max;
+    ovf = true;
+  }
+
+  int32_t bus_max = (ina->config & CONFIG_BRNG) ? 8000 : 4000;
+  int32_t bus = (int32_t)lrintf(ina->bus_v / INA_BUS_LSB_V);
+  if (bus < 0) {
+    bus = 0;
+  }
+  else if (bus > bus_max) {
+    bus = bus_max;
+  }
+
+  int32_t current = (shunt * (int32_t)ina->cal) / 4096;
+  int32_t power = (current * bus) / 5000;
+
+  switch (reg) {
+    case INA_SHUNT_VOLTAGE:
+      return (uint16_t)(int16_t)shunt;
+    case INA_BUS_VOLTAGE:
+      return (uint16_t)((bus << 3) | ((conversions > ina->conversions_seen) ? INA_BUS_CNVR : 0)
+                        | (ovf ? INA_BUS_OVF : 0));
+    case INA_POWER:
+      // reading power acknowledges the conversion ready flag
+      ina->conversions_seen = conversions;
+      return (uint16_t)((power < 0) ? -power : power);
+    case INA_CURRENT:
+      return (uint16_t)(int16_t)current;
+    default:
+      return 0;
+  }
+}
+
+static StatusCode ina_dev_write(void *ctx, const uint8_t *buf, uint16_t len)
+{
+  SimIna219 *ina = ctx;
+
+  pthread_mutex_lock(&ina->mutex);
+  ina->ptr = buf[0];
+
+  if (len >= 3) {
+    uint16_t val = (uint16_t)(buf[1] << 8 | buf[2]);
+
+    if (ina->ptr == INA_CONFIGURATION) {
+      if (val & CONFIG_RST) {
+        ina_reset(ina);
+      }
+      else {
+        ina->config = val;
+        ina->config_ns = time_now_ns();
+        ina->conversions_seen = 0;
+      }
+    }
+    else if (ina->ptr == INA_CALIBRATION) {
+      // bit 0 of the calibration register is always 0
+      ina->cal = val & 0xFFFE;
+    }
+  }
+  pthread_mutex_unlock(&ina->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+static StatusCode ina_dev_read(void *ctx, uint8_t *buf, uint16_t len)
+{
+  SimIna219 *ina = ctx;
+
+  // the pointer does not auto increment, longer reads repeat the register
+  pthread_mutex_lock(&ina->mutex);
+  uint16_t val = ina_read_reg(ina, ina->ptr);
+  for (uint16_t i = 0; i < len; i++) {
+    buf[i] = (i % 2 == 0) ? (uint8_t)(val >> 8) : (uint8_t)(val & 0xFF);
+  }
+  pthread_mutex_unlock(&ina->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+// ================================
+// MAX30102 model
+// ================================
+static bool mx_running(const SimMax30102 *mx)
+{
+  uint8_t mode = mx->regs[MX_MODE_CONFIG];
+  uint8_t led_mode = mode & 0x7;
+
+  return !(mode & MX_MODE_SHDN) && ((led_mode == 0x2) || (led_mode == 0x3) || (led_mode == 0x7));
+}
+
+static uint8_t mx_num_leds(const SimMax30102 *mx)
+{
+  return ((mx->regs[MX_MODE_CONFIG] & 0x7) == 0x2) ? 1 : 2;
+}
+
+static uint64_t mx_sample_period_ns(const SimMax30102 *mx)
+{
+  static const uint32_t rates_hz[8] = {50, 100, 200, 400, 800, 1000, 1600, 3200};
+
+  uint32_t rate = rates_hz[(mx->regs[MX_SPO2_CONFIG] >> 2) & 0x7];
+  uint32_t avg_shift = (mx->regs[MX_FIFO_CONFIG] >> 5) & 0x7;
+  if (avg_shift > 5) {
+    avg_shift = 5;
+  }
+
+  return (1000000000ULL << avg_shift) / rate;
+}
+
+static void mx_reset(SimMax30102 *mx)
+{
+  memset(mx->regs, 0, sizeof(mx->regs));
+  mx->regs[MX_PART_ID] = SIM_MX_PART_ID;
+  mx->regs[MX_REV_ID] = SIM_MX_REV_ID;
+  mx->ptr = 0;
+  mx->fifo_count = 0;
+  mx->byte_offset = 0;
+  mx->sample_index = 0;
+}
+
+static void mx_update_int(SimMax30102 *mx)
+{
+  // INT is open drain and active low, power ready cannot be masked
+  bool pending = (mx->regs[MX_IS1] & (mx->regs[MX_IE1] | MX_IS1_PWR_RDY))
+                 || (mx->regs[MX_IS2] & mx->regs[MX_IE2]);
+  int level = pending ? 0 : 1;
+
+  if (level != mx->int_level) {
+    mx->int_level = level;
+    gpio_sim_drive_input(mx->int_pin, level);
+  }
+}
+
+static uint32_t mx_led_counts(SimMax30102 *mx, float dc, float ac_frac, float pulse,
+                              uint8_t amp)
+{
+  // photocurrent scales with LED current, counts with the inverse of the ADC range
+  float range_scale = 4096.0f / (float)(2048 << ((mx->regs[MX_SPO2_CONFIG] >> 5) & 0x3));
+  float counts = MX_AMBIENT_COUNTS;
+
+  if (mx->finger_present) {
+    counts = dc * ((float)amp / 0x3C) * range_scale * (1.0f - ac_frac * pulse);
+  }
+
+  mx->noise_seed = mx->noise_seed * 1664525U + 1013904223U;
+  counts += (float)((int32_t)(mx->noise_seed >> 24) % MX_NOISE_COUNTS) - MX_NOISE_COUNTS / 2;
+
+  if (counts < 0.0f) {
+    counts = 0.0f;
+  }
+  if (counts > (float)MX_ADC_MAX) {
+    counts = (float)MX_ADC_MAX;
+  }
+
+  // narrower pulse widths give fewer bits, left justified in the 18 bit word
+  uint32_t drop_bits = 3 - (mx->regs[MX_SPO2_CONFIG] & 0x3);
+  return (uint32_t)counts & ~((1U << drop_bits) - 1);
+}
+
+static void mx_push_sample(SimMax30102 *mx)
+{
+  // the pulse runs on the shared clock so two sensors see the same heartbeat, pulse_delay_s
+  // further along the arteries
+  double t = (double)mx->next_sample_ns * 1e-9 - mx->pulse_delay_s;
+  float phase = (float)fmod(t * mx->bpm / 60.0, 1.0);
+
+  // fast systolic rise, slower decay with a dicrotic bump, roughly zero mean
+  float pulse = 0.7f * sinf(2.0f * (float)M_PI * phase)
+                + 0.3f * sinf(4.0f * (float)M_PI * phase - 0.6f);
+
+  // SpO2 = 110 - 25 R, with R the red over ir ratio of AC/DC
+  float ratio = (110.0f - mx->spo2_pct) / 25.0f;
+
+  uint32_t red = mx_led_counts(mx, MX_RED_DC_COUNTS, MX_IR_PERFUSION * ratio, pulse,
+                               mx->regs[MX_LED1_PULSE_AMP]);
+  uint32_t ir = mx_led_counts(mx, MX_IR_DC_COUNTS, MX_IR_PERFUSION, pulse,
+                              mx->regs[MX_LED2_PULSE_AMP]);
+  mx->sample_index++;
+
+  uint8_t ovf = mx->regs[MX_OVF_COUNTER];
+  if (mx->fifo_count == MX_FIFO_DEPTH) {
+    mx->regs[MX_OVF_COUNTER] = (ovf < 0x1F) ? ovf + 1 : ovf;
+    if (!(mx->regs[MX_FIFO_CONFIG] & FIFO_CONFIG_ROLLOVER_EN)) {
+      return;
+    }
+    // rollover overwrites the oldest sample
+    mx->regs[MX_FIFO_RD_PTR] = (mx->regs[MX_FIFO_RD_PTR] + 1) & 0x1F;
+    mx->byte_offset = 0;
+    mx->fifo_count--;
+  }
+
+  uint8_t wr = mx->regs[MX_FIFO_WR_PTR];
+  mx->fifo[wr][0] = red;
+  mx->fifo[wr][1] = ir;
+  mx->regs[MX_FIFO_WR_PTR] = (wr + 1) & 0x1F;
+  mx->fifo_count++;
+
+  mx->regs[MX_IS1] |= IS1_PPG_RDY;
+  if (mx->fifo_count >= MX_FIFO_DEPTH - (mx->regs[MX_FIFO_CONFIG] & 0xF)) {
+    mx->regs[MX_IS1] |= IS1_A_FULL;
+  }
+}
+
+/* Produce every sample that came due since the last access */
+static void mx_catch_up(SimMax30102 *mx, uint64_t now)
+{
+  if (!mx_running(mx)) {
+    return;
+  }
+
+  uint64_t period = mx_sample_period_ns(mx);
+
+  // after a long stall only the last fifo's worth matters, the rest overflowed
+  if (now > mx->next_sample_ns + 2 * MX_FIFO_DEPTH * period) {
+    uint64_t skipped = (now - mx->next_sample_ns) / period - MX_FIFO_DEPTH;
+    uint32_t ovf = mx->regs[MX_OVF_COUNTER] + (uint32_t)((skipped < 0x1F) ? skipped : 0x1F);
+    mx->regs[MX_OVF_COUNTER] = (ovf < 0x1F) ? (uint8_t)ovf : 0x1F;
+    mx->sample_index += skipped;
+    mx->next_sample_ns += skipped * period;
+  }
+
+  while (mx->next_sample_ns <= now) {
+    mx_push_sample(mx);
+    mx->next_sample_ns += period;
+  }
+}
+
+static uint8_t mx_read_fifo_byte(SimMax30102 *mx)
+{
+  if (mx->fifo_count == 0) {
+    return 0;
+  }
+
+  uint8_t rd = mx->regs[MX_FIFO_RD_PTR];
+  uint32_t val = mx->fifo[rd][mx->byte_offset / 3];
+  uint8_t byte = (uint8_t)(val >> (16 - 8 * (mx->byte_offset % 3)));
+
+  if (mx->byte_offset % 3 == 0) {
+    byte &= 0x03;
+  }
+
+  if (++mx->byte_offset == 3 * mx_num_leds(mx)) {
+    // popping a whole sample clears the overflow count
+    mx->byte_offset = 0;
+    mx->regs[MX_FIFO_RD_PTR] = (rd + 1) & 0x1F;
+    mx->regs[MX_OVF_COUNTER] = 0;
+    mx->fifo_count--;
+  }
+
+  return byte;
+}
+
+static void mx_write_reg(SimMax30102 *mx, uint8_t reg, uint8_t val)
+{
+  switch (reg) {
+    case MX_IS1:
+    case MX_IS2:
+    case MX_DIE_TEMP_INT:
+    case MX_DIE_TEMP_FRAC:
+    case MX_REV_ID:
+    case MX_PART_ID:
+      // read only
+      break;
+    case MX_FIFO_WR_PTR:
+    case MX_FIFO_RD_PTR:
+      mx->regs[reg] = val & 0x1F;
+      mx->fifo_count = (mx->regs[MX_FIFO_WR_PTR] - mx->regs[MX_FIFO_RD_PTR]) & 0x1F;
+      mx->byte_offset = 0;
+      break;
+    case MX_OVF_COUNTER:
+      mx->regs[reg] = val & 0x1F;
+      break;
+    case MX_MODE_CONFIG: {
+      if (val & MODE_CONFIG_RESET) {
+        // the reset bit clears itself once the reset completes
+        mx_reset(mx);
+        break;
+      }
+
+      bool was_running = mx_running(mx);
+      mx->regs[reg] = val;
+      if (!was_running && mx_running(mx)) {
+        mx->next_sample_ns = time_now_ns() + mx_sample_period_ns(mx);
+        pthread_cond_signal(&mx->cond);
+      }
+      break;
+    }
+    case MX_DIE_TEMP_CFG:
+      if (val & MX_DIE_TEMP_EN) {
+        mx->regs[MX_DIE_TEMP_INT] = 30;
+        mx->regs[MX_DIE_TEMP_FRAC] = 8; /*0.5 C in 1/16 steps*/
+        mx->regs[MX_IS2] |= MX_IS2_TEMP_RDY;
+      }
+      break;
+    default:
+      mx->regs[reg] = val;
+      break;
+  }
+}
+
+static StatusCode mx_dev_write(void *ctx, const uint8_t *buf, uint16_t len)
+{
+  SimMax30102 *mx = ctx;
+
+  pthread_mutex_lock(&mx->mutex);
+  mx_catch_up(mx, time_now_ns());
+  mx->ptr = buf[0];
+  for (uint16_t i = 1; i < len; i++) {
+    mx_write_reg(mx, mx->ptr, buf[i]);
+    if (mx->ptr != MX_FIFO_DATA) {
+      mx->ptr++;
+    }
+  }
+  mx_update_int(mx);
+  pthread_mutex_unlock(&mx->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+static StatusCode mx_dev_read(void *ctx, uint8_t *buf, uint16_t len)
+{
+  SimMax30102 *mx = ctx;
+
+  pthread_mutex_lock(&mx->mutex);
+  mx_catch_up(mx, time_now_ns());
+  for (uint16_t i = 0; i < len; i++) {
+    if (mx->ptr == MX_FIFO_DATA) {
+      buf[i] = mx_read_fifo_byte(mx);
+      continue;
+    }
+
+    buf[i] = mx->regs[mx->ptr];
+    if ((mx->ptr == MX_IS1) || (mx->ptr == MX_IS2)) {
+      // interrupt status clears on read
+      mx->regs[mx->ptr] = 0;
+    }
+    mx->ptr++;
+  }
+  mx_update_int(mx);
+  pthread_mutex_unlock(&mx->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+/* Keeps the fifo filling and INT up to date while nobody is talking to the chip */
+static void *mx_thread_func(void *arg)
+{
+  SimMax30102 *mx = arg;
+
+  pthread_mutex_lock(&mx->mutex);
+  for (;;) {
+    if (!mx_running(mx)) {
+      pthread_cond_wait(&mx->cond, &mx->mutex);
+      continue;
+    }
+
+    mx_catch_up(mx, time_now_ns());
+    mx_update_int(mx);
+
+    struct timespec until = {
+      .tv_sec = (time_t)(mx->next_sample_ns / 1000000000ULL),
+      .tv_nsec = (long)(mx->next_sample_ns % 1000000000ULL)
+    };
+    pthread_cond_timedwait(&mx->cond, &mx->mutex, &until);
+  }
+
+  return NULL;
+}
+
+static void mx_init_once(void)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+  for (int i = 0; i < SIM_MX_NUM_DEVICES; i++) {
+    SimMax30102 *mx = &s_mx[i];
+
+    pthread_cond_init(&mx->cond, &attr);
+    mx->noise_seed = 0x30102 + (uint32_t)i;
+    mx->thread_started = (pthread_create(&mx->thread, NULL, mx_thread_func, mx) == 0);
+    if (mx->thread_started) {
+      pthread_detach(mx->thread);
+    }
+    else {
+      printf("Failed to create MAX30102 sim thread\n");
+    }
+  }
+
+  pthread_condattr_destroy(&attr);
+}
+
+// ================================
+// Public
+// ================================
+StatusCode sim_devices_attach_defaults(void)
+{
+  pthread_once(&s_mx_once, mx_init_once);
+
+  for (int i = 0; i < SIM_PCA_NUM_DEVICES; i++) {
+    pthread_mutex_lock(&s_pca[i].mutex);
+    pca_reset(&s_pca[i]);
+    pthread_mutex_unlock(&s_pca[i].mutex);
+
+    I2cSimDevice pca_dev = {
+      .name = "PCA9685", .addr = s_pca_addrs[i], .ctx = &s_pca[i],
+      .write = pca_dev_write, .read = pca_dev_read,
+    };
+    TRY(i2c_sim_attach(I2C_BUS_2, &pca_dev));
+  }
+
+  pthread_mutex_lock(&s_ina.mutex);
+  ina_reset(&s_ina);
+  pthread_mutex_unlock(&s_ina.mutex);
+
+  for (int i = 0; i < SIM_MX_NUM_DEVICES; i++) {
+    pthread_mutex_lock(&s_mx[i].mutex);
+    mx_reset(&s_mx[i]);
+    s_mx[i].regs[MX_IS1] = MX_IS1_PWR_RDY;
+    s_mx[i].int_level = -1;
+    mx_update_int(&s_mx[i]);
+    pthread_mutex_unlock(&s_mx[i].mutex);
+  }
+
+  I2cSimDevice ina_dev = {
+    .name = "INA219", .addr = INA_I2C_ADDRESS, .ctx = &s_ina,
+    .write = ina_dev_write, .read = ina_dev_read,
+  };
+  TRY(i2c_sim_attach(I2C_BUS_2, &ina_dev));
+
+  // the address is fixed, the second sensor has a bus of its own
+  for (int i = 0; i < SIM_MX_NUM_DEVICES; i++) {
+    I2cSimDevice mx_dev = {
+      .name = "MAX30102", .addr = MX_I2C_ADDR, .ctx = &s_mx[i],
+      .write = mx_dev_write, .read = mx_dev_read,
+    };
+    TRY(i2c_sim_attach(s_mx_buses[i], &mx_dev));
+  }
+
+  return STATUS_CODE_OK;
+}
+
+__attribute__((constructor)) static void sim_devices_load(void)
+{
+  sim_devices_attach_defaults();
+}
+
+StatusCode sim_pca9685_get_channel(uint8_t channel, uint16_t *on, uint16_t *off)
+{
+  return sim_pca9685_get_dev_channel(PCA_I2C_ADDR, channel, on, off);
+}
+
+StatusCode sim_pca9685_get_dev_channel(uint8_t addr, uint8_t channel, uint16_t *on, uint16_t *off)
+{
+  SimPca9685 *pca = NULL;
+
+  for (int i = 0; i < SIM_PCA_NUM_DEVICES; i++) {
+    if (s_pca_addrs[i] == addr) {
+      pca = &s_pca[i];
+    }
+  }
+
+  if (!pca || (channel >= SIM_PCA_NUM_CHANNELS) || !on || !off) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  const uint8_t *led = &pca->regs[PCA_LED0_ON_L + 4 * channel];
+
+  pthread_mutex_lock(&pca->mutex);
+  *on = (uint16_t)(led[1] << 8 | led[0]);
+  *off = (uint16_t)(led[3] << 8 | led[2]);
+  pthread_mutex_unlock(&pca->mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode sim_pca9685_get_freq_hz(float *freq_hz)
+{
+  if (!freq_hz) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  pthread_mutex_lock(&s_pca[0].mutex);
+  *freq_hz = (float)SIM_PCA_OSC_HZ / (PWM_RESOLUTION * (s_pca[0].regs[PCA_PRE_SCALE] + 1.0f));
+  pthread_mutex_unlock(&s_pca[0].mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode sim_ina219_set_load(float current_a, float bus_v)
+{
+  pthread_mutex_lock(&s_ina.mutex);
+  s_ina.current_a = current_a;
+  s_ina.bus_v = bus_v;
+  pthread_mutex_unlock(&s_ina.mutex);
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode sim_max30102_set_ppg(float bpm, float spo2_pct, bool finger_present)
+{
+  if ((bpm <= 0.0f) || (spo2_pct < 0.0f) || (spo2_pct > 100.0f)) {
+    return STATUS_CODE_INVALID_ARGS;
+  }
+
+  for (int i = 0; i < SIM_MX_NUM_DEVICES; i++) {
+    pthread_mutex_lock(&s_mx[i].mutex);
+    s_mx[i].bpm = bpm;
+    s_mx[i].spo2_pct = spo2_pct;
+    s_mx[i].finger_present = finger_present;
+    pthread_mutex_unlock(&s_mx[i].mutex);
+  }
+
+  return STATUS_CODE_OK;
+}
+
+StatusCode sim_max30102_set_pulse_delay(I2cBus i2c_bus, float delay_s)
+{
+  for (int i = 0; i < SIM_MX_NUM_DEVICES; i++) {
+    if (s_mx_buses[i] == i2c_bus) {
+      pthread_mutex_lock(&s_mx[i].mutex);
+      s_mx[i].pulse_delay_s = delay_s;
+      pthread_mutex_unlock(&s_mx[i].mutex);
+      return STATUS_CODE_OK;
+    }
+  }
+
+  return STATUS_CODE_INVALID_ARGS;
+}
@@ -1,6 +1,6 @@
 import ctypes
 import os
-from ctypes import c_int, c_uint8, c_int32, c_float, c_double, c_char_p, c_size_t, POINTER
+from ctypes import c_int, c_uint8, c_uint16, c_uint32, c_uint64, c_int32, c_float, c_double, c_bool, c_char_p, c_size_t, POINTER
 import platform
 
 _here = os.path.dirname(os.path.abspath(__file__))
@@ -108,6 +108,22 @@ _irled_pop_sample = lib.irled_pop_sample
 _irled_pop_sample.argtypes = [POINTER(Max30102Sample)]
 _irled_pop_sample.restype = c_int
 
+_irled_pop_samples = lib.irled_pop_samples
+_irled_pop_samples.argtypes = [POINTER(Max30102Sample), ctypes.c_uint16, c_int]
+_irled_pop_samples.restype = c_int
+
+_irled_get_bpm = lib.irled_get_bpm
+_irled_get_bpm.argtypes = [POINTER(c_int), POINTER(c_int)]
+_irled_get_bpm.restype = c_int
+
+_irled_get_spo2 = lib.irled_get_spo2
+_irled_get_spo2.argtypes = [POINTER(c_float)]
+_irled_get_spo2.restype = c_int
+
+_irled_get_presence = lib.irled_get_presence
+_irled_get_presence.argtypes = [POINTER(c_bool)]
+_irled_get_presence.restype = c_int
+
 _currentsense_init = lib.currentsense_init
 _currentsense_init.argtypes = []
 _currentsense_init.restype = c_int
@@ -116,6 +132,79 @@ _currentsense_read = lib.currentsense_read
 _currentsense_read.argtypes = [POINTER(c_float)]
 _currentsense_read.restype = c_int
 
+CURRENTSENSE_MAX_WINDOWS = 4
+
+class CurrentSenseSample(ctypes.Structure):
+    _fields_ = [
+        ("timestamp_ns", c_uint64),
+        ("current_a", c_float),
+        ("shunt_v", c_float),
+        ("bus_v", c_float),
+        ("power_w", c_float),
+        ("overflow", c_bool),
+    ]
+
+class CurrentSenseStat(ctypes.Structure):
+    _fields_ = [
+        ("min", c_float),
+        ("max", c_float),
+        ("mean", c_float),
+        ("rms", c_float),
+    ]
+
+class CurrentSenseWindowStats(ctypes.Structure):
+    _fields_ = [
+        ("window_ms", c_uint32),
+        ("samples", c_uint32),
+        ("current_a", CurrentSenseStat),
+        ("bus_v", CurrentSenseStat),
+        ("power_w", CurrentSenseStat),
+    ]
+
+class CurrentSenseEnergy(ctypes.Structure):
+    _fields_ = [
+        ("energy_mwh", c_double),
+        ("charge_mah", c_double),
+        ("samples", c_uint64),
+        ("start_ns", c_uint64),
+        ("end_ns", c_uint64),
+    ]
+
+class CurrentSenseStats(ctypes.Structure):
+    _fields_ = [
+        ("samples", c_uint64),
+        ("polls", c_uint64),
+        ("not_ready", c_uint64),
+        ("missed", c_uint64),
+        ("read_errors", c_uint64),
+        ("overflows", c_uint64),
+        ("pop_dropped", c_uint64),
+        ("conversion_us", c_uint32),
+        ("rate_hz", c_float),
+        ("num_windows", c_uint32),
+        ("windows", CurrentSenseWindowStats * CURRENTSENSE_MAX_WINDOWS),
+    ]
+
+_currentsense_start_sampling = lib.currentsense_start_sampling
+_currentsense_start_sampling.argtypes = []
+_currentsense_start_sampling.restype = c_int
+
+_currentsense_stop_sampling = lib.currentsense_stop_sampling
+_currentsense_stop_sampling.argtypes = []
+_currentsense_stop_sampling.restype = c_int
+
+_currentsense_pop_samples = lib.currentsense_pop_samples
+_currentsense_pop_samples.argtypes = [POINTER(CurrentSenseSample), c_uint16, c_int]
+_currentsense_pop_samples.restype = c_int
+
+_currentsense_get_stats = lib.currentsense_get_stats
+_currentsense_get_stats.argtypes = [POINTER(CurrentSenseStats), c_int]
+_currentsense_get_stats.restype = c_int
+
+_currentsense_get_energy = lib.currentsense_get_energy
+_currentsense_get_energy.argtypes = [POINTER(CurrentSenseEnergy), c_int]
+_currentsense_get_energy.restype = c_int
+
 _i2s_init = lib.i2s_init
 _i2s_init.argtypes = []
 _i2s_init.restype = c_int
@@ -1,6 +1,8 @@
 import clib
 import time
-from ctypes import c_int, c_float, byref
+from ctypes import c_int, byref
+
+POP_BATCH = 1024
 
 def main():
     
@@ -24,19 +26,48 @@ def main():
     else:
         print("_currentsense_init() success")
     
+    ret = clib._currentsense_start_sampling()
+    if ret != 0:
+        print("_currentsense_start_sampling() failed")
+    else:
+        print("_currentsense_start_sampling() success")
+
+    samples = (clib.CurrentSenseSample * POP_BATCH)()
+    stats = clib.CurrentSenseStats()
+    energy = clib.CurrentSenseEnergy()
     try:
         while(True):
-            reading = c_float()
-            clib._currentsense_read(byref(reading))
-            print(f"Current reading: {reading.value}")
             time.sleep(1)
+
+            # every conversion is read natively, drain what arrived to find the peak
+            peak = 0.0
+            popped = 0
+            while True:
+                n = clib._currentsense_pop_samples(samples, POP_BATCH, 0)
+                if n <= 0:
+                    break
+                popped += n
+                peak = max(peak, max(samples[i].current_a for i in range(n)))
+
+            clib._currentsense_get_stats(byref(stats), 0)
+            print(f"{popped} samples at {stats.rate_hz:.0f} Hz, peak {peak:.3f} A, "
+                  f"missed {stats.missed}")
+
+            # cumulative since start, the integration runs on every conversion
+            clib._currentsense_get_energy(byref(energy), 0)
+            print(f"  used {energy.energy_mwh:.3f} mWh, {energy.charge_mah:.3f} mAh")
+            for w in stats.windows[:stats.num_windows]:
+                print(f"  {w.window_ms:>6} ms: current min {w.current_a.min:.3f} "
+                      f"max {w.current_a.max:.3f} mean {w.current_a.mean:.3f} "
+                      f"rms {w.current_a.rms:.3f} A, bus min {w.bus_v.min:.3f} V")
     except KeyboardInterrupt:
         pass
     finally:
         finish()
 
 def finish():
+    clib._currentsense_stop_sampling()
     clib._i2c_deinit(2)
 
 if __name__ == "__main__":
-    main()
\ No newline at end of file
+    main()
@@ -1,17 +1,9 @@
 import clib
 import time
-from ctypes import c_int, byref
+from ctypes import c_int, c_float, c_bool, byref
 import signal
 
-def avg_list(list_in: list):
-    sum = 0
-    for item in list_in:
-        sum += item
-    return (sum / 5) - 40
-
 def main():
-    counter = -0.075
-
     ret = clib._gpio_regs_init()
     if ret != 0:
         print("_gpio_init() failed")
@@ -38,57 +30,27 @@ def main():
     else:
         print("_irled_start_reading() success")
 
-    sample = clib.Max30102Sample()
+    bpm = c_int()
+    confidence = c_int()
+    spo2 = c_float()
+    present = c_bool()
     try:
-        idx = 0
-        ampl_list = [90, 90, 90, 90, 90]
-        running_avg = []
-        
-        
         while True:
-            ret = 0
-            val_list = []
-            min_val = 10000000
-            ret = clib._irled_pop_sample(byref(sample))
-            if ret == 0:
-                counter += 1
-            
-            while ret == 0:
-                val_list.append(sample.ir)
-                if sample.ir < min_val:
-                    min_val = sample.ir
-                ret = clib._irled_pop_sample(byref(sample))
-                        
-            # print("batch popped")
-            hb = False
-            val_num = 0
-            for val in val_list:
-                val_num += 1
-                if min_val > 10000 and val - min_val >= 100 and val - min_val < 200:
-                    if counter < 7:
-                        continue
-                    hb = True
-                    counter += (val_num/10)
-                    bpm = 60 / (counter * 0.075)
-                    
-                    running_avg.append(bpm)
-                    if len(running_avg) > 5:
-                        running_avg.pop(0)
-                    bpm_avg = 0
-                    for item in running_avg:
-                        bpm_avg += item
-                    
-                    bpm_avg /= len(running_avg)
-                    print("beat", val-min_val, ampl_list, val, counter, bpm, bpm_avg)
-                    counter = 0
-                    ampl_list[idx] = val - min_val
-                    idx += 1
-                    idx %= 5
-                    
-                    continue
-            if hb == False:
+            # beat detection and spo2 run natively in the irled hr thread
+            bpm_ret = clib._irled_get_bpm(byref(bpm), byref(confidence))
+            spo2_ret = clib._irled_get_spo2(byref(spo2))
+
+            # the sensor idles with the LEDs dimmed until a finger is on it
+            clib._irled_get_presence(byref(present))
+
+            if not present.value:
+                print("no finger")
+            elif bpm_ret == 0:
+                spo2_str = f"{spo2.value:.1f}%" if spo2_ret == 0 else "--"
+                print(f"bpm: {bpm.value} ({confidence.value}% confidence), spo2: {spo2_str}")
+            else:
                 print("...")
-            time.sleep(0.075)
+            time.sleep(1)
     except KeyboardInterrupt:
         pass
     finally:
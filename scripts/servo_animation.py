@@ -0,0 +1,100 @@
+import clib
+import struct
+import sys
+import time
+from ctypes import c_int, c_char_p
+
+# keep in sync with ServoAnimHeader in project/inc/servo.h
+ANIM_MAGIC = 0x4E415653
+ANIM_VERSION = 1
+ANIM_FLAG_LOOP = 0x1
+
+_servo_play_animation = clib.lib.servo_play_animation
+_servo_play_animation.argtypes = [c_char_p]
+_servo_play_animation.restype = c_int
+
+_servo_stop_animation = clib.lib.servo_stop_animation
+_servo_stop_animation.argtypes = []
+_servo_stop_animation.restype = c_int
+
+def _pad4(n):
+    return (n + 3) & ~3
+
+def write_animation(path, channels, keyframes, loop=False):
+    """Write a keyframe file for servo_play_animation.
+
+    channels  - servo channel driven by each track
+    keyframes - (time in seconds, [angle in degrees per track]) in time order
+    """
+    num_tracks = len(channels)
+    header = struct.pack("<IHHII", ANIM_MAGIC, ANIM_VERSION, num_tracks, len(keyframes),
+                         ANIM_FLAG_LOOP if loop else 0)
+    tracks = bytes(channels).ljust(_pad4(num_tracks), b"\0")
+    stride = _pad4(4 + 2 * num_tracks)
+
+    body = bytearray()
+    for t, angles in keyframes:
+        if len(angles) != num_tracks:
+            raise ValueError("keyframe at %.3fs has %d angles, expected %d" % (t, len(angles), num_tracks))
+        frame = struct.pack("<I%dh" % num_tracks, int(round(t * 1e6)),
+                            *[int(round(a * 100)) for a in angles])
+        body += frame.ljust(stride, b"\0")
+
+    with open(path, "wb") as f:
+        f.write(header + tracks + body)
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else "servo_rotate.anim"
+
+    # the servo_test_setpoint rotation, eased over half a second instead of jumping
+    servo_angles = [-90, -30, 30, 90]
+    keyframes = []
+    for step in range(0, 5):
+        keyframes.append((step * 1.0, servo_angles))
+        keyframes.append((step * 1.0 + 0.5, servo_angles))
+        servo_angles = servo_angles[1:] + servo_angles[:1]
+    write_animation(path, [0, 1, 2, 3], keyframes, loop=True)
+    print("wrote", path)
+
+    ret = clib._gpio_regs_init()
+    if ret != 0:
+        print("_gpio_init() failed")
+    else:
+        print("_gpio_init() success")
+
+    i2c_addr = c_int(2)
+    ret = clib._i2c_init(i2c_addr)
+    if ret != 0:
+        print("_i2c_init() failed")
+    else:
+        print("_i2c_init() success")
+
+    pwm_freq = c_int(50)
+    ret = clib._pwm_controller_init(pwm_freq)
+    if ret != 0:
+        print("_pwm_controller_init() failed")
+    else:
+        print("_pwm_controller_init() success")
+
+    clib._servo_init()
+
+    try:
+        # timing and interpolation run in the servo motion thread, nothing to do here
+        ret = _servo_play_animation(path.encode())
+        if ret != 0:
+            print("_servo_play_animation() failed")
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        finish()
+
+def finish():
+    _servo_stop_animation()
+    clib._servo_deinit()
+    clib._pwm_controller_deinit()
+    clib._i2c_deinit(2)
+
+if __name__ == "__main__":
+    main()